@@ -0,0 +1,899 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "blockdevice.h"
+
+static const char *TAG = "blockdevice";
+
+// Programs and erases let queued reads go first at most this many times
+#define SCHED_MAX_DEFER 4
+
+// ============================================================================
+// External flash
+// ============================================================================
+
+ExtFlashDevice::ExtFlashDevice()
+{
+    dev_info = {};
+    flash = NULL;
+}
+
+ExtFlashDevice::~ExtFlashDevice()
+{
+    term();
+}
+
+esp_err_t ExtFlashDevice::init(ExtFlash *flash)
+{
+    this->flash = flash;
+
+    dev_info = {};
+    dev_info.size = flash->chip_size();
+    dev_info.sector_size = flash->sector_size();
+    dev_info.erase_size = dev_info.sector_size;
+    dev_info.prog_size = 1;
+    dev_info.read_size = 1;
+    dev_info.flags = BLOCK_DEVICE_ERASED_FF;
+
+    return ESP_OK;
+}
+
+void ExtFlashDevice::term()
+{
+    flash = NULL;
+}
+
+esp_err_t ExtFlashDevice::read(size_t addr, void *dst, size_t size)
+{
+    return flash->read(addr, dst, size);
+}
+
+esp_err_t ExtFlashDevice::prog(size_t addr, const void *src, size_t size)
+{
+    return flash->write(addr, src, size);
+}
+
+esp_err_t ExtFlashDevice::erase(size_t addr, size_t size)
+{
+    if (addr % dev_info.sector_size || size % dev_info.sector_size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    for (size_t sector = addr / dev_info.sector_size; size > 0; sector++, size -= dev_info.sector_size)
+    {
+        esp_err_t err = flash->erase_sector(sector);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+
+    return ESP_OK;
+}
+
+// ============================================================================
+// Internal flash partition
+// ============================================================================
+
+PartitionDevice::PartitionDevice()
+{
+    dev_info = {};
+    part = NULL;
+}
+
+PartitionDevice::~PartitionDevice()
+{
+    term();
+}
+
+esp_err_t PartitionDevice::init(const char *label)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                ESP_PARTITION_SUBTYPE_ANY,
+                                                                label);
+    if (partition == NULL)
+    {
+        ESP_LOGE(TAG, "Partition '%s' not found", label);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    return init(partition);
+}
+
+esp_err_t PartitionDevice::init(const esp_partition_t *partition)
+{
+    part = partition;
+
+    // Internal flash can be programmed a word at a time, 16 bytes if
+    // encrypted, and erased flash doesn't decrypt to 0xff.  Erasing an
+    // aligned 64KB range uses the faster block erase.
+    dev_info = {};
+    dev_info.size = part->size;
+    dev_info.sector_size = SPI_FLASH_SEC_SIZE;
+    dev_info.erase_size = 16 * SPI_FLASH_SEC_SIZE;
+    dev_info.prog_size = part->encrypted ? 16 : 4;
+    dev_info.read_size = part->encrypted ? 16 : 1;
+    dev_info.flags = part->encrypted ? 0 : BLOCK_DEVICE_ERASED_FF;
+
+    return ESP_OK;
+}
+
+void PartitionDevice::term()
+{
+    part = NULL;
+}
+
+esp_err_t PartitionDevice::read(size_t addr, void *dst, size_t size)
+{
+    return esp_partition_read(part, addr, dst, size);
+}
+
+esp_err_t PartitionDevice::prog(size_t addr, const void *src, size_t size)
+{
+    return esp_partition_write(part, addr, src, size);
+}
+
+esp_err_t PartitionDevice::erase(size_t addr, size_t size)
+{
+    return esp_partition_erase_range(part, addr, size);
+}
+
+// ============================================================================
+// Simulated flash in RAM
+// ============================================================================
+
+RamDevice::RamDevice()
+{
+    dev_info = {};
+    ram = NULL;
+}
+
+RamDevice::~RamDevice()
+{
+    term();
+}
+
+esp_err_t RamDevice::init(size_t size, size_t sector_size)
+{
+    if (sector_size == 0 || size % sector_size != 0 || size < 2 * sector_size)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    ram = (uint8_t *) malloc(size);
+    if (ram == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    memset(ram, 0xff, size);
+
+    // Same programming rules as internal flash
+    dev_info = {};
+    dev_info.size = size;
+    dev_info.sector_size = sector_size;
+    dev_info.erase_size = sector_size;
+    dev_info.prog_size = 4;
+    dev_info.read_size = 1;
+    dev_info.flags = BLOCK_DEVICE_ERASED_FF | BLOCK_DEVICE_VOLATILE;
+
+    return ESP_OK;
+}
+
+void RamDevice::term()
+{
+    free(ram);
+    ram = NULL;
+}
+
+esp_err_t RamDevice::read(size_t addr, void *dst, size_t size)
+{
+    if (addr + size > dev_info.size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    memcpy(dst, ram + addr, size);
+
+    return ESP_OK;
+}
+
+esp_err_t RamDevice::prog(size_t addr, const void *src, size_t size)
+{
+    if (addr + size > dev_info.size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Programming can only clear bits, just like real flash
+    uint8_t *dst = ram + addr;
+    const uint8_t *s = (const uint8_t *) src;
+    for (size_t i = 0; i < size; i++)
+    {
+        dst[i] &= s[i];
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t RamDevice::erase(size_t addr, size_t size)
+{
+    if (addr % dev_info.sector_size || size % dev_info.sector_size || addr + size > dev_info.size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    memset(ram + addr, 0xff, size);
+
+    return ESP_OK;
+}
+
+// ============================================================================
+// Image file
+// ============================================================================
+
+FileDevice::FileDevice()
+{
+    dev_info = {};
+    file = NULL;
+}
+
+FileDevice::~FileDevice()
+{
+    term();
+}
+
+esp_err_t FileDevice::init(const char *path, size_t size, size_t sector_size)
+{
+    if (sector_size == 0 || size % sector_size != 0 || size < 2 * sector_size)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    file = fopen(path, "r+b");
+    if (file == NULL)
+    {
+        file = fopen(path, "w+b");
+        if (file == NULL)
+        {
+            ESP_LOGE(TAG, "Unable to open '%s'", path);
+            return ESP_ERR_NOT_FOUND;
+        }
+    }
+
+    dev_info = {};
+    dev_info.size = size;
+    dev_info.sector_size = sector_size;
+    dev_info.erase_size = sector_size;
+    dev_info.prog_size = 1;
+    dev_info.read_size = 1;
+    dev_info.flags = BLOCK_DEVICE_ERASED_FF;
+
+    // A new or short image is grown with erased sectors
+    if (fseek(file, 0, SEEK_END) != 0)
+    {
+        term();
+        return ESP_FAIL;
+    }
+
+    long len = ftell(file);
+    if (len < 0)
+    {
+        term();
+        return ESP_FAIL;
+    }
+
+    if ((size_t) len < size)
+    {
+        esp_err_t err = fill(len, size - len);
+        if (err == ESP_OK)
+        {
+            err = sync();
+        }
+
+        if (err != ESP_OK)
+        {
+            term();
+            return err;
+        }
+    }
+
+    return ESP_OK;
+}
+
+void FileDevice::term()
+{
+    if (file)
+    {
+        fclose(file);
+        file = NULL;
+    }
+}
+
+esp_err_t FileDevice::read(size_t addr, void *dst, size_t size)
+{
+    if (addr + size > dev_info.size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (fseek(file, addr, SEEK_SET) != 0 || fread(dst, 1, size, file) != size)
+    {
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+// The image holds what was last written rather than the AND of everything
+// programmed since the erase, which only differs if LittleFS programs the
+// same bytes twice, and it doesn't
+esp_err_t FileDevice::prog(size_t addr, const void *src, size_t size)
+{
+    if (addr + size > dev_info.size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (fseek(file, addr, SEEK_SET) != 0 || fwrite(src, 1, size, file) != size)
+    {
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t FileDevice::erase(size_t addr, size_t size)
+{
+    if (addr % dev_info.sector_size || size % dev_info.sector_size || addr + size > dev_info.size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return fill(addr, size);
+}
+
+esp_err_t FileDevice::sync()
+{
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0)
+    {
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+// Writes 0xff over the range
+esp_err_t FileDevice::fill(size_t addr, size_t size)
+{
+    uint8_t ff[256];
+    memset(ff, 0xff, sizeof(ff));
+
+    if (fseek(file, addr, SEEK_SET) != 0)
+    {
+        return ESP_FAIL;
+    }
+
+    while (size > 0)
+    {
+        size_t len = std::min(size, sizeof(ff));
+        if (fwrite(ff, 1, len, file) != len)
+        {
+            return ESP_FAIL;
+        }
+        size -= len;
+    }
+
+    return ESP_OK;
+}
+
+// ============================================================================
+// Slice of another device
+// ============================================================================
+
+SliceDevice::SliceDevice()
+{
+    dev_info = {};
+    lower = NULL;
+    offset = 0;
+}
+
+SliceDevice::~SliceDevice()
+{
+    term();
+}
+
+esp_err_t SliceDevice::init(BlockDevice *lower, size_t offset, size_t size)
+{
+    const block_device_info_t *info = lower->info();
+    if (offset % info->sector_size || size % info->sector_size || size < 2 * info->sector_size || offset + size > info->size)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    this->lower = lower;
+    this->offset = offset;
+
+    dev_info = *info;
+    dev_info.size = size;
+
+    return ESP_OK;
+}
+
+void SliceDevice::term()
+{
+    lower = NULL;
+}
+
+esp_err_t SliceDevice::read(size_t addr, void *dst, size_t size)
+{
+    if (addr + size > dev_info.size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return lower->read(offset + addr, dst, size);
+}
+
+esp_err_t SliceDevice::prog(size_t addr, const void *src, size_t size)
+{
+    if (addr + size > dev_info.size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return lower->prog(offset + addr, src, size);
+}
+
+esp_err_t SliceDevice::erase(size_t addr, size_t size)
+{
+    if (addr + size > dev_info.size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return lower->erase(offset + addr, size);
+}
+
+esp_err_t SliceDevice::sync()
+{
+    return lower->sync();
+}
+
+esp_err_t SliceDevice::suspend()
+{
+    return lower->suspend();
+}
+
+esp_err_t SliceDevice::resume()
+{
+    return lower->resume();
+}
+
+// ============================================================================
+// Simulated chip timing
+// ============================================================================
+
+SimDevice::SimDevice()
+{
+    dev_info = {};
+    lower = NULL;
+}
+
+SimDevice::~SimDevice()
+{
+    term();
+}
+
+esp_err_t SimDevice::init(BlockDevice *lower, const sim_device_timing_t *timing)
+{
+    if (timing->read_rate <= 0 || timing->prog_rate <= 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    this->lower = lower;
+    this->timing = *timing;
+
+    dev_info = *lower->info();
+    dev_info.flags &= ~BLOCK_DEVICE_SUSPEND;
+    if (timing->suspend_us)
+    {
+        dev_info.flags |= BLOCK_DEVICE_SUSPEND;
+    }
+
+    stats = {};
+    suspended = false;
+    suspend_start = 0;
+    busy_until = 0;
+
+    _lock_init(&chip_lock);
+    _lock_init(&state_lock);
+
+    return ESP_OK;
+}
+
+void SimDevice::term()
+{
+    if (lower)
+    {
+        _lock_close(&state_lock);
+        _lock_close(&chip_lock);
+        lower = NULL;
+    }
+}
+
+// The task that suspended the chip reads without waiting for it
+esp_err_t SimDevice::read(size_t addr, void *dst, size_t size)
+{
+    _lock_acquire(&state_lock);
+    bool locked = !suspended;
+    _lock_release(&state_lock);
+
+    if (locked && _lock_try_acquire(&chip_lock) != 0)
+    {
+        _lock_acquire(&state_lock);
+        stats.busy_waits++;
+        _lock_release(&state_lock);
+
+        _lock_acquire(&chip_lock);
+    }
+
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = lower->read(addr, dst, size);
+    wait_until(start + (int64_t) (size / timing.read_rate / 1.048576));
+
+    if (locked)
+    {
+        _lock_release(&chip_lock);
+    }
+
+    return err;
+}
+
+esp_err_t SimDevice::prog(size_t addr, const void *src, size_t size)
+{
+    _lock_acquire(&chip_lock);
+
+    esp_err_t err = lower->prog(addr, src, size);
+    busy((int64_t) (size / timing.prog_rate / 1.048576));
+
+    _lock_release(&chip_lock);
+
+    return err;
+}
+
+esp_err_t SimDevice::erase(size_t addr, size_t size)
+{
+    _lock_acquire(&chip_lock);
+
+    esp_err_t err = lower->erase(addr, size);
+    busy((int64_t) timing.erase_us * (size / dev_info.sector_size));
+
+    _lock_release(&chip_lock);
+
+    return err;
+}
+
+esp_err_t SimDevice::sync()
+{
+    return lower->sync();
+}
+
+esp_err_t SimDevice::suspend()
+{
+    if (timing.suspend_us == 0)
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    int64_t now = esp_timer_get_time();
+
+    _lock_acquire(&state_lock);
+    suspended = true;
+    suspend_start = now;
+    stats.suspends++;
+    _lock_release(&state_lock);
+
+    wait_until(now + timing.suspend_us);
+
+    return ESP_OK;
+}
+
+// The time spent suspended is added to the program or erase
+esp_err_t SimDevice::resume()
+{
+    if (timing.suspend_us == 0)
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    _lock_acquire(&state_lock);
+    suspended = false;
+    busy_until += esp_timer_get_time() - suspend_start;
+    _lock_release(&state_lock);
+
+    return ESP_OK;
+}
+
+void SimDevice::get_stats(sim_device_stats_t *stats)
+{
+    _lock_acquire(&state_lock);
+    *stats = this->stats;
+    _lock_release(&state_lock);
+}
+
+void SimDevice::reset_stats()
+{
+    _lock_acquire(&state_lock);
+    stats = {};
+    _lock_release(&state_lock);
+}
+
+// Must be called with chip_lock held.  Sleeps through most of the time so
+// other tasks get the CPU, spinning for the last part of a tick.
+void SimDevice::busy(int64_t us)
+{
+    _lock_acquire(&state_lock);
+    busy_until = esp_timer_get_time() + us;
+    _lock_release(&state_lock);
+
+    for (;;)
+    {
+        _lock_acquire(&state_lock);
+        bool paused = suspended;
+        int64_t until = busy_until;
+        _lock_release(&state_lock);
+
+        int64_t now = esp_timer_get_time();
+        if (!paused && now >= until)
+        {
+            break;
+        }
+
+        if (paused || until - now >= portTICK_PERIOD_MS * 1000)
+        {
+            vTaskDelay(1);
+        }
+        else
+        {
+            wait_until(until);
+        }
+    }
+}
+
+void SimDevice::wait_until(int64_t until)
+{
+    while (esp_timer_get_time() < until)
+    {
+    }
+}
+
+// ============================================================================
+// Read priority scheduler
+// ============================================================================
+
+SchedDevice::SchedDevice()
+{
+    dev_info = {};
+    lower = NULL;
+    drained = NULL;
+    initialized = false;
+}
+
+SchedDevice::~SchedDevice()
+{
+    term();
+}
+
+esp_err_t SchedDevice::init(BlockDevice *lower)
+{
+    drained = xSemaphoreCreateBinary();
+    if (drained == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    this->lower = lower;
+
+    // Suspending is taken care of here
+    dev_info = *lower->info();
+    dev_info.flags &= ~BLOCK_DEVICE_SUSPEND;
+
+    stats = {};
+    reads_queued = 0;
+    writing = false;
+
+    _lock_init(&io_lock);
+    _lock_init(&state_lock);
+    _lock_init(&suspend_lock);
+    initialized = true;
+
+    return ESP_OK;
+}
+
+void SchedDevice::term()
+{
+    if (initialized)
+    {
+        _lock_close(&suspend_lock);
+        _lock_close(&state_lock);
+        _lock_close(&io_lock);
+        initialized = false;
+    }
+
+    if (drained)
+    {
+        vSemaphoreDelete(drained);
+        drained = NULL;
+    }
+
+    lower = NULL;
+}
+
+esp_err_t SchedDevice::read(size_t addr, void *dst, size_t size)
+{
+    _lock_acquire(&state_lock);
+    bool suspend = writing && (lower->info()->flags & BLOCK_DEVICE_SUSPEND);
+    if (!suspend)
+    {
+        reads_queued++;
+    }
+    stats.reads++;
+    _lock_release(&state_lock);
+
+    esp_err_t err = ESP_OK;
+    if (suspend)
+    {
+        // The write may have finished since, but it can't finish while the
+        // suspend lock is held, so look again before pausing it
+        _lock_acquire(&suspend_lock);
+
+        _lock_acquire(&state_lock);
+        suspend = writing;
+        if (!suspend)
+        {
+            reads_queued++;
+        }
+        _lock_release(&state_lock);
+
+        if (suspend)
+        {
+            // Read in a pause of the program or erase instead of waiting it out
+            err = lower->suspend();
+            if (err == ESP_OK)
+            {
+                err = lower->read(addr, dst, size);
+
+                esp_err_t rerr = lower->resume();
+                if (err == ESP_OK)
+                {
+                    err = rerr;
+                }
+            }
+
+            _lock_acquire(&state_lock);
+            stats.suspended_reads++;
+            _lock_release(&state_lock);
+        }
+
+        _lock_release(&suspend_lock);
+    }
+
+    if (!suspend)
+    {
+        _lock_acquire(&io_lock);
+        err = lower->read(addr, dst, size);
+        _lock_release(&io_lock);
+
+        _lock_acquire(&state_lock);
+        if (--reads_queued == 0)
+        {
+            xSemaphoreGive(drained);
+        }
+        _lock_release(&state_lock);
+    }
+
+    return err;
+}
+
+esp_err_t SchedDevice::prog(size_t addr, const void *src, size_t size)
+{
+    write_begin();
+    esp_err_t err = lower->prog(addr, src, size);
+    write_end();
+
+    return err;
+}
+
+esp_err_t SchedDevice::erase(size_t addr, size_t size)
+{
+    write_begin();
+    esp_err_t err = lower->erase(addr, size);
+    write_end();
+
+    return err;
+}
+
+esp_err_t SchedDevice::sync()
+{
+    _lock_acquire(&io_lock);
+    esp_err_t err = lower->sync();
+    _lock_release(&io_lock);
+
+    return err;
+}
+
+void SchedDevice::get_stats(sched_device_stats_t *stats)
+{
+    _lock_acquire(&state_lock);
+    *stats = this->stats;
+    _lock_release(&state_lock);
+}
+
+void SchedDevice::reset_stats()
+{
+    _lock_acquire(&state_lock);
+    stats = {};
+    _lock_release(&state_lock);
+}
+
+// Takes the device once queued reads are done, or after letting them go
+// first a few times so a steady stream of reads can't hold writes off
+void SchedDevice::write_begin()
+{
+    for (int defer = 0; ; defer++)
+    {
+        _lock_acquire(&io_lock);
+
+        _lock_acquire(&state_lock);
+        if (reads_queued == 0 || defer == SCHED_MAX_DEFER)
+        {
+            writing = true;
+            _lock_release(&state_lock);
+            return;
+        }
+        stats.deferrals++;
+        _lock_release(&state_lock);
+
+        _lock_release(&io_lock);
+        xSemaphoreTake(drained, 1);
+    }
+}
+
+// Waits for a suspended read to resume the device before letting it go
+void SchedDevice::write_end()
+{
+    _lock_acquire(&suspend_lock);
+    _lock_acquire(&state_lock);
+    writing = false;
+    _lock_release(&state_lock);
+    _lock_release(&suspend_lock);
+
+    _lock_release(&io_lock);
+}
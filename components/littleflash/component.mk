@@ -5,3 +5,6 @@
 COMPONENT_SRCDIRS := . littlefs
 COMPONENT_ADD_INCLUDEDIRS := include littlefs
 
+# lfs_crc() comes from littlecrc.c instead
+COMPONENT_OBJEXCLUDE := littlefs/lfs_util.o
+
@@ -0,0 +1,271 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_BLOCKDEVICE_H_)
+#define _BLOCKDEVICE_H_ 1
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/lock.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "esp_err.h"
+#include "esp_partition.h"
+
+#include "extflash.h"
+
+// Capability flags
+#define BLOCK_DEVICE_ERASED_FF  0x0001  // erased sectors read back as 0xff
+#define BLOCK_DEVICE_VOLATILE   0x0002  // contents are lost on reset
+#define BLOCK_DEVICE_SUSPEND    0x0004  // programs and erases can be suspended for reads
+
+typedef struct
+{
+    size_t size;                // device size in bytes
+    size_t sector_size;         // smallest erase unit
+    size_t erase_size;          // largest erase unit, erased faster than its sectors one by one
+    size_t prog_size;           // smallest program unit
+    size_t read_size;           // smallest read unit
+    uint32_t flags;             // BLOCK_DEVICE_* capabilities
+} block_device_info_t;
+
+//
+// Storage LittleFlash mounts on.  Addresses are byte offsets from the start
+// of the device and erases cover whole sectors.  A device can sit on top of
+// another one to add caching, striping or simulation, passing on what it
+// doesn't change.
+//
+class BlockDevice
+{
+public:
+    virtual ~BlockDevice() {}
+
+    virtual esp_err_t read(size_t addr, void *dst, size_t size) = 0;
+    virtual esp_err_t prog(size_t addr, const void *src, size_t size) = 0;
+    virtual esp_err_t erase(size_t addr, size_t size) = 0;
+    virtual esp_err_t sync() { return ESP_OK; }
+
+    // With BLOCK_DEVICE_SUSPEND, another task can read between suspend()
+    // and resume() while a program or erase is in progress
+    virtual esp_err_t suspend() { return ESP_ERR_NOT_SUPPORTED; }
+    virtual esp_err_t resume() { return ESP_ERR_NOT_SUPPORTED; }
+
+    const block_device_info_t *info() const { return &dev_info; }
+
+protected:
+    block_device_info_t dev_info;
+};
+
+// External SPI flash through an initialized ExtFlash
+class ExtFlashDevice : public BlockDevice
+{
+public:
+    ExtFlashDevice();
+    virtual ~ExtFlashDevice();
+
+    esp_err_t init(ExtFlash *flash);
+    void term();
+
+    esp_err_t read(size_t addr, void *dst, size_t size);
+    esp_err_t prog(size_t addr, const void *src, size_t size);
+    esp_err_t erase(size_t addr, size_t size);
+
+private:
+    ExtFlash *flash;
+};
+
+// A data partition in internal flash
+class PartitionDevice : public BlockDevice
+{
+public:
+    PartitionDevice();
+    virtual ~PartitionDevice();
+
+    esp_err_t init(const char *label);
+    esp_err_t init(const esp_partition_t *partition);
+    void term();
+
+    esp_err_t read(size_t addr, void *dst, size_t size);
+    esp_err_t prog(size_t addr, const void *src, size_t size);
+    esp_err_t erase(size_t addr, size_t size);
+
+private:
+    const esp_partition_t *part;
+};
+
+// Simulated flash in RAM, starts out erased
+class RamDevice : public BlockDevice
+{
+public:
+    RamDevice();
+    virtual ~RamDevice();
+
+    esp_err_t init(size_t size, size_t sector_size = SPI_FLASH_SEC_SIZE);
+    void term();
+
+    esp_err_t read(size_t addr, void *dst, size_t size);
+    esp_err_t prog(size_t addr, const void *src, size_t size);
+    esp_err_t erase(size_t addr, size_t size);
+
+private:
+    uint8_t *ram;
+};
+
+// Image file on another filesystem, created erased or grown to size
+class FileDevice : public BlockDevice
+{
+public:
+    FileDevice();
+    virtual ~FileDevice();
+
+    esp_err_t init(const char *path, size_t size, size_t sector_size = SPI_FLASH_SEC_SIZE);
+    void term();
+
+    esp_err_t read(size_t addr, void *dst, size_t size);
+    esp_err_t prog(size_t addr, const void *src, size_t size);
+    esp_err_t erase(size_t addr, size_t size);
+    esp_err_t sync();
+
+private:
+    esp_err_t fill(size_t addr, size_t size);
+
+    FILE *file;
+};
+
+// Part of another device, so several mounts can share one chip
+class SliceDevice : public BlockDevice
+{
+public:
+    SliceDevice();
+    virtual ~SliceDevice();
+
+    esp_err_t init(BlockDevice *lower, size_t offset, size_t size);
+    void term();
+
+    esp_err_t read(size_t addr, void *dst, size_t size);
+    esp_err_t prog(size_t addr, const void *src, size_t size);
+    esp_err_t erase(size_t addr, size_t size);
+    esp_err_t sync();
+    esp_err_t suspend();
+    esp_err_t resume();
+
+private:
+    BlockDevice *lower;
+    size_t offset;
+};
+
+typedef struct
+{
+    float read_rate;            // MB/s
+    float prog_rate;            // MB/s
+    uint32_t erase_us;          // sector erase time
+    uint32_t suspend_us;        // time to suspend a program or erase, 0=can't suspend
+} sim_device_timing_t;
+
+typedef struct
+{
+    uint32_t busy_waits;        // reads that waited for a program or erase to finish
+    uint32_t suspends;          // programs and erases suspended for reads
+} sim_device_stats_t;
+
+//
+// Adds the timing of a real chip to another device, usually a RamDevice.
+// Like a chip it does one thing at a time, so a read waits for a program
+// or erase in progress unless it's suspended.
+//
+class SimDevice : public BlockDevice
+{
+public:
+    SimDevice();
+    virtual ~SimDevice();
+
+    esp_err_t init(BlockDevice *lower, const sim_device_timing_t *timing);
+    void term();
+
+    esp_err_t read(size_t addr, void *dst, size_t size);
+    esp_err_t prog(size_t addr, const void *src, size_t size);
+    esp_err_t erase(size_t addr, size_t size);
+    esp_err_t sync();
+    esp_err_t suspend();
+    esp_err_t resume();
+
+    void get_stats(sim_device_stats_t *stats);
+    void reset_stats();
+
+private:
+    void busy(int64_t us);
+    static void wait_until(int64_t until);
+
+    BlockDevice *lower;
+    sim_device_timing_t timing;
+    sim_device_stats_t stats;
+
+    _lock_t chip_lock;          // held for the length of each operation
+    _lock_t state_lock;         // guards the fields below
+    bool suspended;
+    int64_t suspend_start;
+    int64_t busy_until;
+};
+
+typedef struct
+{
+    uint32_t reads;             // reads passed to the device
+    uint32_t suspended_reads;   // reads done while a program or erase was suspended
+    uint32_t deferrals;         // times a program or erase waited for queued reads
+} sched_device_stats_t;
+
+//
+// Puts reads ahead of programs and erases from other tasks.  Queued reads
+// go before a waiting program or erase, and on a device that can suspend,
+// a read doesn't wait for the one in progress either.  Mounts sharing a
+// chip through SliceDevices over one of these keep their reads quick
+// while another mount writes.
+//
+class SchedDevice : public BlockDevice
+{
+public:
+    SchedDevice();
+    virtual ~SchedDevice();
+
+    esp_err_t init(BlockDevice *lower);
+    void term();
+
+    esp_err_t read(size_t addr, void *dst, size_t size);
+    esp_err_t prog(size_t addr, const void *src, size_t size);
+    esp_err_t erase(size_t addr, size_t size);
+    esp_err_t sync();
+
+    void get_stats(sched_device_stats_t *stats);
+    void reset_stats();
+
+private:
+    void write_begin();
+    void write_end();
+
+    BlockDevice *lower;
+    sched_device_stats_t stats;
+    bool initialized;
+
+    _lock_t io_lock;            // one operation at a time, except suspended reads
+    _lock_t state_lock;         // guards the fields below
+    _lock_t suspend_lock;       // one read at a time in a suspension, held to clear writing
+    SemaphoreHandle_t drained;  // given when the last queued read is done
+    int reads_queued;
+    bool writing;
+};
+
+#endif
@@ -0,0 +1,61 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_LITTLECRC_H_)
+#define _LITTLECRC_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//
+// The CRC LittleFS checks its metadata with: CRC-32 (polynomial 0xedb88320,
+// reflected), carried in *crc from one call to the next with no final
+// inversion.  This file supplies lfs_crc() in place of LittleFS's
+// lfs_util.c, which works a nibble at a time.  Every version gives the
+// same results, so filesystems are compatible whichever is in use.
+//
+
+#if defined(ESP_PLATFORM)
+#define LITTLE_CRC_HAS_ROM 1
+#endif
+
+typedef void (*little_crc_fn_t)(uint32_t *crc, const void *buffer, size_t size);
+
+// LittleFS's own version, for comparison
+void little_crc_bytewise(uint32_t *crc, const void *buffer, size_t size);
+
+// Eight bytes per step through 8KB of tables
+void little_crc_slice8(uint32_t *crc, const void *buffer, size_t size);
+
+#if defined(LITTLE_CRC_HAS_ROM)
+// The chip's ROM routine, the default on target
+void little_crc_rom(uint32_t *crc, const void *buffer, size_t size);
+#endif
+
+// Selects the version lfs_crc() uses, NULL for the default.  Call it with
+// nothing mounted.
+void little_crc_use(little_crc_fn_t fn);
+
+void lfs_crc(uint32_t *crc, const void *buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -16,12 +16,18 @@
 #define _LITTLEFLASH_H_ 1
 
 #include <sys/lock.h>
+#include <sys/uio.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include "esp_err.h"
 #include "esp_vfs.h"
 #include "esp_partition.h"
 
 #include "extflash.h"
+#include "blockdevice.h"
+#include "littlepool.h"
 
 extern "C"
 {
@@ -36,10 +42,113 @@ typedef struct
     int open_files;             // number of open files to support
     bool auto_format;           // true=format if not valid
     lfs_size_t lookahead;       // number of LFS lookahead blocks
+    int dentry_cache;           // number of path lookups to cache, 0=disabled
+    const char *compress_prefix; // compress files below this path in the filesystem, NULL=none
+    bool wear_stats;            // true=count erases per block, kept in /.wear
+    size_t ram_size;            // simulate a device of this size in RAM if flash and part_label are NULL
+    lfs_size_t prog_size;       // program granularity, 0=sector size
+    bool verify_writes;         // true=read back and compare writes
+    bool read_only;             // true=mount without write support, reads run concurrently
+    int handle_cache;           // recently closed read-only handles kept open, 0=none
+    bool blank_check;           // true=read sectors before erasing and skip the erase if blank
+    BlockDevice *device;        // initialized device to use instead of flash, part_label or ram_size
+    LittlePool *pool;           // memory budget shared with other mounts, NULL=none
+    size_t pool_limit;          // most bytes this mount takes from the pool, 0=no limit
+    int file_buffers;           // LittleFS file buffers shared by open files, 0=one per file
 } little_flash_config_t;
 
+typedef struct
+{
+    uint32_t reads;             // number of flash read requests
+    uint32_t progs;             // number of flash program requests
+    uint32_t erases;            // number of flash erase requests
+    uint64_t read_bytes;        // bytes read from flash
+    uint64_t prog_bytes;        // bytes programmed to flash
+    uint32_t lock_acquires;     // times the filesystem lock was taken
+    uint32_t lock_contended;    // times a caller had to wait for it
+    uint64_t lock_wait_us;      // total time spent waiting for it
+    uint32_t handle_hits;       // opens served from the handle cache
+    uint32_t erases_skipped;    // erase requests skipped because the sector was blank
+    uint32_t buffer_reclaims;   // shared file buffers taken from idle files
+} little_flash_stats_t;
+
+typedef struct
+{
+    size_t buffer_size;         // staging buffer size, 0=block size
+    size_t max_bytes;           // commit once this many bytes are staged, 0=buffer_size
+    uint32_t max_ms;            // commit staged records within this many ms, 0=no time bound
+} little_flash_log_config_t;
+
+typedef struct
+{
+    uint32_t records;           // records appended
+    uint32_t commits;           // staged batches committed to flash
+    uint64_t bytes;             // record bytes appended
+} little_flash_log_stats_t;
+
+typedef struct little_flash_log little_flash_log_t;
+
+typedef struct
+{
+    uint32_t files;             // number of files
+    uint32_t dirs;              // number of directories, including the top
+    uint64_t bytes;             // total size of the files
+    uint32_t blocks;            // approximate number of blocks in use
+} little_flash_usage_t;
+
+typedef struct
+{
+    uint32_t block_size;        // bytes per block
+    uint32_t blocks;            // blocks in the filesystem
+    uint32_t used;              // blocks in use, counted exactly
+} little_flash_space_t;
+
+typedef struct
+{
+    uint32_t blocks;            // number of blocks
+    uint32_t min;               // fewest erases of any block
+    uint32_t max;               // most erases of any block
+    float mean;                 // average erases per block
+    float stddev;               // standard deviation of erases per block
+    uint64_t total;             // erases of all blocks
+} little_flash_wear_t;
+
+// ioctl() requests on open files, wrapped by the LittleFlash members of the
+// same names
+#define LITTLE_FLASH_IOC_READV     0x4c460001  // little_flash_iov_t *
+#define LITTLE_FLASH_IOC_WRITEV    0x4c460002  // little_flash_iov_t *
+#define LITTLE_FLASH_IOC_PREAD     0x4c460003  // little_flash_pio_t *
+#define LITTLE_FLASH_IOC_PWRITE    0x4c460004  // little_flash_pio_t *
+#define LITTLE_FLASH_IOC_SET_CACHE 0x4c460005  // size_t, 0=no cache
+
+typedef struct
+{
+    const struct iovec *iov;
+    int iovcnt;
+} little_flash_iov_t;
+
+typedef struct
+{
+    void *buf;
+    size_t size;
+    off_t offset;
+} little_flash_pio_t;
+
+// Receives file data from sendfile(), returns 0 to continue or -1 to stop
+typedef int (*little_flash_sink_t)(void *ctx, const void *data, size_t size);
+
+typedef struct
+{
+    char name[LFS_NAME_MAX + 1];
+    uint8_t type;               // DT_REG or DT_DIR
+    size_t size;                // file size
+} little_flash_dirent_t;
+
 class LittleFlash
 {
+    friend class LittleKV;
+    friend class LittlePool;
+
 public:
     LittleFlash();
     virtual ~LittleFlash();
@@ -47,11 +156,227 @@ public:
     esp_err_t init(const little_flash_config_t *config);
     void term();
 
+    //
+    // Flash statistics
+    //
+    void get_stats(little_flash_stats_t *stats);
+    void reset_stats();
+
+    //
+    // Per-block erase counts
+    //
+    int wear_stats(little_flash_wear_t *wear);
+    int wear_counts(uint32_t *counts, size_t first, size_t count);
+    int wear_heatmap(char *buf, size_t size, int width);
+    int wear_save();
+
+    //
+    // Bulk directory listing
+    //
+    ssize_t readdir_bulk(DIR *dir, little_flash_dirent_t *entries, size_t count);
+
+    //
+    // Directory trees
+    //
+    int remove_tree(const char *path);
+    int usage(const char *path, little_flash_usage_t *usage);
+    int space(little_flash_space_t *space);
+
+    //
+    // File copy
+    //
+    int copy(const char *src, const char *dst);
+
+    //
+    // Truncation and preallocation
+    //
+    int truncate(const char *path, off_t size);
+    int preallocate(const char *path, off_t size);
+
+    //
+    // Streaming file contents
+    //
+    ssize_t sendfile(const char *path, off_t offset, size_t count, little_flash_sink_t sink, void *ctx);
+
+    //
+    // Vectored I/O on files opened through the VFS
+    //
+    ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+    ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+    ssize_t pread(int fd, void *dst, size_t size, off_t offset);
+    ssize_t pwrite(int fd, const void *src, size_t size, off_t offset);
+
+    //
+    // Per-file caching on files opened through the VFS
+    //
+    int open_cached(const char *path, int flags, size_t cache);
+    int set_cache(int fd, size_t size);
+
+    //
+    // Append optimized log files
+    //
+    little_flash_log_t *log_open(const char *path, const little_flash_log_config_t *config);
+    int log_append(little_flash_log_t *log, const void *data, size_t size);
+    int log_commit(little_flash_log_t *log);
+    int log_close(little_flash_log_t *log);
+    void log_stats(little_flash_log_t *log, little_flash_log_stats_t *stats);
+
 private:
+    void lock_acquire();
+    void lock_release();
+    void lock_yield();
+    const char *lfs_path(const char *path);
+
+    //
+    // Path lookup cache
+    //
+    typedef struct dentry
+    {
+        char *path;             // NULL=unused
+        uint32_t hash;
+        uint32_t used;
+        uint8_t type;           // 0=path doesn't exist
+        lfs_size_t size;
+        bool zsized;            // zsize is known
+        lfs_size_t zsize;       // uncompressed size of a compressed file
+    } dentry_t;
+
+    dentry_t *dentry_find(const char *path);
+    int dentry_stat(const char *path, struct lfs_info *info);
+    void dentry_insert(const char *path, const struct lfs_info *info);
+    void dentry_child(char *path, size_t len, const struct lfs_info *info);
+    void invalidate(const char *path, bool tree);
+
+    //
+    // Open handle cache
+    //
+    typedef struct hcache
+    {
+        lfs_file *file;         // NULL=unused
+        char *name;
+        uint32_t used;
+    } hcache_t;
+
+    lfs_file *hcache_take(const char *path, char **name);
+    bool hcache_put(lfs_file *file, char *name);
+    void hcache_drop(const char *path, bool tree);
+    void hcache_evict(hcache_t *h);
+
+    //
+    // Directory tree walking
+    //
+    typedef struct walk
+    {
+        char *path;
+        size_t cap;
+        uint32_t count;
+        little_flash_usage_t *usage;
+    } walk_t;
+
+    int walk_init(walk_t *w, const char *path, size_t *len);
+    int walk_child(walk_t *w, size_t len, const char *name, size_t *child_len);
+    void walk_yield(walk_t *w);
+    int usage_dir(walk_t *w, size_t len);
+    int remove_dir(walk_t *w, size_t len);
+
+    //
+    // Compressed files
+    //
+    typedef struct zchunk
+    {
+        lfs_off_t raw;          // file offset of the chunk's data
+        lfs_off_t pos;          // offset of the chunk's header on flash
+    } zchunk_t;
+
+    typedef struct zfile
+    {
+        uint8_t *buf;           // data of one chunk
+        size_t len;             // valid bytes in buf
+        lfs_off_t start;        // file offset of buf
+        bool tail;              // buf holds unwritten data at the end of the file
+        size_t flushed;         // bytes of the tail already written as the last chunk
+        lfs_off_t pos;          // file position
+        lfs_off_t size;         // file size
+        lfs_off_t end;          // stored size
+        zchunk_t *index;
+        size_t chunks;
+        size_t cap;
+    } zfile_t;
+
+    static size_t path_normalize(const char *path, char *out);
+    static void path_match(const char *path, const char *base, size_t *depth, size_t *matched);
+    bool compressed(const char *path);
+    bool compress_crossed(const char *src, const char *dst);
+    int zstat(const char *path, struct lfs_info *info);
+    int zscan(lfs_file_t *file, zfile_t *z);
+    int zload(lfs_file_t *file, zfile_t *z, size_t chunk);
+    int zflush(lfs_file_t *file, zfile_t *z);
+    lfs_ssize_t zread(lfs_file_t *file, zfile_t *z, void *dst, size_t size);
+    lfs_ssize_t zwrite(lfs_file_t *file, zfile_t *z, const void *src, size_t size, bool append);
+    static void zfree(zfile_t *z);
+
+    //
+    // Truncation and preallocation
+    //
+    int truncate_locked(lfs_file_t *file, zfile_t *z, off_t size);
+    static int prealloc_mark(void *data, lfs_block_t block);
+    bool blank_take(lfs_block_t block);
+    void blank_clear(lfs_block_t block);
+    bool blank_check(lfs_block_t block);
+
+    //
+    // Shared memory pool
+    //
+    size_t pool_reclaim(size_t want);
+    void pool_touch();
+    uint32_t pool_last_used();
+    int file_open(lfs_file_t *file, const char *path, int flags);
+    int file_close(lfs_file_t *file);
+
+    //
+    // Shared file buffers
+    //
+    typedef struct fbuf
+    {
+        uint8_t *buf;
+        int fd;                 // -1=free
+        uint32_t used;
+    } fbuf_t;
+
+    int fbuf_attach(int fd);
+    int fbuf_take(fbuf_t *b, bool *busy);
+    void fbuf_free(int fd);
+
+    //
+    // Erase count support
+    //
+    void wear_load();
+    int wear_save_locked();
+    bool wear_file(const char *path);
+
+    //
+    // Append log support
+    //
+    int log_commit_locked(little_flash_log_t *log);
+    static void log_task(void *arg);
+
     //
     // VFS interface
     //
     int get_free_fd();
+    _lock_t *read_lock(int fd);
+    lfs_ssize_t file_read(int fd, void *dst, size_t size);
+    lfs_ssize_t file_write(int fd, const void *src, size_t size);
+    ssize_t vread(int fd, const struct iovec *iov, int iovcnt);
+    ssize_t vwrite(int fd, const struct iovec *iov, int iovcnt);
+    int file_repos(int fd);
+    lfs_ssize_t file_pread(int fd, void *dst, size_t size, off_t offset);
+    lfs_ssize_t file_pwrite(int fd, const void *src, size_t size, off_t offset);
+    int cache_set(int fd, size_t size);
+    void cache_free(int fd);
+    int cache_sync(int fd);
+    lfs_ssize_t cache_read(int fd, void *dst, size_t size);
+    lfs_ssize_t cache_write(int fd, const void *src, size_t size);
 
     static int map_lfs_error(int err);
 
@@ -75,29 +400,26 @@ private:
     static int rmdir_p(void *ctx, const char *name);
     static int fcntl_p(void *ctx, int fd, int cmd, va_list args);
     static int ioctl_p(void *ctx, int fd, int cmd, va_list args);
+    static ssize_t pread_p(void *ctx, int fd, void *dst, size_t size, off_t offset);
+    static ssize_t pwrite_p(void *ctx, int fd, const void *src, size_t size, off_t offset);
     static int fsync_p(void *ctx, int fd);
+    static int truncate_p(void *ctx, const char *path, off_t length);
+    static int ftruncate_p(void *ctx, int fd, off_t length);
 
     //
-    // LFS disk interface for external flash
-    //
-    static int external_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
-    static int external_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
-    static int external_erase(const struct lfs_config *c, lfs_block_t block);
-    static int external_sync(const struct lfs_config *c);
-
-    //
-    // LFS disk interface for internal flash
+    // LFS disk interface
     //
-    static int internal_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
-    static int internal_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
-    static int internal_erase(const struct lfs_config *c, lfs_block_t block);
-    static int internal_sync(const struct lfs_config *c);
+    static int dev_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
+    static int dev_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
+    static int dev_erase(const struct lfs_config *c, lfs_block_t block);
+    static int dev_sync(const struct lfs_config *c);
 
 private:
     struct lfs_config lfs_cfg;
 
     little_flash_config_t cfg;
-    const esp_partition_t *part;
+    BlockDevice *dev;
+    BlockDevice *dev_owned;     // made from flash, part_label or ram_size
 
     bool mounted;
     bool registered;
@@ -108,13 +430,64 @@ private:
     _lock_t lock;
     lfs_t lfs;
 
+    // Read-only mounts only: reads of a file take its fd lock instead of
+    // the filesystem lock, and device reads are serialized by dev_lock
+    _lock_t *fd_locks;
+    _lock_t dev_lock;
+
     typedef struct vfs_fd
     {
         lfs_file *file;
         char *name;
+        int flags;
+        zfile_t *z;             // NULL=not compressed
+        bool stale;             // path changed while open, don't cache the handle
+        bool repos;             // pread() or pwrite() moved the position from pos
+        lfs_off_t pos;
+        uint8_t *cache;         // set_cache() buffer, NULL=none
+        size_t cache_size;
+        size_t cache_len;       // bytes in the cache
+        size_t cache_pos;       // next byte read from the cache
+        bool cache_write;       // cache holds unwritten data, not read ahead
+        fbuf_t *fbuf;           // shared file buffer in use, NULL=none
     } vfs_fd_t;
 
     vfs_fd_t *fds;
+
+    dentry_t *dentries;
+    uint32_t dentry_clock;
+
+    hcache_t *hcache;
+    uint32_t hcache_clock;
+    size_t hcache_size;         // memory held by each cached handle
+
+    fbuf_t *fbufs;              // NULL=files have their own buffers
+    uint32_t fbuf_clock;
+    _lock_t fbuf_lock;
+    struct lfs_file_config fbuf_cfg;
+    uint8_t *fbuf_scratch;      // cache for opens, never given to a file
+
+    int pool_id;                // -1=not using a pool
+    uint32_t pool_tick;         // when the mount was last used, read by other mounts
+
+    little_flash_stats_t stats;
+
+    uint32_t *erase_counts;
+    uint32_t *blank;            // blocks erased by preallocate(), NULL until used
+    uint32_t erases_unsaved;
+    uint32_t wear_interval;     // erases between automatic saves
+
+    uint8_t *copy_buf;
+
+    char *zprefix;              // compress_prefix as LittleFS resolves it
+    size_t zprefix_parts;
+    uint8_t *zbuf;
+    uint16_t *zhtab;
+
+    _lock_t log_lock;
+    little_flash_log_t *logs;
+    TaskHandle_t log_task_handle;
+    bool log_task_stop;
 };
 
 #endif
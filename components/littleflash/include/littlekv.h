@@ -0,0 +1,135 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_LITTLEKV_H_)
+#define _LITTLEKV_H_ 1
+
+#include <sys/lock.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_err.h"
+
+#include "littleflash.h"
+
+#define LITTLE_KV_KEY_MAX 64
+
+typedef struct
+{
+    LittleFlash *fs;            // mounted LittleFlash holding the store
+    const char *path;           // directory for the segment files
+    int segments;               // maximum number of segment files (2 to 255)
+    size_t segment_size;        // start a new segment at this size
+    size_t capacity;            // maximum number of keys
+    bool sync_writes;           // true=sync every put and delete
+    bool compact_task;          // true=compact in a background task
+} little_kv_config_t;
+
+// Called with the store locked, so it must not call back into the store.
+// get(), put(), del(), sync() and compact() fail with EDEADLK if it does.
+typedef int (*little_kv_iter_t)(void *ctx, const char *key, size_t size);
+
+class LittleKV
+{
+public:
+    LittleKV();
+    virtual ~LittleKV();
+
+    esp_err_t init(const little_kv_config_t *config);
+    void term();
+
+    ssize_t get(const char *key, void *value, size_t size);
+    int put(const char *key, const void *value, size_t size);
+    int del(const char *key);
+    int iterate(little_kv_iter_t cb, void *ctx);
+    int sync();
+    int compact();
+
+    size_t count();
+
+private:
+    typedef struct kv_hdr
+    {
+        uint32_t crc;
+        uint16_t key_len;
+        uint16_t flags;
+        uint32_t val_len;
+    } kv_hdr_t;
+
+    typedef struct kv_entry
+    {
+        uint32_t hash;          // 0=unused
+        uint32_t check;
+        uint32_t loc;           // segment slot << 24 | offset
+    } kv_entry_t;
+
+    typedef struct kv_seg
+    {
+        lfs_file file;
+        uint32_t id;
+        uint32_t size;
+        uint32_t records;
+        uint32_t live;
+        bool open;
+        bool at_end;
+    } kv_seg_t;
+
+    static void hash_key(const char *key, size_t len, uint32_t *hash, uint32_t *check);
+    int find(const char *key, size_t key_len, uint32_t hash, uint32_t check, kv_entry_t **entry);
+    kv_entry_t *find_loc(uint32_t hash, uint32_t check, uint32_t loc);
+    kv_entry_t *insert(uint32_t hash, uint32_t check);
+    void remove(kv_entry_t *entry);
+    bool reentered();
+
+    const char *seg_name(uint32_t id);
+    void seg_invalidate(uint32_t id);
+    int seg_open(int slot, uint32_t id, bool create);
+    int seg_scan(int slot);
+    int seg_start();
+    int seg_oldest();
+    int seg_count();
+
+    int read_at(kv_seg_t *seg, uint32_t off, void *buffer, size_t size);
+    int append(const char *key, size_t key_len, const void *value, size_t val_len, uint16_t flags, uint32_t *loc);
+    int compact_locked(int slot, uint32_t *off);
+
+    static void compact_task(void *arg);
+
+private:
+    little_kv_config_t cfg;
+    char *dir;
+    char *name;
+    size_t name_size;
+
+    _lock_t lock;
+    bool initialized;
+
+    kv_entry_t *index;
+    size_t index_size;
+    size_t keys;
+
+    kv_seg_t *segs;
+    int active;
+
+    uint8_t *copy_buf;
+    bool compacting;
+
+    TaskHandle_t task;
+    bool task_stop;
+
+    TaskHandle_t iterating;
+};
+
+#endif
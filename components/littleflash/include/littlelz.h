@@ -0,0 +1,48 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_LITTLELZ_H_)
+#define _LITTLELZ_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//
+// Small LZF style codec used for compressed files.  It has no platform
+// dependencies so host tools can share it.
+//
+
+// Number of entries in the caller supplied hash table
+#define LITTLE_LZ_HASH_SIZE 1024
+
+// Largest input little_lz_compress() accepts
+#define LITTLE_LZ_MAX_INPUT 65535
+
+// Returns the compressed length, or 0 if the result doesn't fit in out_len
+size_t little_lz_compress(const void *in, size_t in_len, void *out, size_t out_len, uint16_t *htab);
+
+// Returns the decompressed length, or 0 if the input is malformed or
+// doesn't fit in out_len
+size_t little_lz_decompress(const void *in, size_t in_len, void *out, size_t out_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
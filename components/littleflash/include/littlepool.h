@@ -0,0 +1,89 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if !defined(_LITTLEPOOL_H_)
+#define _LITTLEPOOL_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/lock.h>
+
+#include "esp_err.h"
+
+#define LITTLE_POOL_MOUNTS 8
+
+typedef struct
+{
+    size_t used;                // bytes held now
+    size_t peak;                // most bytes held at once
+    uint32_t charges;           // buffers and handles taken from the pool
+    uint32_t failures;          // requests refused for lack of room
+    uint32_t reclaims;          // times memory was taken back from a mount
+    uint64_t reclaimed;         // bytes taken back
+} little_pool_stats_t;
+
+class LittleFlash;
+
+//
+// A memory budget shared by several mounts.  Each mount's LittleFS buffers,
+// cached handles and per-file caches are charged to it, and when it's full
+// memory is taken back from the mounts that were used least recently.
+//
+class LittlePool
+{
+public:
+    LittlePool();
+    virtual ~LittlePool();
+
+    esp_err_t init(size_t budget);
+    void term();
+
+    // fs=NULL for the whole pool
+    void get_stats(const LittleFlash *fs, little_pool_stats_t *stats);
+    void reset_stats();
+
+private:
+    friend class LittleFlash;
+
+    typedef struct
+    {
+        LittleFlash *fs;        // NULL=unused
+        size_t limit;           // 0=no limit
+        bool reclaimable;       // true=memory can be taken back
+        int busy;               // reclaims calling into the mount right now
+        little_pool_stats_t stats;
+    } client_t;
+
+    int attach(LittleFlash *fs, size_t limit);
+    void detach(int id);
+    void set_reclaimable(int id, bool reclaimable);
+
+    bool charge(int id, size_t size);
+    void uncharge(int id, size_t size);
+    void *alloc(int id, size_t size);
+    void release(int id, void *buf, size_t size);
+
+    bool fits(int id, size_t size);
+    void reclaim(int id, size_t size);
+
+private:
+    _lock_t lock;
+    bool initialized;
+
+    size_t budget;
+    little_pool_stats_t stats;
+    client_t clients[LITTLE_POOL_MOUNTS];
+};
+
+#endif
@@ -14,24 +14,92 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/errno.h>
 #include <sys/fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/lock.h>
 
+#include <algorithm>
+#include <new>
+
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 
 #include "littleflash.h"
+#include "littlelz.h"
 
 static const char *TAG = "littleflash";
 
+// The VFS passes pread() and pwrite() on from ESP-IDF 4.2
+#if defined(ESP_IDF_VERSION_VAL)
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 2, 0)
+#define VFS_PREAD 1
+#endif
+#endif
+
+// Tree walks give other tasks a chance at the lock this often
+#define WALK_YIELD_ENTRIES 32
+
+// Entries removed per directory pass in remove_tree()
+#define REMOVE_BATCH 8
+
+// Uncompressed size of each chunk of a compressed file
+#define COMPRESS_CHUNK 4096
+
+// Chunk header: raw length and stored length, little endian
+#define COMPRESS_HDR 4
+
+// Erase counts are kept here and saved at sync points after this many
+// erases per block, so saving them is a tiny part of the wear they count
+#define WEAR_FILE "/.wear"
+#define WEAR_MAGIC 0x52414557
+#define WEAR_SAVE_PER_BLOCK 4
+#define WEAR_SAVE_MIN 1024
+
+#define LOG_TASK_STACK 3072
+#define LOG_TASK_PRIORITY 5
+
+struct little_flash_log
+{
+    little_flash_log_t *next;
+    lfs_file file;
+    char *path;
+    uint8_t *buf;
+    size_t size;
+    size_t used;
+    size_t max_bytes;
+    uint32_t max_ms;
+    TickType_t first;
+    int err;
+    little_flash_log_stats_t stats;
+};
+
 LittleFlash::LittleFlash()
 {
     fds = NULL;
+    dentries = NULL;
+    hcache = NULL;
+    copy_buf = NULL;
+    zbuf = NULL;
+    zhtab = NULL;
+    zprefix = NULL;
+    dev = NULL;
+    dev_owned = NULL;
+    erase_counts = NULL;
+    blank = NULL;
+    fd_locks = NULL;
+    fbufs = NULL;
+    fbuf_scratch = NULL;
+    pool_id = -1;
     mounted = false;
     registered = false;
+    logs = NULL;
+    log_task_handle = NULL;
 }
 
 LittleFlash::~LittleFlash()
@@ -44,53 +112,117 @@ esp_err_t LittleFlash::init(const little_flash_config_t *config)
     ESP_LOGD(TAG, "%s", __func__);
 
     _lock_init(&lock);
+    _lock_init(&log_lock);
+    _lock_init(&dev_lock);
+    _lock_init(&fbuf_lock);
 
     lfs_cfg = {};
+    stats = {};
 
     cfg = *config;
 
-    if (cfg.flash)
+    esp_err_t esp_err = ESP_OK;
+    if (cfg.device)
     {
-        sector_sz = cfg.flash->sector_size();
-        block_cnt = cfg.flash->chip_size() / sector_sz;
-
-        lfs_cfg.read  = &external_read;
-        lfs_cfg.prog  = &external_prog;
-        lfs_cfg.erase = &external_erase;
-        lfs_cfg.sync  = &external_sync;
+        dev = cfg.device;
+    }
+    else if (cfg.flash)
+    {
+        ExtFlashDevice *ext = new (std::nothrow) ExtFlashDevice();
+        dev_owned = ext;
+        esp_err = ext ? ext->init(cfg.flash) : ESP_ERR_NO_MEM;
+    }
+    else if (cfg.ram_size > 0 && cfg.part_label == NULL)
+    {
+        // Starts out erased, so needs auto_format to be useful
+        RamDevice *rdev = new (std::nothrow) RamDevice();
+        dev_owned = rdev;
+        esp_err = rdev ? rdev->init(cfg.ram_size) : ESP_ERR_NO_MEM;
     }
     else
     {
-        part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
-                                        ESP_PARTITION_SUBTYPE_ANY,
-                                        cfg.part_label);
-        if (part == NULL)
+        // Without a label, the first data partition
+        PartitionDevice *pdev = new (std::nothrow) PartitionDevice();
+        dev_owned = pdev;
+        esp_err = pdev ? pdev->init(cfg.part_label) : ESP_ERR_NO_MEM;
+    }
+
+    if (esp_err != ESP_OK)
+    {
+        return esp_err;
+    }
+
+    if (dev_owned)
+    {
+        dev = dev_owned;
+    }
+
+    const block_device_info_t *info = dev->info();
+    sector_sz = info->sector_size;
+    block_cnt = info->size / sector_sz;
+
+    lfs_cfg.read  = &dev_read;
+    lfs_cfg.prog  = &dev_prog;
+    lfs_cfg.erase = &dev_erase;
+    lfs_cfg.sync  = &dev_sync;
+
+    if (cfg.wear_stats)
+    {
+        erase_counts = (uint32_t *) calloc(block_cnt, sizeof(uint32_t));
+        if (erase_counts == NULL)
         {
-            ESP_LOGE(TAG, "Partition '%s' not found", cfg.part_label);
-            return ESP_ERR_NOT_FOUND;
+            return ESP_ERR_NO_MEM;
         }
+        erases_unsaved = 0;
+        wear_interval = std::max((uint32_t) WEAR_SAVE_MIN, (uint32_t) block_cnt * WEAR_SAVE_PER_BLOCK);
+    }
 
-        sector_sz = SPI_FLASH_SEC_SIZE;
-        block_cnt = part->size / sector_sz;
-
-        lfs_cfg.read  = &internal_read;
-        lfs_cfg.prog  = &internal_prog;
-        lfs_cfg.erase = &internal_erase;
-        lfs_cfg.sync  = &internal_sync;
+    // Flash can be programmed in much smaller units than a sector, so
+    // small commits don't have to program a whole one.  LittleFS reads in
+    // units of the program size too.
+    lfs_size_t prog_sz = sector_sz;
+    if (cfg.prog_size)
+    {
+        lfs_size_t min = std::max((lfs_size_t) 4, (lfs_size_t) std::max(info->prog_size, info->read_size));
+        if (cfg.prog_size < min || sector_sz % cfg.prog_size != 0)
+        {
+            ESP_LOGE(TAG, "prog_size must be a divisor of %d and at least %d", sector_sz, min);
+            return ESP_ERR_INVALID_ARG;
+        }
+        prog_sz = cfg.prog_size;
     }
 
     lfs_cfg.context     = (void *) this;
-    lfs_cfg.read_size   = sector_sz;
-    lfs_cfg.prog_size   = sector_sz;
+    lfs_cfg.read_size   = prog_sz;
+    lfs_cfg.prog_size   = prog_sz;
     lfs_cfg.block_size  = sector_sz;
     lfs_cfg.block_count = block_cnt;
     lfs_cfg.lookahead   = cfg.lookahead;
 
+    // LittleFS takes its buffers from the pool instead of the heap
+    if (cfg.pool)
+    {
+        pool_id = cfg.pool->attach(this, cfg.pool_limit);
+        if (pool_id < 0)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+        pool_touch();
+
+        lfs_cfg.read_buffer = cfg.pool->alloc(pool_id, lfs_cfg.read_size);
+        lfs_cfg.prog_buffer = cfg.pool->alloc(pool_id, lfs_cfg.prog_size);
+        lfs_cfg.lookahead_buffer = cfg.pool->alloc(pool_id, lfs_cfg.lookahead / 8);
+        if (lfs_cfg.read_buffer == NULL || lfs_cfg.prog_buffer == NULL || lfs_cfg.lookahead_buffer == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
     int err = lfs_mount(&lfs, &lfs_cfg);
     if (err < 0)
     {
         lfs_unmount(&lfs);
-        if (!cfg.auto_format)
+        if (!cfg.auto_format || cfg.read_only)
         {
             return ESP_FAIL;
         }
@@ -113,7 +245,12 @@ esp_err_t LittleFlash::init(const little_flash_config_t *config)
     }
     mounted = true;
 
-    fds = new vfs_fd_t[cfg.open_files];
+    if (erase_counts)
+    {
+        wear_load();
+    }
+
+    fds = new (std::nothrow) vfs_fd_t[cfg.open_files];
     if (fds == NULL)
     {
         return ESP_ERR_NO_MEM;
@@ -121,32 +258,155 @@ esp_err_t LittleFlash::init(const little_flash_config_t *config)
 
     for (int i = 0; i < cfg.open_files; i++)
     {
-        fds[i].file = NULL;
-        fds[i].name = NULL;
+        fds[i] = {};
+    }
+
+    if (cfg.read_only)
+    {
+        fd_locks = new (std::nothrow) _lock_t[cfg.open_files];
+        if (fd_locks == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+
+        for (int i = 0; i < cfg.open_files; i++)
+        {
+            _lock_init(&fd_locks[i]);
+        }
+    }
+
+    // Open files share a few buffers instead of LittleFS giving each its own
+    if (cfg.file_buffers > 0)
+    {
+        fbufs = new (std::nothrow) fbuf_t[cfg.file_buffers];
+        if (fbufs == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+
+        for (int i = 0; i < cfg.file_buffers; i++)
+        {
+            fbufs[i] = {};
+            fbufs[i].fd = -1;
+        }
+
+        for (int i = 0; i < cfg.file_buffers; i++)
+        {
+            size_t size = lfs_cfg.prog_size;
+            fbufs[i].buf = (uint8_t *) (pool_id >= 0 ? cfg.pool->alloc(pool_id, size) : malloc(size));
+            if (fbufs[i].buf == NULL)
+            {
+                return ESP_ERR_NO_MEM;
+            }
+        }
+        fbuf_clock = 0;
+
+        // LittleFS clears a file's cache as it opens it, so it gets one of
+        // its own that no file keeps.  Files then start out without one.
+        size_t size = lfs_cfg.prog_size;
+        fbuf_scratch = (uint8_t *) (pool_id >= 0 ? cfg.pool->alloc(pool_id, size) : malloc(size));
+        if (fbuf_scratch == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+
+        fbuf_cfg = {};
+        fbuf_cfg.buffer = fbuf_scratch;
+    }
+
+    if (cfg.compress_prefix)
+    {
+        zprefix = (char *) malloc(strlen(cfg.compress_prefix) + 1);
+        if (zprefix == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+        zprefix_parts = path_normalize(cfg.compress_prefix, zprefix);
+
+        // Shared by all compressed files since they're only used with
+        // the lock held
+        zbuf = (uint8_t *) malloc(COMPRESS_HDR + COMPRESS_CHUNK);
+        zhtab = (uint16_t *) malloc(LITTLE_LZ_HASH_SIZE * sizeof(uint16_t));
+        if (zbuf == NULL || zhtab == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    if (cfg.dentry_cache > 0)
+    {
+        dentries = new (std::nothrow) dentry_t[cfg.dentry_cache];
+        if (dentries == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+
+        for (int i = 0; i < cfg.dentry_cache; i++)
+        {
+            dentries[i] = {};
+        }
+        dentry_clock = 0;
+    }
+
+    if (cfg.handle_cache > 0)
+    {
+        hcache = new (std::nothrow) hcache_t[cfg.handle_cache];
+        if (hcache == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+
+        for (int i = 0; i < cfg.handle_cache; i++)
+        {
+            hcache[i] = {};
+        }
+        hcache_clock = 0;
+
+        // The handle and the cache LittleFS gave it, if any
+        hcache_size = sizeof(lfs_file) + (fbufs ? 0 : lfs_cfg.prog_size);
     }
 
     esp_vfs_t vfs = {};
 
     vfs.flags = ESP_VFS_FLAG_CONTEXT_PTR;
-    vfs.write_p = &write_p;
     vfs.lseek_p = &lseek_p;
     vfs.read_p = &read_p;
+#if defined(VFS_PREAD)
+    vfs.pread_p = &pread_p;
+#endif
     vfs.open_p = &open_p;
     vfs.close_p = &close_p;
     vfs.fstat_p = &fstat_p;
     vfs.stat_p = &stat_p;
-    vfs.unlink_p = &unlink_p;
-    vfs.rename_p = &rename_p;
     vfs.opendir_p = &opendir_p;
     vfs.readdir_p = &readdir_p;
     vfs.readdir_r_p = &readdir_r_p;
     vfs.telldir_p = &telldir_p;
     vfs.seekdir_p = &seekdir_p;
     vfs.closedir_p = &closedir_p;
-    vfs.mkdir_p = &mkdir_p;
-    vfs.rmdir_p = &rmdir_p;
+    vfs.ioctl_p = &ioctl_p;
     vfs.fsync_p = &fsync_p;
 
+    // The VFS fails calls without a handler, so a read-only mount simply
+    // leaves out everything that writes
+    if (!cfg.read_only)
+    {
+        vfs.write_p = &write_p;
+#if defined(VFS_PREAD)
+        vfs.pwrite_p = &pwrite_p;
+#endif
+        vfs.unlink_p = &unlink_p;
+        vfs.rename_p = &rename_p;
+        vfs.mkdir_p = &mkdir_p;
+        vfs.rmdir_p = &rmdir_p;
+#if defined(ESP_IDF_VERSION_MAJOR) && ESP_IDF_VERSION_MAJOR >= 4
+        vfs.truncate_p = &truncate_p;
+#endif
+#if defined(ESP_IDF_VERSION_MAJOR) && ESP_IDF_VERSION_MAJOR >= 5
+        vfs.ftruncate_p = &ftruncate_p;
+#endif
+    }
+
     esp_err_t esperr = esp_vfs_register(cfg.base_path, &vfs, this);
     if (esperr != ESP_OK)
     {
@@ -155,6 +415,12 @@ esp_err_t LittleFlash::init(const little_flash_config_t *config)
 
     registered = true;
 
+    // Only now is there anything for the pool to take back
+    if (pool_id >= 0)
+    {
+        cfg.pool->set_reclaimable(pool_id, true);
+    }
+
     return ESP_OK;
 }
 
@@ -162,6 +428,27 @@ void LittleFlash::term()
 {
     ESP_LOGD(TAG, "%s", __func__);
 
+    // Nothing is taken back from what's being torn down
+    if (pool_id >= 0)
+    {
+        cfg.pool->set_reclaimable(pool_id, false);
+    }
+
+    if (log_task_handle)
+    {
+        log_task_stop = true;
+        xTaskNotifyGive(log_task_handle);
+        while (log_task_handle)
+        {
+            vTaskDelay(1);
+        }
+    }
+
+    while (logs)
+    {
+        log_close(logs);
+    }
+
     if (registered)
     {
         for (int i = 0; i < cfg.open_files; i++)
@@ -183,698 +470,4470 @@ void LittleFlash::term()
         fds = NULL;
     }
 
-    if (mounted)
+    if (fd_locks)
     {
-        lfs_unmount(&lfs);
-        mounted = false;
+        for (int i = 0; i < cfg.open_files; i++)
+        {
+            _lock_close(&fd_locks[i]);
+        }
+        delete [] fd_locks;
+        fd_locks = NULL;
     }
 
-    _lock_close(&lock);
-}
-
-// ============================================================================
-// ESP32 VFS implementation
-// ============================================================================
-
-typedef struct
-{
-    DIR dir;                // must be first...ESP32 VFS expects it...
-    struct dirent dirent;
-    lfs_dir_t lfs_dir;
-    long off;
-} vfs_lfs_dir_t;
-
-int LittleFlash::map_lfs_error(int err)
-{
-    if (err == LFS_ERR_OK)
+    if (hcache)
     {
-        return 0;
+        for (int i = 0; i < cfg.handle_cache; i++)
+        {
+            hcache_evict(&hcache[i]);
+        }
+        delete [] hcache;
+        hcache = NULL;
     }
 
-    switch (err)
+    if (fbufs)
     {
-        case LFS_ERR_IO:
-            errno = EIO;
-        break;
-        case LFS_ERR_CORRUPT:
-            errno = EIO;
-        break;
-        case LFS_ERR_NOENT:
-            errno = ENOENT;
-        break;
-        case LFS_ERR_EXIST:
-            errno = EEXIST;
-        break;
-        case LFS_ERR_NOTDIR:
-            errno = ENOTDIR;
-        break;
-        case LFS_ERR_ISDIR:
-            errno = EISDIR;
-        break;
-        case LFS_ERR_NOTEMPTY:
-            errno = ENOTEMPTY;
-        break;
-        case LFS_ERR_INVAL:
-            errno = EINVAL;
-        break;
-        case LFS_ERR_NOSPC:
-            errno = ENOSPC;
-        break;
-        case LFS_ERR_NOMEM:
-            errno = ENOMEM;
-        break;
-        default:
-            errno = EINVAL;
-        break;
+        for (int i = 0; i < cfg.file_buffers; i++)
+        {
+            if (pool_id >= 0)
+            {
+                cfg.pool->release(pool_id, fbufs[i].buf, lfs_cfg.prog_size);
+            }
+            else
+            {
+                free(fbufs[i].buf);
+            }
+        }
+        delete [] fbufs;
+        fbufs = NULL;
     }
 
-    return -1;
-}
-
-int LittleFlash::get_free_fd()
-{
-    for (int i = 0; i < cfg.open_files; i++)
+    if (fbuf_scratch)
     {
-        if (fds[i].file == NULL)
+        if (pool_id >= 0)
         {
-            return i;
+            cfg.pool->release(pool_id, fbuf_scratch, lfs_cfg.prog_size);
+        }
+        else
+        {
+            free(fbuf_scratch);
         }
+        fbuf_scratch = NULL;
     }
 
-    return -1;
-}
-
-ssize_t LittleFlash::write_p(void *ctx, int fd, const void *data, size_t size)
-{
-    LittleFlash *that = (LittleFlash *) ctx;
-
-    _lock_acquire(&that->lock);
-
-    if (that->fds[fd].file == NULL)
+    if (dentries)
     {
-        _lock_release(&that->lock);
-        errno = EBADF;
-        return -1;
+        for (int i = 0; i < cfg.dentry_cache; i++)
+        {
+            free(dentries[i].path);
+        }
+        delete [] dentries;
+        dentries = NULL;
     }
 
-    lfs_ssize_t written = lfs_file_write(&that->lfs, that->fds[fd].file, data, size);
-
-    _lock_release(&that->lock);
-
-    if (written < 0)
+    if (copy_buf)
     {
-        return map_lfs_error(written);
+        free(copy_buf);
+        copy_buf = NULL;
     }
 
-    return written;
-}
-
-off_t LittleFlash::lseek_p(void *ctx, int fd, off_t size, int mode)
-{
-    LittleFlash *that = (LittleFlash *) ctx;
+    free(zbuf);
+    zbuf = NULL;
+    free(zhtab);
+    zhtab = NULL;
+    free(zprefix);
+    zprefix = NULL;
 
-    int lfs_mode = 0;
-    if (mode == SEEK_SET)
+    if (erase_counts)
     {
-        lfs_mode = LFS_SEEK_SET;
+        if (mounted && !cfg.read_only)
+        {
+            lock_acquire();
+            wear_save_locked();
+            _lock_release(&lock);
+        }
+        free(erase_counts);
+        erase_counts = NULL;
     }
-    else if (mode == SEEK_CUR)
+
+    if (mounted)
     {
-        lfs_mode = LFS_SEEK_CUR;
+        lfs_unmount(&lfs);
+        mounted = false;
     }
-    else if (mode == SEEK_END)
+
+    if (pool_id >= 0)
     {
-        lfs_mode = LFS_SEEK_END;
+        cfg.pool->release(pool_id, lfs_cfg.read_buffer, lfs_cfg.read_size);
+        cfg.pool->release(pool_id, lfs_cfg.prog_buffer, lfs_cfg.prog_size);
+        cfg.pool->release(pool_id, lfs_cfg.lookahead_buffer, lfs_cfg.lookahead / 8);
+        cfg.pool->detach(pool_id);
+        pool_id = -1;
     }
-    else
+
+    if (blank)
     {
-        errno = EINVAL;
-        return -1;
+        free(blank);
+        blank = NULL;
     }
 
-    _lock_acquire(&that->lock);
-
-    if (that->fds[fd].file == NULL)
+    if (dev_owned)
     {
-        _lock_release(&that->lock);
-        errno = EBADF;
-        return -1;
+        delete dev_owned;
+        dev_owned = NULL;
     }
+    dev = NULL;
 
-    lfs_soff_t pos = lfs_file_seek(&that->lfs, that->fds[fd].file, size, lfs_mode);
+    _lock_close(&fbuf_lock);
+    _lock_close(&dev_lock);
+    _lock_close(&log_lock);
+    _lock_close(&lock);
+}
 
-    if (pos >= 0)
+// Takes the filesystem lock, keeping track of how long callers wait for it
+void LittleFlash::lock_acquire()
+{
+    if (_lock_try_acquire(&lock) == 0)
     {
-        pos = lfs_file_tell(&that->lfs, that->fds[fd].file);
+        stats.lock_acquires++;
+        pool_touch();
+        return;
     }
 
-    _lock_release(&that->lock);
+    int64_t start = esp_timer_get_time();
 
-    if (pos < 0)
-    {
-        return map_lfs_error(pos);
-    }
+    _lock_acquire(&lock);
 
-    return pos;
+    stats.lock_acquires++;
+    stats.lock_contended++;
+    stats.lock_wait_us += esp_timer_get_time() - start;
+    pool_touch();
 }
 
-ssize_t LittleFlash::read_p(void *ctx, int fd, void *dst, size_t size)
+// Pairs with lock_acquire() for callers outside this file
+void LittleFlash::lock_release()
 {
-    LittleFlash *that = (LittleFlash *) ctx;
+    _lock_release(&lock);
+}
 
-    _lock_acquire(&that->lock);
+// Must be called with lock held.  Releasing and retaking the lock back to
+// back rarely lets a waiting task in, so give up the CPU in between.
+void LittleFlash::lock_yield()
+{
+    _lock_release(&lock);
+    taskYIELD();
+    lock_acquire();
+}
 
-    if (that->fds[fd].file == NULL)
-    {
-        _lock_release(&that->lock);
-        errno = EBADF;
-        return -1;
-    }
+void LittleFlash::get_stats(little_flash_stats_t *stats)
+{
+    lock_acquire();
+    _lock_acquire(&dev_lock);
+
+    *stats = this->stats;
+
+    _lock_release(&dev_lock);
+    _lock_release(&lock);
+}
+
+void LittleFlash::reset_stats()
+{
+    lock_acquire();
+    _lock_acquire(&dev_lock);
+
+    stats = {};
+
+    _lock_release(&dev_lock);
+    _lock_release(&lock);
+}
+
+// On a read-only mount, reads of an uncompressed file only touch the file's
+// own state and cache, so they're serialized per fd instead of taking the
+// filesystem lock.  Compressed files share the decompression buffer.
+_lock_t *LittleFlash::read_lock(int fd)
+{
+    if (fd_locks && fds[fd].z == NULL)
+    {
+        _lock_acquire(&fd_locks[fd]);
+        pool_touch();
+        return &fd_locks[fd];
+    }
+
+    lock_acquire();
+
+    return &lock;
+}
+
+// Convert a path under the mount point to the path LFS expects
+const char *LittleFlash::lfs_path(const char *path)
+{
+    size_t len = strlen(cfg.base_path);
+
+    if (path == NULL || strncmp(path, cfg.base_path, len) != 0)
+    {
+        return NULL;
+    }
+
+    if (path[len] == '\0')
+    {
+        return "/";
+    }
+
+    if (path[len] != '/')
+    {
+        return NULL;
+    }
+
+    return path + len;
+}
+
+// ============================================================================
+// Path lookup cache
+// ============================================================================
+
+static uint32_t dentry_hash(const char *path)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*path)
+    {
+        hash = (hash ^ (uint8_t) *path++) * 16777619u;
+    }
+
+    return hash;
+}
+
+// Only paths with a single spelling are cached so invalidating by name
+// can't miss an alias like "/a/./b" or "/a//b"
+static bool dentry_cacheable(const char *path)
+{
+    if (path[0] != '/')
+    {
+        return false;
+    }
+
+    for (const char *p = path; *p; p++)
+    {
+        if (p[0] != '/')
+        {
+            continue;
+        }
+
+        if (p[1] == '/' || (p[1] == '\0' && p != path))
+        {
+            return false;
+        }
+
+        if (p[1] == '.' && (p[2] == '/' || p[2] == '\0' ||
+            (p[2] == '.' && (p[3] == '/' || p[3] == '\0'))))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Must be called with lock held
+LittleFlash::dentry_t *LittleFlash::dentry_find(const char *path)
+{
+    if (dentries == NULL || !dentry_cacheable(path))
+    {
+        return NULL;
+    }
+
+    uint32_t hash = dentry_hash(path);
+
+    for (int i = 0; i < cfg.dentry_cache; i++)
+    {
+        dentry_t *d = &dentries[i];
+        if (d->path && d->hash == hash && strcmp(d->path, path) == 0)
+        {
+            d->used = ++dentry_clock;
+            return d;
+        }
+    }
+
+    return NULL;
+}
+
+// Must be called with lock held
+int LittleFlash::dentry_stat(const char *path, struct lfs_info *info)
+{
+    dentry_t *d = dentry_find(path);
+    if (d)
+    {
+        if (d->type == 0)
+        {
+            return LFS_ERR_NOENT;
+        }
+
+        strlcpy(info->name, strrchr(path, '/') + 1, sizeof(info->name));
+        info->type = d->type;
+        info->size = d->size;
+
+        return LFS_ERR_OK;
+    }
+
+    int err = lfs_stat(&lfs, path, info);
+    if (err == LFS_ERR_OK)
+    {
+        dentry_insert(path, info);
+    }
+    else if (err == LFS_ERR_NOENT)
+    {
+        dentry_insert(path, NULL);
+    }
+
+    return err;
+}
+
+// Must be called with lock held, info=NULL records that path doesn't exist
+void LittleFlash::dentry_insert(const char *path, const struct lfs_info *info)
+{
+    if (dentries == NULL || !dentry_cacheable(path))
+    {
+        return;
+    }
+
+    uint32_t hash = dentry_hash(path);
+    dentry_t *slot = NULL;
+
+    for (int i = 0; i < cfg.dentry_cache; i++)
+    {
+        dentry_t *d = &dentries[i];
+        if (d->path && d->hash == hash && strcmp(d->path, path) == 0)
+        {
+            slot = d;
+            break;
+        }
+
+        if (slot == NULL || (slot->path && (d->path == NULL || d->used < slot->used)))
+        {
+            slot = d;
+        }
+    }
+
+    if (slot->path == NULL || strcmp(slot->path, path) != 0)
+    {
+        char *copy = strdup(path);
+        if (copy == NULL)
+        {
+            return;
+        }
+        free(slot->path);
+        slot->path = copy;
+        slot->hash = hash;
+    }
+
+    slot->used = ++dentry_clock;
+    slot->type = info ? info->type : 0;
+    slot->size = info ? info->size : 0;
+    slot->zsized = false;
+}
+
+// Must be called with lock held, path has room for the name after len
+void LittleFlash::dentry_child(char *path, size_t len, const struct lfs_info *info)
+{
+    if (strcmp(info->name, ".") == 0 || strcmp(info->name, "..") == 0)
+    {
+        return;
+    }
+
+    path[len] = '/';
+    strcpy(path + len + 1, info->name);
+
+    dentry_insert(path, info);
+}
+
+// Must be called with lock held, tree=true also drops everything below path
+void LittleFlash::invalidate(const char *path, bool tree)
+{
+    hcache_drop(path, tree);
+
+    if (dentries == NULL)
+    {
+        return;
+    }
+
+    bool all = !dentry_cacheable(path);
+    size_t len = strlen(path);
+    uint32_t hash = dentry_hash(path);
+
+    for (int i = 0; i < cfg.dentry_cache; i++)
+    {
+        dentry_t *d = &dentries[i];
+        if (d->path == NULL)
+        {
+            continue;
+        }
+
+        bool match = all || (d->hash == hash && strcmp(d->path, path) == 0);
+        if (!match && tree)
+        {
+            match = strncmp(d->path, path, len) == 0 && (d->path[len] == '/' || len == 1);
+        }
+
+        if (match)
+        {
+            free(d->path);
+            *d = {};
+        }
+    }
+}
+
+// ============================================================================
+// Open handle cache
+// ============================================================================
+
+//
+// Read-only handles of uncompressed files aren't closed right away but kept
+// here, still open with their cache intact, so opening the same file again
+// skips the path lookup and allocations.  LittleFS doesn't pin the blocks of
+// a file that's only being read, so anything that changes a path drops its
+// handle through invalidate().  Like the directory entry cache, only
+// canonical paths are kept, and a change through any other spelling drops
+// every handle.  All of these need the lock held.
+//
+
+lfs_file *LittleFlash::hcache_take(const char *path, char **name)
+{
+    if (hcache == NULL)
+    {
+        return NULL;
+    }
+
+    for (int i = 0; i < cfg.handle_cache; i++)
+    {
+        hcache_t *h = &hcache[i];
+        if (h->file == NULL || strcmp(h->name, path) != 0)
+        {
+            continue;
+        }
+
+        // Seeking drops the read position but keeps the cached block
+        lfs_file *file = h->file;
+        if (lfs_file_seek(&lfs, file, 0, LFS_SEEK_SET) < 0)
+        {
+            hcache_evict(h);
+            return NULL;
+        }
+
+        *name = h->name;
+        *h = {};
+
+        if (pool_id >= 0)
+        {
+            cfg.pool->uncharge(pool_id, sizeof(lfs_file));
+        }
+
+        return file;
+    }
+
+    return NULL;
+}
+
+// Returns false if the handle can't be kept
+bool LittleFlash::hcache_put(lfs_file *file, char *name)
+{
+    if (!dentry_cacheable(name))
+    {
+        return false;
+    }
+
+    hcache_t *victim = NULL;
+    for (int i = 0; i < cfg.handle_cache; i++)
+    {
+        hcache_t *h = &hcache[i];
+
+        // One handle per path is plenty
+        if (h->file && strcmp(h->name, name) == 0)
+        {
+            victim = h;
+            break;
+        }
+
+        if (victim == NULL || (victim->file && (h->file == NULL || h->used < victim->used)))
+        {
+            victim = h;
+        }
+    }
+
+    // Charged first, so the victim stays cached if there's no room
+    if (pool_id >= 0 && !cfg.pool->charge(pool_id, sizeof(lfs_file)))
+    {
+        return false;
+    }
+
+    hcache_evict(victim);
+
+    victim->file = file;
+    victim->name = name;
+    victim->used = ++hcache_clock;
+
+    return true;
+}
+
+static bool hcache_match(const char *name, const char *path, size_t len, bool tree)
+{
+    if (strcmp(name, path) == 0)
+    {
+        return true;
+    }
+
+    return tree && strncmp(name, path, len) == 0 && (name[len] == '/' || len == 1);
+}
+
+void LittleFlash::hcache_drop(const char *path, bool tree)
+{
+    if (hcache == NULL)
+    {
+        return;
+    }
+
+    bool all = !dentry_cacheable(path);
+    size_t len = strlen(path);
+    for (int i = 0; i < cfg.handle_cache; i++)
+    {
+        hcache_t *h = &hcache[i];
+        if (h->file && (all || hcache_match(h->name, path, len, tree)))
+        {
+            hcache_evict(h);
+        }
+    }
+
+    // Handles open now would be out of date once closed
+    for (int i = 0; i < cfg.open_files; i++)
+    {
+        if (fds[i].file && (all || hcache_match(fds[i].name, path, len, tree)))
+        {
+            fds[i].stale = true;
+        }
+    }
+}
+
+void LittleFlash::hcache_evict(hcache_t *h)
+{
+    if (h->file)
+    {
+        file_close(h->file);
+        free(h->file);
+        free(h->name);
+        *h = {};
+
+        if (pool_id >= 0)
+        {
+            cfg.pool->uncharge(pool_id, sizeof(lfs_file));
+        }
+    }
+}
+
+// ============================================================================
+// ESP32 VFS implementation
+// ============================================================================
+
+typedef struct
+{
+    DIR dir;                // must be first...ESP32 VFS expects it...
+    struct dirent dirent;
+    lfs_dir_t lfs_dir;
+    long off;
+    char *path;             // directory path with room for a name, or NULL
+    size_t path_len;
+    LittleFlash *fs;        // mount that opened it
+    int err;                // error held back from the last readdir_bulk()
+    bool hide_wear;         // skip the erase counts file
+} vfs_lfs_dir_t;
+
+// Reads the next directory entry, skipping the erase counts file
+static int dir_read(lfs_t *lfs, vfs_lfs_dir_t *vfs_dir, struct lfs_info *info)
+{
+    int err;
+    do
+    {
+        err = lfs_dir_read(lfs, &vfs_dir->lfs_dir, info);
+    } while (err > 0 && vfs_dir->hide_wear && strcmp(info->name, WEAR_FILE + 1) == 0);
+
+    return err;
+}
+
+int LittleFlash::map_lfs_error(int err)
+{
+    if (err == LFS_ERR_OK)
+    {
+        return 0;
+    }
+
+    switch (err)
+    {
+        case LFS_ERR_IO:
+            errno = EIO;
+        break;
+        case LFS_ERR_CORRUPT:
+            errno = EIO;
+        break;
+        case LFS_ERR_NOENT:
+            errno = ENOENT;
+        break;
+        case LFS_ERR_EXIST:
+            errno = EEXIST;
+        break;
+        case LFS_ERR_NOTDIR:
+            errno = ENOTDIR;
+        break;
+        case LFS_ERR_ISDIR:
+            errno = EISDIR;
+        break;
+        case LFS_ERR_NOTEMPTY:
+            errno = ENOTEMPTY;
+        break;
+        case LFS_ERR_INVAL:
+            errno = EINVAL;
+        break;
+        case LFS_ERR_BADF:
+            errno = EBADF;
+        break;
+        case LFS_ERR_NOSPC:
+            errno = ENOSPC;
+        break;
+        case LFS_ERR_NOMEM:
+            errno = ENOMEM;
+        break;
+        default:
+            errno = EINVAL;
+        break;
+    }
+
+    return -1;
+}
+
+int LittleFlash::get_free_fd()
+{
+    for (int i = 0; i < cfg.open_files; i++)
+    {
+        if (fds[i].file == NULL)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+ssize_t LittleFlash::write_p(void *ctx, int fd, const void *data, size_t size)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    if (that->cfg.read_only)
+    {
+        errno = EROFS;
+        return -1;
+    }
+
+    that->lock_acquire();
+
+    lfs_ssize_t written = that->file_write(fd, data, size);
+
+    _lock_release(&that->lock);
+
+    if (written < 0)
+    {
+        return map_lfs_error(written);
+    }
+
+    return written;
+}
+
+off_t LittleFlash::lseek_p(void *ctx, int fd, off_t size, int mode)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    int lfs_mode = 0;
+    if (mode == SEEK_SET)
+    {
+        lfs_mode = LFS_SEEK_SET;
+    }
+    else if (mode == SEEK_CUR)
+    {
+        lfs_mode = LFS_SEEK_CUR;
+    }
+    else if (mode == SEEK_END)
+    {
+        lfs_mode = LFS_SEEK_END;
+    }
+    else
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _lock_t *lock = that->read_lock(fd);
+
+    if (that->fds[fd].file == NULL)
+    {
+        _lock_release(lock);
+        errno = EBADF;
+        return -1;
+    }
+
+    lfs_soff_t pos;
+    zfile_t *z = that->fds[fd].z;
+    if (z)
+    {
+        // Only the position changes, chunks are loaded when read
+        pos = size;
+        if (lfs_mode == LFS_SEEK_CUR)
+        {
+            pos += z->pos;
+        }
+        else if (lfs_mode == LFS_SEEK_END)
+        {
+            pos += z->size;
+        }
+
+        if (pos < 0)
+        {
+            pos = LFS_ERR_INVAL;
+        }
+        else
+        {
+            z->pos = pos;
+        }
+    }
+    else
+    {
+        pos = that->cache_sync(fd);
+        if (pos == LFS_ERR_OK)
+        {
+            pos = that->file_repos(fd);
+        }
+
+        if (pos == LFS_ERR_OK)
+        {
+            pos = lfs_file_seek(&that->lfs, that->fds[fd].file, size, lfs_mode);
+        }
+
+        if (pos >= 0)
+        {
+            pos = lfs_file_tell(&that->lfs, that->fds[fd].file);
+        }
+    }
+
+    _lock_release(lock);
+
+    if (pos < 0)
+    {
+        return map_lfs_error(pos);
+    }
+
+    return pos;
+}
+
+ssize_t LittleFlash::read_p(void *ctx, int fd, void *dst, size_t size)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    _lock_t *lock = that->read_lock(fd);
+
+    lfs_ssize_t read = that->file_read(fd, dst, size);
+
+    _lock_release(lock);
+
+    if (read < 0)
+    {
+        return map_lfs_error(read);
+    }
+
+    return read;
+}
+
+// Must be called with the fd's read lock held
+lfs_ssize_t LittleFlash::file_read(int fd, void *dst, size_t size)
+{
+    if (fds[fd].file == NULL)
+    {
+        return LFS_ERR_BADF;
+    }
+
+    if (fds[fd].z)
+    {
+        if (!(fds[fd].flags & LFS_O_RDONLY))
+        {
+            return LFS_ERR_BADF;
+        }
+
+        return zread(fds[fd].file, fds[fd].z, dst, size);
+    }
+
+    int err = fbuf_attach(fd);
+    if (err == LFS_ERR_OK)
+    {
+        err = file_repos(fd);
+    }
+    if (err < 0)
+    {
+        return err;
+    }
+
+    if (fds[fd].cache)
+    {
+        return cache_read(fd, dst, size);
+    }
+
+    return lfs_file_read(&lfs, fds[fd].file, dst, size);
+}
+
+// Must be called with lock held
+lfs_ssize_t LittleFlash::file_write(int fd, const void *src, size_t size)
+{
+    // Checked before the cache or a shared buffer is touched
+    if (fds[fd].file == NULL || !(fds[fd].flags & LFS_O_WRONLY))
+    {
+        return LFS_ERR_BADF;
+    }
+
+    if (fds[fd].z)
+    {
+        return zwrite(fds[fd].file, fds[fd].z, src, size, fds[fd].flags & LFS_O_APPEND);
+    }
+
+    int err = fbuf_attach(fd);
+    if (err == LFS_ERR_OK)
+    {
+        err = file_repos(fd);
+    }
+    if (err < 0)
+    {
+        return err;
+    }
+
+    if (fds[fd].cache)
+    {
+        return cache_write(fd, src, size);
+    }
+
+    return lfs_file_write(&lfs, fds[fd].file, src, size);
+}
+
+// Moves the position back to where it was before pread() or pwrite().  This
+// is put off until something uses the position, since seeking flushes the
+// file and a run of positional calls doesn't need it.
+int LittleFlash::file_repos(int fd)
+{
+    if (!fds[fd].repos)
+    {
+        return LFS_ERR_OK;
+    }
+
+    fds[fd].repos = false;
+
+    if (lfs_file_tell(&lfs, fds[fd].file) == (lfs_soff_t) fds[fd].pos)
+    {
+        return LFS_ERR_OK;
+    }
+
+    lfs_soff_t pos = lfs_file_seek(&lfs, fds[fd].file, fds[fd].pos, LFS_SEEK_SET);
+
+    return pos < 0 ? pos : LFS_ERR_OK;
+}
+
+// Must be called with the fd's read lock held
+lfs_ssize_t LittleFlash::file_pread(int fd, void *dst, size_t size, off_t offset)
+{
+    if (fds[fd].file == NULL)
+    {
+        return LFS_ERR_BADF;
+    }
+
+    if (offset < 0)
+    {
+        return LFS_ERR_INVAL;
+    }
+
+    // Compressed files keep their own position
+    zfile_t *z = fds[fd].z;
+    if (z)
+    {
+        lfs_off_t pos = z->pos;
+        z->pos = offset;
+        lfs_ssize_t len = file_read(fd, dst, size);
+        z->pos = pos;
+
+        return len;
+    }
+
+    int err = fbuf_attach(fd);
+    if (err == LFS_ERR_OK)
+    {
+        err = cache_sync(fd);
+    }
+
+    if (err < 0)
+    {
+        return err;
+    }
+
+    lfs_soff_t pos = lfs_file_tell(&lfs, fds[fd].file);
+    if (!fds[fd].repos)
+    {
+        fds[fd].pos = pos;
+        fds[fd].repos = true;
+    }
+
+    if (pos != offset)
+    {
+        pos = lfs_file_seek(&lfs, fds[fd].file, offset, LFS_SEEK_SET);
+        if (pos < 0)
+        {
+            return pos;
+        }
+    }
+
+    return lfs_file_read(&lfs, fds[fd].file, dst, size);
+}
+
+// Must be called with lock held
+lfs_ssize_t LittleFlash::file_pwrite(int fd, const void *src, size_t size, off_t offset)
+{
+    if (fds[fd].file == NULL || !(fds[fd].flags & LFS_O_WRONLY))
+    {
+        return LFS_ERR_BADF;
+    }
+
+    if (offset < 0)
+    {
+        return LFS_ERR_INVAL;
+    }
+
+    // Compressed files can still only be written at the end
+    zfile_t *z = fds[fd].z;
+    if (z)
+    {
+        lfs_off_t pos = z->pos;
+        z->pos = offset;
+        lfs_ssize_t len = zwrite(fds[fd].file, z, src, size, false);
+        z->pos = pos;
+
+        return len;
+    }
+
+    int err = fbuf_attach(fd);
+    if (err == LFS_ERR_OK)
+    {
+        err = cache_sync(fd);
+    }
+
+    if (err < 0)
+    {
+        return err;
+    }
+
+    lfs_soff_t pos = lfs_file_tell(&lfs, fds[fd].file);
+    if (!fds[fd].repos)
+    {
+        fds[fd].pos = pos;
+        fds[fd].repos = true;
+    }
+
+    if (pos != offset)
+    {
+        pos = lfs_file_seek(&lfs, fds[fd].file, offset, LFS_SEEK_SET);
+        if (pos < 0)
+        {
+            return pos;
+        }
+    }
+
+    return lfs_file_write(&lfs, fds[fd].file, src, size);
+}
+
+int LittleFlash::open_p(void *ctx, const char *path, int flags, int mode)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    int lfs_flags = 0;
+    if ((flags & O_ACCMODE) == O_RDONLY)
+    {
+        lfs_flags = LFS_O_RDONLY;
+    }
+    else if ((flags & O_ACCMODE) == O_WRONLY)
+    {
+        lfs_flags = LFS_O_WRONLY;
+    }
+    else if ((flags & O_ACCMODE) == O_RDWR)
+    {
+        lfs_flags = LFS_O_RDWR;
+    }
+
+    if (flags & O_CREAT)
+    {
+        lfs_flags |= LFS_O_CREAT;
+    }
+
+    if (flags & O_EXCL)
+    {
+        lfs_flags |= LFS_O_EXCL;
+    }
+
+    if (flags & O_TRUNC)
+    {
+        lfs_flags |= LFS_O_TRUNC;
+    }
+    
+    if (flags & O_APPEND)
+    {
+        lfs_flags |= LFS_O_APPEND;
+    }
+
+    if (that->cfg.read_only && (lfs_flags & (LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC | LFS_O_APPEND)))
+    {
+        errno = EROFS;
+        return -1;
+    }
+
+    // The counts in RAM would overwrite anything written there at unmount
+    if ((lfs_flags & (LFS_O_WRONLY | LFS_O_TRUNC | LFS_O_APPEND)) && that->wear_file(path))
+    {
+        errno = EACCES;
+        return -1;
+    }
+
+    // A recently closed handle can be handed out again as is
+    if (that->hcache && lfs_flags == LFS_O_RDONLY)
+    {
+        that->lock_acquire();
+
+        int fd = that->get_free_fd();
+        char *name;
+        lfs_file *file = fd == -1 ? NULL : that->hcache_take(path, &name);
+        if (file)
+        {
+            that->fds[fd].file = file;
+            that->fds[fd].name = name;
+            that->fds[fd].flags = lfs_flags;
+            that->fds[fd].z = NULL;
+            that->stats.handle_hits++;
+
+            _lock_release(&that->lock);
+
+            return fd;
+        }
+
+        _lock_release(&that->lock);
+    }
+
+    lfs_file *file = (lfs_file *) malloc(sizeof(lfs_file));
+    if (file == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    char *name = strdup(path);
+    if (name == NULL)
+    {
+        free(file);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    zfile_t *z = NULL;
+    if (that->compressed(path))
+    {
+        z = (zfile_t *) calloc(1, sizeof(zfile_t));
+        if (z)
+        {
+            z->buf = (uint8_t *) malloc(COMPRESS_CHUNK);
+        }
+
+        if (z == NULL || z->buf == NULL)
+        {
+            zfree(z);
+            free(name);
+            free(file);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    that->lock_acquire();
+
+    int fd = that->get_free_fd();
+    if (fd == -1)
+    {
+        _lock_release(&that->lock);
+        zfree(z);
+        free(name);
+        free(file);
+        errno = ENFILE;
+        return -1;
+    }
+
+    // A cached lookup can answer for a missing file or a directory
+    // without touching flash
+    int err = LFS_ERR_OK;
+    if (!(lfs_flags & LFS_O_CREAT))
+    {
+        dentry_t *d = that->dentry_find(path);
+        if (d && d->type == 0)
+        {
+            err = LFS_ERR_NOENT;
+        }
+        else if (d && d->type == LFS_TYPE_DIR)
+        {
+            err = LFS_ERR_ISDIR;
+        }
+    }
+
+    if (err == LFS_ERR_OK)
+    {
+        // Uncompressed files get a shared buffer when they first need one
+        if (that->fbufs && z == NULL)
+        {
+            err = lfs_file_opencfg(&that->lfs, file, path, lfs_flags, &that->fbuf_cfg);
+            file->cache.buffer = NULL;
+        }
+        else
+        {
+            err = that->file_open(file, path, lfs_flags);
+        }
+
+        if (err == LFS_ERR_NOENT && !(lfs_flags & LFS_O_CREAT))
+        {
+            that->dentry_insert(path, NULL);
+        }
+    }
+
+    // The chunk index of a compressed file is built up front
+    if (err == LFS_ERR_OK && z)
+    {
+        err = that->zscan(file, z);
+        if (err < 0)
+        {
+            that->file_close(file);
+        }
+    }
+
+    if (err < 0)
+    {
+        _lock_release(&that->lock);
+        zfree(z);
+        free(name);
+        free(file);
+        return map_lfs_error(err);
+    }
+
+    if (lfs_flags & (LFS_O_CREAT | LFS_O_TRUNC))
+    {
+        that->invalidate(path, false);
+    }
+    else if (lfs_flags & LFS_O_WRONLY)
+    {
+        that->hcache_drop(path, false);
+    }
+
+    that->fds[fd].file = file;
+    that->fds[fd].name = name;
+    that->fds[fd].flags = lfs_flags;
+    that->fds[fd].z = z;
+
+    _lock_release(&that->lock);
+
+    return fd;
+}
+
+int LittleFlash::close_p(void *ctx, int fd)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    that->lock_acquire();
+
+    if (that->fds[fd].file == NULL)
+    {
+        _lock_release(&that->lock);
+        errno = EBADF;
+        return -1;
+    }
+
+    // Wait for reads in progress on a read-only mount
+    if (that->fd_locks)
+    {
+        _lock_acquire(&that->fd_locks[fd]);
+    }
+
+    int err = that->cache_sync(fd);
+    that->cache_free(fd);
+
+    if (that->fds[fd].z)
+    {
+        err = that->zflush(that->fds[fd].file, that->fds[fd].z);
+        zfree(that->fds[fd].z);
+    }
+
+    // Read-only handles stay open in the handle cache, which takes over
+    // the file and name
+    bool cached = that->hcache &&
+                  that->fds[fd].z == NULL &&
+                  that->fds[fd].flags == LFS_O_RDONLY &&
+                  !that->fds[fd].stale &&
+                  that->hcache_put(that->fds[fd].file, that->fds[fd].name);
+    if (cached)
+    {
+        that->fbuf_free(fd);
+    }
+    else
+    {
+        int cerr = that->file_close(that->fds[fd].file);
+        if (err == LFS_ERR_OK)
+        {
+            err = cerr;
+        }
+        that->fbuf_free(fd);
+
+        if (that->fds[fd].flags & LFS_O_WRONLY)
+        {
+            that->invalidate(that->fds[fd].name, false);
+        }
+
+        free(that->fds[fd].name);
+        free(that->fds[fd].file);
+    }
+
+    if (that->erase_counts && that->erases_unsaved >= that->wear_interval)
+    {
+        that->wear_save_locked();
+    }
+
+    that->fds[fd] = {};
+
+    if (that->fd_locks)
+    {
+        _lock_release(&that->fd_locks[fd]);
+    }
+
+    _lock_release(&that->lock);
+
+    return map_lfs_error(err);
+}
+
+int LittleFlash::fstat_p(void *ctx, int fd, struct stat *st)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    _lock_t *lock = that->read_lock(fd);
+
+    if (that->fds[fd].file == NULL)
+    {
+        _lock_release(lock);
+        errno = EBADF;
+        return -1;
+    }
+
+    // The open file knows its own size, including unsynced writes
+    lfs_soff_t size;
+    if (that->fds[fd].z)
+    {
+        size = that->fds[fd].z->size;
+    }
+    else if (that->fds[fd].cache_write)
+    {
+        size = that->cache_sync(fd);
+        if (size == LFS_ERR_OK)
+        {
+            size = lfs_file_size(&that->lfs, that->fds[fd].file);
+        }
+    }
+    else
+    {
+        size = lfs_file_size(&that->lfs, that->fds[fd].file);
+    }
+
+    _lock_release(lock);
+
+    if (size < 0)
+    {
+        return map_lfs_error(size);
+    }
+
+    *st = {};
+    st->st_size = size;
+    st->st_mode = S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO;
+
+    return 0;
+}
+
+int LittleFlash::stat_p(void *ctx, const char *path, struct stat *st)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    that->lock_acquire();
+
+    struct lfs_info lfs_info;
+    int err = that->dentry_stat(path, &lfs_info);
+
+    // The stored size of a compressed file isn't its real size
+    if (err == LFS_ERR_OK && lfs_info.type == LFS_TYPE_REG && that->compressed(path))
+    {
+        err = that->zstat(path, &lfs_info);
+    }
+
+    _lock_release(&that->lock);
+
+    if (err < 0)
+    {
+        return map_lfs_error(err);
+    }
+
+    *st = {};
+    st->st_size = lfs_info.size;
+    if (lfs_info.type == LFS_TYPE_DIR)
+    {
+        st->st_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
+    }
+    else
+    {
+        st->st_mode = S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO;
+    }
+
+    return 0;
+}
+
+int LittleFlash::unlink_p(void *ctx, const char *path)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    if (that->wear_file(path))
+    {
+        errno = EPERM;
+        return -1;
+    }
+
+    that->lock_acquire();
+
+    int err = lfs_remove(&that->lfs, path);
+
+    that->invalidate(path, false);
+
+    _lock_release(&that->lock);
+
+    return map_lfs_error(err);
+}
+
+int LittleFlash::rename_p(void *ctx, const char *src, const char *dst)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    if (that->compress_crossed(src, dst))
+    {
+        errno = EXDEV;
+        return -1;
+    }
+
+    if (that->wear_file(src) || that->wear_file(dst))
+    {
+        errno = EPERM;
+        return -1;
+    }
+
+    that->lock_acquire();
+
+    int err = lfs_rename(&that->lfs, src, dst);
+
+    that->invalidate(src, true);
+    that->invalidate(dst, true);
+
+    _lock_release(&that->lock);
+
+    return map_lfs_error(err);
+}
+
+DIR *LittleFlash::opendir_p(void *ctx, const char *name)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    vfs_lfs_dir_t *vfs_dir = (vfs_lfs_dir_t *) malloc(sizeof(vfs_lfs_dir_t));
+    if (vfs_dir == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    *vfs_dir = {};
+    vfs_dir->fs = that;
+
+    // The erase counts file is kept out of listings of the root
+    size_t depth;
+    size_t matched;
+    path_match(name, "", &depth, &matched);
+    vfs_dir->hide_wear = that->erase_counts && depth == 0;
+
+    // Remember where we are so entries can be added to the lookup cache
+    if (that->dentries)
+    {
+        vfs_dir->path_len = strlen(name);
+        while (vfs_dir->path_len > 0 && name[vfs_dir->path_len - 1] == '/')
+        {
+            vfs_dir->path_len--;
+        }
+
+        vfs_dir->path = (char *) malloc(vfs_dir->path_len + LFS_NAME_MAX + 2);
+        if (vfs_dir->path == NULL)
+        {
+            free(vfs_dir);
+            errno = ENOMEM;
+            return NULL;
+        }
+        memcpy(vfs_dir->path, name, vfs_dir->path_len);
+    }
+
+    that->lock_acquire();
+
+    int err = lfs_dir_open(&that->lfs, &vfs_dir->lfs_dir, name);
+
+    _lock_release(&that->lock);
+
+    if (err != LFS_ERR_OK)
+    {
+        free(vfs_dir->path);
+        free(vfs_dir);
+        vfs_dir = NULL;
+        map_lfs_error(err);
+    }
+
+    return (DIR *) vfs_dir;
+}
+
+struct dirent *LittleFlash::readdir_p(void *ctx, DIR *pdir)
+{
+    vfs_lfs_dir_t *vfs_dir = (vfs_lfs_dir_t *) pdir;
+    if (vfs_dir == NULL)
+    {
+        errno = EBADF;
+        return NULL;
+    }
+
+    struct dirent *out_dirent = NULL;
+
+    int err = readdir_r_p(ctx, pdir, &vfs_dir->dirent, &out_dirent);
+    if (err != 0)
+    {
+        errno = err;
+    }
+
+    return out_dirent;
+}
+
+int LittleFlash::readdir_r_p(void *ctx, DIR *pdir, struct dirent *entry, struct dirent **out_dirent)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    vfs_lfs_dir_t *vfs_dir = (vfs_lfs_dir_t *) pdir;
+    if (vfs_dir == NULL)
+    {
+        errno = EBADF;
+        return errno;
+    }
+
+    that->lock_acquire();
+
+    struct lfs_info lfs_info;
+    int err = dir_read(&that->lfs, vfs_dir, &lfs_info);
+    if (err > 0 && vfs_dir->path)
+    {
+        that->dentry_child(vfs_dir->path, vfs_dir->path_len, &lfs_info);
+    }
+
+    _lock_release(&that->lock);
+
+    if (err == 0)
+    {
+        *out_dirent = NULL;
+        return 0;
+    }
+
+    if (err < 0)
+    {
+        map_lfs_error(err);
+        return errno;
+    }
+
+    entry->d_ino = 0;
+    if (lfs_info.type == LFS_TYPE_REG)
+    {
+        entry->d_type = DT_REG;
+    }
+    else if (lfs_info.type == LFS_TYPE_DIR)
+    {
+        entry->d_type = DT_DIR;
+    }
+    else
+    {
+        entry->d_type = DT_UNKNOWN;
+    }
+    size_t len = strlcpy(entry->d_name, lfs_info.name, sizeof(entry->d_name));
+
+    // This "shouldn't" happen, but the LFS name length can be customized and may
+    // be longer than what's provided in "struct dirent"
+    if (len >= sizeof(entry->d_name))
+    {
+        errno = ENAMETOOLONG;
+        return errno;
+    }
+
+    vfs_dir->off++;
+
+    *out_dirent = entry;
+
+    return 0;
+}
+
+long LittleFlash::telldir_p(void *ctx, DIR *pdir)
+{
+    vfs_lfs_dir_t *vfs_dir = (vfs_lfs_dir_t *) pdir;
+    if (vfs_dir == NULL)
+    {
+        errno = EBADF;
+        return errno;
+    }
+
+    return vfs_dir->off;
+}
+
+void LittleFlash::seekdir_p(void *ctx, DIR *pdir, long offset)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    vfs_lfs_dir_t *vfs_dir = (vfs_lfs_dir_t *) pdir;
+    if (vfs_dir == NULL)
+    {
+        errno = EBADF;
+        return;
+    }
+
+    that->lock_acquire();
+
+    // ESP32 VFS expects simple 0 to n counted directory offsets but lfs
+    // doesn't so we need to "translate"...
+    int err = lfs_dir_rewind(&that->lfs, &vfs_dir->lfs_dir);
+    vfs_dir->err = LFS_ERR_OK;
+    if (err >= 0)
+    {
+        for (vfs_dir->off = 0; vfs_dir->off < offset; ++vfs_dir->off)
+        {
+            struct lfs_info lfs_info;
+            err = dir_read(&that->lfs, vfs_dir, &lfs_info);
+            if (err < 0)
+            {
+                break;
+            }
+        }
+    }
+
+    _lock_release(&that->lock);
+
+    if (err < 0)
+    {
+        map_lfs_error(err);
+        return;
+    }
+
+    return;
+}
+
+int LittleFlash::closedir_p(void *ctx, DIR *pdir)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    vfs_lfs_dir_t *vfs_dir = (vfs_lfs_dir_t *) pdir;
+    if (vfs_dir == NULL)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    that->lock_acquire();
+
+    int err = lfs_dir_close(&that->lfs, &vfs_dir->lfs_dir);
+
+    _lock_release(&that->lock);
+
+    free(vfs_dir->path);
+    free(vfs_dir);
+
+    return map_lfs_error(err);
+}
+
+int LittleFlash::mkdir_p(void *ctx, const char *name, mode_t mode)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    that->lock_acquire();
+
+    int err = lfs_mkdir(&that->lfs, name);
+
+    that->invalidate(name, false);
+
+    _lock_release(&that->lock);
+
+    return map_lfs_error(err);
+}
+
+int LittleFlash::rmdir_p(void *ctx, const char *name)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    that->lock_acquire();
+
+    int err = lfs_remove(&that->lfs, name);
+
+    that->invalidate(name, true);
+
+    _lock_release(&that->lock);
+
+    return map_lfs_error(err);
+}
+
+int LittleFlash::fsync_p(void *ctx, int fd)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    that->lock_acquire();
+
+    if (that->fds[fd].file == NULL)
+    {
+        _lock_release(&that->lock);
+        errno = EBADF;
+        return -1;
+    }
+
+    int err = that->cache_sync(fd);
+    if (err == LFS_ERR_OK && that->fds[fd].z)
+    {
+        err = that->zflush(that->fds[fd].file, that->fds[fd].z);
+    }
+
+    if (err == LFS_ERR_OK)
+    {
+        err = lfs_file_sync(&that->lfs, that->fds[fd].file);
+    }
+
+    if (that->fds[fd].flags & LFS_O_WRONLY)
+    {
+        that->invalidate(that->fds[fd].name, false);
+    }
+
+    if (that->erase_counts && that->erases_unsaved >= that->wear_interval)
+    {
+        that->wear_save_locked();
+    }
+
+    _lock_release(&that->lock);
+
+    return map_lfs_error(err);
+}
+
+int LittleFlash::truncate_p(void *ctx, const char *path, off_t length)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    if (length < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (that->wear_file(path))
+    {
+        errno = EACCES;
+        return -1;
+    }
+
+    that->lock_acquire();
+
+    lfs_file_t file;
+    int err = that->file_open(&file, path, LFS_O_WRONLY);
+    if (err == LFS_ERR_OK)
+    {
+        // Compressed files aren't opened for their index, so only
+        // emptying them is allowed here
+        if (that->compressed(path) && length != 0)
+        {
+            err = LFS_ERR_INVAL;
+        }
+        else
+        {
+            err = lfs_file_truncate(&that->lfs, &file, length);
+        }
+
+        int cerr = that->file_close(&file);
+        if (err == LFS_ERR_OK)
+        {
+            err = cerr;
+        }
+
+        that->invalidate(path, false);
+    }
+
+    _lock_release(&that->lock);
+
+    return map_lfs_error(err);
+}
+
+int LittleFlash::ftruncate_p(void *ctx, int fd, off_t length)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    that->lock_acquire();
+
+    if (that->fds[fd].file == NULL || !(that->fds[fd].flags & LFS_O_WRONLY))
+    {
+        _lock_release(&that->lock);
+        errno = EBADF;
+        return -1;
+    }
+
+    int err = that->cache_sync(fd);
+    if (err == LFS_ERR_OK)
+    {
+        err = that->fbuf_attach(fd);
+    }
+
+    if (err == LFS_ERR_OK)
+    {
+        err = that->truncate_locked(that->fds[fd].file, that->fds[fd].z, length);
+    }
+
+    that->invalidate(that->fds[fd].name, false);
+
+    _lock_release(&that->lock);
+
+    return map_lfs_error(err);
+}
+
+int LittleFlash::ioctl_p(void *ctx, int fd, int cmd, va_list args)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    switch (cmd)
+    {
+        case LITTLE_FLASH_IOC_READV:
+        {
+            little_flash_iov_t *v = va_arg(args, little_flash_iov_t *);
+            return that->vread(fd, v->iov, v->iovcnt);
+        }
+        case LITTLE_FLASH_IOC_WRITEV:
+        {
+            little_flash_iov_t *v = va_arg(args, little_flash_iov_t *);
+            return that->vwrite(fd, v->iov, v->iovcnt);
+        }
+        case LITTLE_FLASH_IOC_PREAD:
+        {
+            little_flash_pio_t *p = va_arg(args, little_flash_pio_t *);
+            return pread_p(that, fd, p->buf, p->size, p->offset);
+        }
+        case LITTLE_FLASH_IOC_PWRITE:
+        {
+            little_flash_pio_t *p = va_arg(args, little_flash_pio_t *);
+            return pwrite_p(that, fd, p->buf, p->size, p->offset);
+        }
+        case LITTLE_FLASH_IOC_SET_CACHE:
+        {
+            size_t size = va_arg(args, size_t);
+
+            _lock_t *lock = that->read_lock(fd);
+            int err = that->cache_set(fd, size);
+            _lock_release(lock);
+
+            return map_lfs_error(err);
+        }
+    }
+
+    errno = ENOTTY;
+    return -1;
+}
+
+ssize_t LittleFlash::pread_p(void *ctx, int fd, void *dst, size_t size, off_t offset)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    _lock_t *lock = that->read_lock(fd);
+
+    lfs_ssize_t read = that->file_pread(fd, dst, size, offset);
+
+    _lock_release(lock);
+
+    if (read < 0)
+    {
+        return map_lfs_error(read);
+    }
+
+    return read;
+}
+
+ssize_t LittleFlash::pwrite_p(void *ctx, int fd, const void *src, size_t size, off_t offset)
+{
+    LittleFlash *that = (LittleFlash *) ctx;
+
+    if (that->cfg.read_only)
+    {
+        errno = EROFS;
+        return -1;
+    }
+
+    that->lock_acquire();
+
+    lfs_ssize_t written = that->file_pwrite(fd, src, size, offset);
+
+    _lock_release(&that->lock);
+
+    if (written < 0)
+    {
+        return map_lfs_error(written);
+    }
+
+    return written;
+}
+
+// ============================================================================
+// Bulk directory listing
+// ============================================================================
+
+ssize_t LittleFlash::readdir_bulk(DIR *pdir, little_flash_dirent_t *entries, size_t count)
+{
+    vfs_lfs_dir_t *vfs_dir = (vfs_lfs_dir_t *) pdir;
+    if (vfs_dir == NULL || vfs_dir->fs != this)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    // An error hit after some entries were returned is reported now
+    if (vfs_dir->err < 0)
+    {
+        int err = vfs_dir->err;
+        vfs_dir->err = LFS_ERR_OK;
+        return map_lfs_error(err);
+    }
+
+    size_t filled = 0;
+    int err = LFS_ERR_OK;
+
+    lock_acquire();
+
+    while (filled < count)
+    {
+        struct lfs_info lfs_info;
+        err = dir_read(&lfs, vfs_dir, &lfs_info);
+        if (err <= 0)
+        {
+            break;
+        }
+
+        if (vfs_dir->path)
+        {
+            dentry_child(vfs_dir->path, vfs_dir->path_len, &lfs_info);
+        }
+
+        little_flash_dirent_t *entry = &entries[filled++];
+        strlcpy(entry->name, lfs_info.name, sizeof(entry->name));
+        if (lfs_info.type == LFS_TYPE_REG)
+        {
+            entry->type = DT_REG;
+        }
+        else if (lfs_info.type == LFS_TYPE_DIR)
+        {
+            entry->type = DT_DIR;
+        }
+        else
+        {
+            entry->type = DT_UNKNOWN;
+        }
+        entry->size = lfs_info.size;
+
+        vfs_dir->off++;
+    }
+
+    _lock_release(&lock);
+
+    // Don't lose the entries already filled, hold the error for next time
+    if (err < 0 && filled > 0)
+    {
+        vfs_dir->err = err;
+    }
+    else if (err < 0)
+    {
+        return map_lfs_error(err);
+    }
+
+    return filled;
+}
+
+// ============================================================================
+// Directory trees
+// ============================================================================
+
+int LittleFlash::remove_tree(const char *path)
+{
+    const char *lpath = lfs_path(path);
+    if (lpath == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (cfg.read_only)
+    {
+        errno = EROFS;
+        return -1;
+    }
+
+    if (wear_file(lpath))
+    {
+        errno = EPERM;
+        return -1;
+    }
+
+    walk_t w = {};
+    size_t len;
+    int err = walk_init(&w, lpath, &len);
+    if (err < 0)
+    {
+        return map_lfs_error(err);
+    }
+
+    lock_acquire();
+
+    struct lfs_info info;
+    err = lfs_stat(&lfs, len ? w.path : "/", &info);
+    if (err == LFS_ERR_OK && info.type == LFS_TYPE_DIR)
+    {
+        err = remove_dir(&w, len);
+    }
+
+    // The root itself can't be removed, only emptied.  Everything below
+    // was dropped from the caches as it went, so only the top is left.
+    if (err == LFS_ERR_OK && len > 0)
+    {
+        invalidate(w.path, true);
+        err = lfs_remove(&lfs, w.path);
+    }
+
+    _lock_release(&lock);
+
+    free(w.path);
+
+    return map_lfs_error(err);
+}
+
+int LittleFlash::usage(const char *path, little_flash_usage_t *usage)
+{
+    const char *lpath = lfs_path(path);
+    if (lpath == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *usage = {};
+
+    walk_t w = {};
+    w.usage = usage;
+    size_t len;
+    int err = walk_init(&w, lpath, &len);
+    if (err < 0)
+    {
+        return map_lfs_error(err);
+    }
+
+    lock_acquire();
+
+    struct lfs_info info;
+    err = lfs_stat(&lfs, len ? w.path : "/", &info);
+    if (err == LFS_ERR_OK)
+    {
+        if (info.type == LFS_TYPE_DIR)
+        {
+            err = usage_dir(&w, len);
+        }
+        else
+        {
+            usage->files++;
+            usage->bytes += info.size;
+            usage->blocks += (info.size + sector_sz - 1) / sector_sz;
+        }
+    }
+
+    _lock_release(&lock);
+
+    free(w.path);
+
+    return map_lfs_error(err);
+}
+
+// Counts every block LittleFS has in use, which takes reading the block
+// lists of all files
+int LittleFlash::space(little_flash_space_t *space)
+{
+    uint32_t *used = (uint32_t *) calloc((block_cnt + 31) / 32, sizeof(uint32_t));
+    if (used == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    lock_acquire();
+
+    int err = lfs_traverse(&lfs, prealloc_mark, used);
+
+    _lock_release(&lock);
+
+    *space = {};
+    space->block_size = sector_sz;
+    space->blocks = block_cnt;
+    for (lfs_block_t b = 0; err == LFS_ERR_OK && b < block_cnt; b++)
+    {
+        if (used[b / 32] & (1U << (b % 32)))
+        {
+            space->used++;
+        }
+    }
+
+    free(used);
+
+    return map_lfs_error(err);
+}
+
+// Copies the starting path without trailing slashes, so the root is ""
+int LittleFlash::walk_init(walk_t *w, const char *path, size_t *len)
+{
+    *len = strlen(path);
+    while (*len > 0 && path[*len - 1] == '/')
+    {
+        (*len)--;
+    }
+
+    w->cap = *len + LFS_NAME_MAX + 2;
+    w->path = (char *) malloc(w->cap);
+    if (w->path == NULL)
+    {
+        return LFS_ERR_NOMEM;
+    }
+
+    memcpy(w->path, path, *len);
+    w->path[*len] = '\0';
+
+    return LFS_ERR_OK;
+}
+
+int LittleFlash::walk_child(walk_t *w, size_t len, const char *name, size_t *child_len)
+{
+    *child_len = len + 1 + strlen(name);
+
+    // Leave room for the child's children too
+    if (*child_len + LFS_NAME_MAX + 2 > w->cap)
+    {
+        size_t cap = *child_len + LFS_NAME_MAX + 2;
+        char *path = (char *) realloc(w->path, cap);
+        if (path == NULL)
+        {
+            return LFS_ERR_NOMEM;
+        }
+        w->path = path;
+        w->cap = cap;
+    }
+
+    w->path[len] = '/';
+    strcpy(w->path + len + 1, name);
+
+    return LFS_ERR_OK;
+}
+
+// Must be called with lock held and no directories open
+void LittleFlash::walk_yield(walk_t *w)
+{
+    if (++w->count % WALK_YIELD_ENTRIES == 0)
+    {
+        lock_yield();
+    }
+}
+
+// Must be called with lock held.  The directory is closed while visiting
+// subdirectories or yielding and reopened at the same position, so no
+// handle is held across a lock release.
+int LittleFlash::usage_dir(walk_t *w, size_t len)
+{
+    lfs_dir_t dir;
+
+    int err = lfs_dir_open(&lfs, &dir, len ? w->path : "/");
+    if (err < 0)
+    {
+        return err;
+    }
+
+    w->usage->dirs++;
+    w->usage->blocks += 2;
+
+    while (true)
+    {
+        struct lfs_info info;
+        err = lfs_dir_read(&lfs, &dir, &info);
+        if (err <= 0)
+        {
+            break;
+        }
+
+        if (strcmp(info.name, ".") == 0 || strcmp(info.name, "..") == 0)
+        {
+            continue;
+        }
+
+        if (info.type == LFS_TYPE_REG)
+        {
+            w->usage->files++;
+            w->usage->bytes += info.size;
+            w->usage->blocks += (info.size + sector_sz - 1) / sector_sz;
+        }
+
+        lfs_soff_t pos = lfs_dir_tell(&lfs, &dir);
+        lfs_dir_close(&lfs, &dir);
+
+        if (info.type == LFS_TYPE_DIR)
+        {
+            size_t child_len;
+            err = walk_child(w, len, info.name, &child_len);
+            if (err == LFS_ERR_OK)
+            {
+                err = usage_dir(w, child_len);
+            }
+            w->path[len] = '\0';
+
+            if (err < 0)
+            {
+                return err;
+            }
+        }
+
+        walk_yield(w);
+
+        err = lfs_dir_open(&lfs, &dir, len ? w->path : "/");
+        if (err < 0)
+        {
+            return err;
+        }
+
+        err = lfs_dir_seek(&lfs, &dir, pos);
+        if (err < 0)
+        {
+            break;
+        }
+    }
+
+    lfs_dir_close(&lfs, &dir);
+
+    return err < 0 ? err : LFS_ERR_OK;
+}
+
+// Must be called with lock held.  Removes everything below the directory
+// a batch at a time, since removing entries moves the others around.
+int LittleFlash::remove_dir(walk_t *w, size_t len)
+{
+    typedef struct
+    {
+        char name[LFS_NAME_MAX + 1];
+        bool dir;
+    } batch_t;
+
+    batch_t *batch = (batch_t *) malloc(REMOVE_BATCH * sizeof(batch_t));
+    if (batch == NULL)
+    {
+        return LFS_ERR_NOMEM;
+    }
+
+    int err;
+    int count;
+    do
+    {
+        lfs_dir_t dir;
+        err = lfs_dir_open(&lfs, &dir, len ? w->path : "/");
+        if (err < 0)
+        {
+            break;
+        }
+
+        count = 0;
+        while (count < REMOVE_BATCH)
+        {
+            struct lfs_info info;
+            err = lfs_dir_read(&lfs, &dir, &info);
+            if (err <= 0)
+            {
+                break;
+            }
+
+            if (strcmp(info.name, ".") == 0 || strcmp(info.name, "..") == 0)
+            {
+                continue;
+            }
+
+            // Emptying the root leaves the erase counts
+            if (len == 0 && erase_counts && strcmp(info.name, WEAR_FILE + 1) == 0)
+            {
+                continue;
+            }
+
+            strcpy(batch[count].name, info.name);
+            batch[count].dir = info.type == LFS_TYPE_DIR;
+            count++;
+        }
+
+        lfs_dir_close(&lfs, &dir);
+
+        for (int i = 0; err >= 0 && i < count; i++)
+        {
+            size_t child_len;
+            err = walk_child(w, len, batch[i].name, &child_len);
+            if (err == LFS_ERR_OK && batch[i].dir)
+            {
+                err = remove_dir(w, child_len);
+            }
+            // Drop it from the caches before the lock can be released, so
+            // nobody is handed a cached entry for something that's gone
+            if (err == LFS_ERR_OK)
+            {
+                invalidate(w->path, batch[i].dir);
+                err = lfs_remove(&lfs, w->path);
+            }
+            w->path[len] = '\0';
+
+            walk_yield(w);
+        }
+    } while (err >= 0 && count > 0);
+
+    free(batch);
+
+    return err < 0 ? err : LFS_ERR_OK;
+}
+
+// ============================================================================
+// File copy
+// ============================================================================
+
+int LittleFlash::copy(const char *src, const char *dst)
+{
+    const char *lsrc = lfs_path(src);
+    const char *ldst = lfs_path(dst);
+    if (lsrc == NULL || ldst == NULL || strcmp(lsrc, ldst) == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (cfg.read_only)
+    {
+        errno = EROFS;
+        return -1;
+    }
+
+    if (wear_file(ldst))
+    {
+        errno = EACCES;
+        return -1;
+    }
+
+    // Compressed data is copied as is, so both must agree
+    if (compressed(lsrc) != compressed(ldst))
+    {
+        errno = EXDEV;
+        return -1;
+    }
+
+    lock_acquire();
+
+    // One block sized buffer, allocated on first use and shared by all
+    // copies since it's only used with the lock held
+    if (copy_buf == NULL)
+    {
+        copy_buf = (uint8_t *) malloc(sector_sz);
+        if (copy_buf == NULL)
+        {
+            _lock_release(&lock);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    lfs_file_t sfile;
+    int err = file_open(&sfile, lsrc, LFS_O_RDONLY);
+    if (err < 0)
+    {
+        _lock_release(&lock);
+        return map_lfs_error(err);
+    }
+
+    lfs_file_t dfile;
+    err = file_open(&dfile, ldst, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err < 0)
+    {
+        file_close(&sfile);
+        _lock_release(&lock);
+        return map_lfs_error(err);
+    }
+
+    invalidate(ldst, false);
+
+    // Whole blocks go straight from flash into the buffer, bypassing the
+    // source's file cache
+    while (true)
+    {
+        lfs_ssize_t len = lfs_file_read(&lfs, &sfile, copy_buf, sector_sz);
+        if (len <= 0)
+        {
+            err = len;
+            break;
+        }
+
+        lfs_ssize_t written = lfs_file_write(&lfs, &dfile, copy_buf, len);
+        if (written < 0)
+        {
+            err = written;
+            break;
+        }
+
+        // Let others in between blocks
+        lock_yield();
+    }
+
+    file_close(&sfile);
+
+    int cerr = file_close(&dfile);
+    if (err == LFS_ERR_OK)
+    {
+        err = cerr;
+    }
+
+    // Don't leave a partial copy behind
+    if (err < 0)
+    {
+        lfs_remove(&lfs, ldst);
+    }
+
+    invalidate(ldst, false);
+
+    _lock_release(&lock);
+
+    return map_lfs_error(err);
+}
+
+// ============================================================================
+// Vectored and positional I/O
+// ============================================================================
+
+//
+// The VFS doesn't pass readv() and writev() on, so these go through ioctl()
+// to get from the application's fd to ours.  The whole array is transferred
+// with one lock hold, stopping early on a short transfer like readv() and
+// writev() do.  pread() and pwrite() seek and transfer with one lock hold
+// and leave the file position alone.
+//
+
+ssize_t LittleFlash::readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    little_flash_iov_t v = { iov, iovcnt };
+
+    return ioctl(fd, LITTLE_FLASH_IOC_READV, &v);
+}
+
+ssize_t LittleFlash::writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    little_flash_iov_t v = { iov, iovcnt };
+
+    return ioctl(fd, LITTLE_FLASH_IOC_WRITEV, &v);
+}
+
+// For ESP-IDF versions whose VFS doesn't pass pread() and pwrite() on
+ssize_t LittleFlash::pread(int fd, void *dst, size_t size, off_t offset)
+{
+    little_flash_pio_t p = { dst, size, offset };
+
+    return ioctl(fd, LITTLE_FLASH_IOC_PREAD, &p);
+}
+
+ssize_t LittleFlash::pwrite(int fd, const void *src, size_t size, off_t offset)
+{
+    little_flash_pio_t p = { (void *) src, size, offset };
+
+    return ioctl(fd, LITTLE_FLASH_IOC_PWRITE, &p);
+}
+
+ssize_t LittleFlash::vread(int fd, const struct iovec *iov, int iovcnt)
+{
+    if (iovcnt < 0 || (iov == NULL && iovcnt > 0))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _lock_t *rlock = read_lock(fd);
+
+    ssize_t done = 0;
+    lfs_ssize_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        len = file_read(fd, iov[i].iov_base, iov[i].iov_len);
+        if (len < 0)
+        {
+            break;
+        }
+
+        done += len;
+        if ((size_t) len < iov[i].iov_len)
+        {
+            break;
+        }
+    }
+
+    _lock_release(rlock);
+
+    // Report an error only if nothing was read
+    if (len < 0 && done == 0)
+    {
+        return map_lfs_error(len);
+    }
+
+    return done;
+}
+
+ssize_t LittleFlash::vwrite(int fd, const struct iovec *iov, int iovcnt)
+{
+    if (iovcnt < 0 || (iov == NULL && iovcnt > 0))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Readers on a read-only mount only hold the fd's lock, so the cache
+    // mustn't be touched here
+    if (cfg.read_only)
+    {
+        errno = EROFS;
+        return -1;
+    }
+
+    lock_acquire();
+
+    ssize_t done = 0;
+    lfs_ssize_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        len = file_write(fd, iov[i].iov_base, iov[i].iov_len);
+        if (len < 0)
+        {
+            break;
+        }
+
+        done += len;
+        if ((size_t) len < iov[i].iov_len)
+        {
+            break;
+        }
+    }
+
+    _lock_release(&lock);
+
+    if (len < 0 && done == 0)
+    {
+        return map_lfs_error(len);
+    }
+
+    return done;
+}
+
+// ============================================================================
+// Per-file caches
+// ============================================================================
+
+//
+// LittleFS gives every file a cache of prog_size bytes.  set_cache() adds a
+// cache of any size in front of it for one open file, so a large file read
+// or written sequentially moves whole blocks per call into LittleFS while
+// small files get by with prog_size alone.  Buffered writes reach LittleFS
+// when the cache fills or on fsync(), lseek(), fstat() or close(), which is
+// also where their errors are reported.
+//
+
+// Opens path through the VFS and gives it a cache of the given size
+int LittleFlash::open_cached(const char *path, int flags, size_t cache)
+{
+    int fd = ::open(path, flags, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (set_cache(fd, cache) < 0)
+    {
+        int err = errno;
+        ::close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+// Sets the cache size of an open file, 0 to go back to LittleFS's own
+int LittleFlash::set_cache(int fd, size_t size)
+{
+    return ioctl(fd, LITTLE_FLASH_IOC_SET_CACHE, size);
+}
+
+// Must be called with the fd's read lock held
+int LittleFlash::cache_set(int fd, size_t size)
+{
+    if (fds[fd].file == NULL)
+    {
+        return LFS_ERR_BADF;
+    }
+
+    // Compressed files already work a chunk at a time
+    if (fds[fd].z && size > 0)
+    {
+        return LFS_ERR_INVAL;
+    }
+
+    // The old cache stays if there's no room for the new one
+    uint8_t *cache = NULL;
+    if (size > 0)
+    {
+        cache = (uint8_t *) (pool_id >= 0 ? cfg.pool->alloc(pool_id, size) : malloc(size));
+        if (cache == NULL)
+        {
+            return LFS_ERR_NOMEM;
+        }
+    }
+
+    int err = cache_sync(fd);
+    if (err < 0)
+    {
+        if (pool_id >= 0)
+        {
+            cfg.pool->release(pool_id, cache, size);
+        }
+        else
+        {
+            free(cache);
+        }
+        return err;
+    }
+
+    cache_free(fd);
+
+    fds[fd].cache = cache;
+    fds[fd].cache_size = size;
+
+    return LFS_ERR_OK;
+}
+
+// Must be called with the fd's read lock held and the cache synced
+void LittleFlash::cache_free(int fd)
+{
+    if (pool_id >= 0)
+    {
+        cfg.pool->release(pool_id, fds[fd].cache, fds[fd].cache_size);
+    }
+    else
+    {
+        free(fds[fd].cache);
+    }
+
+    fds[fd].cache = NULL;
+    fds[fd].cache_size = 0;
+}
+
+// Must be called with the fd's read lock held.  Writes out buffered data,
+// or seeks back over read ahead that wasn't used, so the LittleFS position
+// is the application's position again.
+int LittleFlash::cache_sync(int fd)
+{
+    vfs_fd_t *f = &fds[fd];
+    int err = LFS_ERR_OK;
+
+    if (f->cache_write && f->cache_len > 0)
+    {
+        err = fbuf_attach(fd);
+        if (err == LFS_ERR_OK)
+        {
+            lfs_ssize_t len = lfs_file_write(&lfs, f->file, f->cache, f->cache_len);
+            if (len < 0)
+            {
+                err = len;
+            }
+        }
+    }
+    else if (!f->cache_write && f->cache_pos < f->cache_len)
+    {
+        lfs_soff_t pos = lfs_file_seek(&lfs, f->file, -(lfs_soff_t) (f->cache_len - f->cache_pos), LFS_SEEK_CUR);
+        if (pos < 0)
+        {
+            err = pos;
+        }
+    }
+
+    f->cache_len = 0;
+    f->cache_pos = 0;
+    f->cache_write = false;
+
+    return err;
+}
+
+// Must be called with the fd's read lock held
+lfs_ssize_t LittleFlash::cache_read(int fd, void *dst, size_t size)
+{
+    vfs_fd_t *f = &fds[fd];
+
+    if (f->cache_write)
+    {
+        int err = cache_sync(fd);
+        if (err < 0)
+        {
+            return err;
+        }
+    }
+
+    uint8_t *d = (uint8_t *) dst;
+    size_t done = 0;
+    while (done < size)
+    {
+        if (f->cache_pos == f->cache_len)
+        {
+            f->cache_len = 0;
+            f->cache_pos = 0;
+
+            // Reads at least as big as the cache skip it
+            lfs_ssize_t len;
+            if (size - done >= f->cache_size)
+            {
+                len = lfs_file_read(&lfs, f->file, d + done, size - done);
+                if (len > 0)
+                {
+                    done += len;
+                }
+                else if (len < 0 && done == 0)
+                {
+                    return len;
+                }
+                break;
+            }
+
+            len = lfs_file_read(&lfs, f->file, f->cache, f->cache_size);
+            if (len <= 0)
+            {
+                if (len < 0 && done == 0)
+                {
+                    return len;
+                }
+                break;
+            }
+            f->cache_len = len;
+        }
+
+        size_t n = f->cache_len - f->cache_pos;
+        if (n > size - done)
+        {
+            n = size - done;
+        }
+
+        memcpy(d + done, f->cache + f->cache_pos, n);
+        f->cache_pos += n;
+        done += n;
+    }
+
+    return done;
+}
+
+// Must be called with lock held
+lfs_ssize_t LittleFlash::cache_write(int fd, const void *src, size_t size)
+{
+    vfs_fd_t *f = &fds[fd];
+
+    if (!f->cache_write)
+    {
+        int err = cache_sync(fd);
+        if (err < 0)
+        {
+            return err;
+        }
+    }
+
+    if (f->cache_len + size > f->cache_size)
+    {
+        int err = cache_sync(fd);
+        if (err < 0)
+        {
+            return err;
+        }
+
+        // Writes at least as big as the cache skip it
+        if (size >= f->cache_size)
+        {
+            return lfs_file_write(&lfs, f->file, src, size);
+        }
+    }
+
+    memcpy(f->cache + f->cache_len, src, size);
+    f->cache_len += size;
+    f->cache_write = true;
+
+    return size;
+}
+
+// ============================================================================
+// Shared memory pool
+// ============================================================================
+
+//
+// With a LittlePool in the config, the mount's LittleFS buffers, the
+// caches of its open files, cached handles and per-file caches are charged
+// to the pool.  The LittleFS buffers stay for as long as the mount, but
+// when another mount needs room the pool asks this one to give back what
+// it can do without.
+//
+
+// Called by the pool, returns the bytes given back.  Cached handles go
+// first, least recently used first, then per-file caches with no unwritten
+// data, whose files carry on with LittleFS's own cache.  A mount that's busy
+// keeps everything.
+size_t LittleFlash::pool_reclaim(size_t want)
+{
+    if (_lock_try_acquire(&lock) != 0)
+    {
+        return 0;
+    }
+
+    size_t freed = 0;
+    while (hcache && freed < want)
+    {
+        hcache_t *victim = NULL;
+        for (int i = 0; i < cfg.handle_cache; i++)
+        {
+            hcache_t *h = &hcache[i];
+            if (h->file && (victim == NULL || h->used < victim->used))
+            {
+                victim = h;
+            }
+        }
+
+        if (victim == NULL)
+        {
+            break;
+        }
+
+        hcache_evict(victim);
+        freed += hcache_size;
+    }
+
+    for (int fd = 0; fd < cfg.open_files && freed < want; fd++)
+    {
+        if (fds[fd].cache == NULL || fds[fd].cache_write)
+        {
+            continue;
+        }
+
+        // Don't wait for a read in progress on a read-only mount
+        if (fd_locks && _lock_try_acquire(&fd_locks[fd]) != 0)
+        {
+            continue;
+        }
+
+        if (cache_sync(fd) == LFS_ERR_OK)
+        {
+            freed += fds[fd].cache_size;
+            cache_free(fd);
+        }
+
+        if (fd_locks)
+        {
+            _lock_release(&fd_locks[fd]);
+        }
+    }
+
+    _lock_release(&lock);
+
+    return freed;
+}
+
+// Notes when the mount was used.  The pool reads this from other mounts'
+// tasks, hence the atomics.
+void LittleFlash::pool_touch()
+{
+    __atomic_store_n(&pool_tick, xTaskGetTickCount(), __ATOMIC_RELAXED);
+}
+
+uint32_t LittleFlash::pool_last_used()
+{
+    return __atomic_load_n(&pool_tick, __ATOMIC_RELAXED);
+}
+
+// Opens a file with the cache LittleFS mallocs for it, charged to the pool
+int LittleFlash::file_open(lfs_file_t *file, const char *path, int flags)
+{
+    if (pool_id >= 0 && !cfg.pool->charge(pool_id, lfs_cfg.prog_size))
+    {
+        return LFS_ERR_NOMEM;
+    }
+
+    int err = lfs_file_open(&lfs, file, path, flags);
+    if (err < 0 && pool_id >= 0)
+    {
+        cfg.pool->uncharge(pool_id, lfs_cfg.prog_size);
+    }
+
+    return err;
+}
+
+// Closes any file, giving back the cache if LittleFS malloced it
+int LittleFlash::file_close(lfs_file_t *file)
+{
+    bool charged = file->cfg->buffer == NULL;
+
+    int err = lfs_file_close(&lfs, file);
+    if (charged && pool_id >= 0)
+    {
+        cfg.pool->uncharge(pool_id, lfs_cfg.prog_size);
+    }
+
+    return err;
+}
+
+// ============================================================================
+// Shared file buffers
+// ============================================================================
+
+//
+// LittleFS gives every open file a buffer of prog_size bytes, a whole
+// sector by default, so memory grows with open_files even when only a few
+// files are in use at once.  With file_buffers set, uncompressed files
+// opened through the VFS share that many buffers instead.  A file gets one
+// when it first reads or writes and keeps it until another file needs it,
+// at which point the buffer idle longest is taken back, from a file that's
+// only read if there is one, with its unwritten data flushed to flash
+// first.  A file without a buffer has nothing buffered, so seeking, syncing
+// and closing it don't need one.
+//
+
+// Must be called with the fd's read lock held
+int LittleFlash::fbuf_attach(int fd)
+{
+    vfs_fd_t *f = &fds[fd];
+
+    if (fbufs == NULL || f->z)
+    {
+        return LFS_ERR_OK;
+    }
+
+    while (true)
+    {
+        _lock_acquire(&fbuf_lock);
+
+        if (f->fbuf)
+        {
+            f->fbuf->used = ++fbuf_clock;
+            _lock_release(&fbuf_lock);
+            return LFS_ERR_OK;
+        }
+
+        fbuf_t *b = NULL;
+        for (int i = 0; i < cfg.file_buffers && b == NULL; i++)
+        {
+            if (fbufs[i].fd == -1)
+            {
+                b = &fbufs[i];
+            }
+        }
+
+        // None free, so take one from another file, idle longest first.
+        // Files only being read give theirs up for nothing, while a file
+        // being written has its partial block flushed and its next write
+        // copies that block to a new, erased one.  A flush error stays
+        // with the file it belongs to and the next file is tried.
+        bool busy = false;
+        for (int pass = 0; pass < 2 && b == NULL; pass++)
+        {
+            uint32_t last = 0;
+            while (b == NULL)
+            {
+                fbuf_t *victim = NULL;
+                for (int i = 0; i < cfg.file_buffers; i++)
+                {
+                    bool writer = (fds[fbufs[i].fd].flags & LFS_O_WRONLY) != 0;
+                    if (writer != (pass > 0) || fbufs[i].used <= last)
+                    {
+                        continue;
+                    }
+
+                    if (victim == NULL || fbufs[i].used < victim->used)
+                    {
+                        victim = &fbufs[i];
+                    }
+                }
+
+                if (victim == NULL)
+                {
+                    break;
+                }
+                last = victim->used;
+
+                if (fbuf_take(victim, &busy) == LFS_ERR_OK)
+                {
+                    b = victim;
+                }
+            }
+        }
+
+        if (b)
+        {
+            // Whatever's in the buffer belongs to another file
+            b->fd = fd;
+            b->used = ++fbuf_clock;
+            f->fbuf = b;
+            f->file->cache.buffer = b->buf;
+            f->file->cache.block = 0xffffffff;
+
+            _lock_release(&fbuf_lock);
+            return LFS_ERR_OK;
+        }
+
+        _lock_release(&fbuf_lock);
+
+        // Reads on a read-only mount hold their buffers briefly
+        if (!busy)
+        {
+            return LFS_ERR_NOMEM;
+        }
+
+        vTaskDelay(1);
+    }
+}
+
+// Must be called with the fd's read lock and fbuf_lock held.  Takes the
+// buffer from its file, busy=true if that file is being read right now.
+int LittleFlash::fbuf_take(fbuf_t *b, bool *busy)
+{
+    int fd = b->fd;
+
+    if (fd_locks && _lock_try_acquire(&fd_locks[fd]) != 0)
+    {
+        *busy = true;
+        return LFS_ERR_NOMEM;
+    }
+
+    // Seeking flushes the file's buffer, an error stays with the file
+    int err = LFS_ERR_OK;
+    if (fds[fd].flags & LFS_O_WRONLY)
+    {
+        lfs_soff_t pos = lfs_file_seek(&lfs, fds[fd].file, 0, LFS_SEEK_CUR);
+        if (pos < 0)
+        {
+            err = pos;
+        }
+    }
+
+    if (err == LFS_ERR_OK)
+    {
+        fds[fd].file->cache.buffer = NULL;
+        fds[fd].fbuf = NULL;
+        b->fd = -1;
+
+        _lock_acquire(&dev_lock);
+        stats.buffer_reclaims++;
+        _lock_release(&dev_lock);
+    }
+
+    if (fd_locks)
+    {
+        _lock_release(&fd_locks[fd]);
+    }
+
+    return err;
+}
+
+// Must be called with the fd's read lock held and nothing unwritten in
+// the file's buffer
+void LittleFlash::fbuf_free(int fd)
+{
+    if (fds[fd].fbuf == NULL)
+    {
+        return;
+    }
+
+    _lock_acquire(&fbuf_lock);
+
+    fds[fd].fbuf->fd = -1;
+    fds[fd].fbuf->used = 0;
+    fds[fd].fbuf = NULL;
+    fds[fd].file->cache.buffer = NULL;
+
+    _lock_release(&fbuf_lock);
+}
+
+// ============================================================================
+// Streaming file contents
+// ============================================================================
+
+//
+// Sends up to count bytes starting at offset to the sink, a block at a time.
+// Flash reads land in a buffer of its own, so the sink runs without the lock
+// and can take as long as it likes.  Returns the number of bytes sent, which
+// is less than count at the end of the file, or -1 if reading or the sink
+// failed.
+//
+ssize_t LittleFlash::sendfile(const char *path, off_t offset, size_t count, little_flash_sink_t sink, void *ctx)
+{
+    const char *lpath = lfs_path(path);
+    if (lpath == NULL || offset < 0 || sink == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint8_t *buf = (uint8_t *) malloc(sector_sz);
+    if (buf == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Going through an fd gets compressed files, the handle cache and
+    // unlocked reads on read-only mounts for free
+    int fd = open_p(this, lpath, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        free(buf);
+        return -1;
+    }
+
+    ssize_t sent = -1;
+    if (lseek_p(this, fd, offset, SEEK_SET) >= 0)
+    {
+        sent = 0;
+        while ((size_t) sent < count)
+        {
+            size_t size = std::min(count - sent, sector_sz);
+
+            _lock_t *rlock = read_lock(fd);
+
+            lfs_ssize_t len = file_read(fd, buf, size);
+
+            _lock_release(rlock);
+
+            if (len <= 0)
+            {
+                if (len < 0)
+                {
+                    sent = map_lfs_error(len);
+                }
+                break;
+            }
+
+            if (sink(ctx, buf, len) < 0)
+            {
+                sent = -1;
+                break;
+            }
+
+            sent += len;
+        }
+    }
+
+    // Closing a read-only file only fails if it was never open
+    int err = errno;
+    close_p(this, fd);
+    errno = err;
+
+    free(buf);
+
+    return sent;
+}
+
+// ============================================================================
+// Truncation and preallocation
+// ============================================================================
+
+int LittleFlash::truncate(const char *path, off_t size)
+{
+    const char *lpath = lfs_path(path);
+    if (lpath == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (cfg.read_only)
+    {
+        errno = EROFS;
+        return -1;
+    }
+
+    return truncate_p(this, lpath, size);
+}
+
+// Must be called with lock held
+int LittleFlash::truncate_locked(lfs_file_t *file, zfile_t *z, off_t size)
+{
+    if (size < 0)
+    {
+        return LFS_ERR_INVAL;
+    }
+
+    if (z == NULL)
+    {
+        return lfs_file_truncate(&lfs, file, size);
+    }
+
+    // Chunks can't be cut, so a compressed file can only be emptied
+    if ((lfs_off_t) size == z->size)
+    {
+        return LFS_ERR_OK;
+    }
+
+    if (size != 0)
+    {
+        return LFS_ERR_INVAL;
+    }
+
+    int err = lfs_file_truncate(&lfs, file, 0);
+    if (err == LFS_ERR_OK)
+    {
+        z->len = 0;
+        z->start = 0;
+        z->tail = false;
+        z->flushed = 0;
+        z->size = 0;
+        z->end = 0;
+        z->chunks = 0;
+    }
+
+    return err;
+}
+
+//
+// LittleFS copies on write, so blocks can't be handed to a file before it
+// writes them.  What makes a growing file stall is erasing each block as
+// it's allocated and running out of space part way.  preallocate() checks
+// the space up front and erases the free blocks the allocator will hand out
+// next, so those erases are skipped when the blocks are allocated.  A block
+// that's programmed is no longer blank, so a wrong guess just means a
+// normal erase later.
+//
+int LittleFlash::preallocate(const char *path, off_t size)
+{
+    const char *lpath = lfs_path(path);
+    if (lpath == NULL || size < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (cfg.read_only)
+    {
+        errno = EROFS;
+        return -1;
+    }
+
+    if (wear_file(lpath))
+    {
+        errno = EACCES;
+        return -1;
+    }
+
+    size_t words = (block_cnt + 31) / 32;
+    uint32_t *used = (uint32_t *) calloc(words, sizeof(uint32_t));
+    if (used == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    lock_acquire();
+
+    if (blank == NULL)
+    {
+        blank = (uint32_t *) calloc(words, sizeof(uint32_t));
+        if (blank == NULL)
+        {
+            _lock_release(&lock);
+            free(used);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    struct lfs_info info;
+    int err = lfs_stat(&lfs, lpath, &info);
+    if (err == LFS_ERR_NOENT)
+    {
+        info.type = LFS_TYPE_REG;
+        info.size = 0;
+        err = LFS_ERR_OK;
+    }
+    else if (err == LFS_ERR_OK && info.type == LFS_TYPE_DIR)
+    {
+        err = LFS_ERR_ISDIR;
+    }
+
+    lfs_block_t need = 0;
+    if (err == LFS_ERR_OK && (lfs_off_t) size > info.size)
+    {
+        // Blocks also carry the file's skip list pointers, two on average,
+        // and the partly filled last block gets copied
+        lfs_size_t per_block = sector_sz - 2 * sizeof(lfs_block_t);
+        need = (size - info.size + per_block - 1) / per_block + 1;
+
+        err = lfs_traverse(&lfs, prealloc_mark, used);
+    }
+
+    lfs_block_t free_blocks = 0;
+    for (lfs_block_t b = 0; err == LFS_ERR_OK && b < block_cnt; b++)
+    {
+        if (!(used[b / 32] & (1U << (b % 32))))
+        {
+            free_blocks++;
+        }
+    }
+
+    if (err == LFS_ERR_OK && need > free_blocks)
+    {
+        err = LFS_ERR_NOSPC;
+    }
+
+    // The allocator hands out free blocks in order from its lookahead
+    // position, wrapping at the end of the device
+    lfs_block_t block = (lfs.free.off + lfs.free.i) % block_cnt;
+    for (lfs_block_t n = 0; err == LFS_ERR_OK && n < block_cnt && need > 0; n++)
+    {
+        if (!(used[block / 32] & (1U << (block % 32))))
+        {
+            if (!(blank[block / 32] & (1U << (block % 32))))
+            {
+                err = lfs_cfg.erase(&lfs_cfg, block);
+                if (err == LFS_ERR_OK)
+                {
+                    blank[block / 32] |= 1U << (block % 32);
+                }
+            }
+            need--;
+        }
+        block = (block + 1) % block_cnt;
+    }
+
+    _lock_release(&lock);
+
+    free(used);
+
+    return map_lfs_error(err);
+}
+
+int LittleFlash::prealloc_mark(void *data, lfs_block_t block)
+{
+    uint32_t *used = (uint32_t *) data;
+
+    used[block / 32] |= 1U << (block % 32);
+
+    return 0;
+}
+
+// Called from the erase callbacks, true if the block is still blank from
+// preallocate() and doesn't need erasing
+bool LittleFlash::blank_take(lfs_block_t block)
+{
+    if (blank == NULL || !(blank[block / 32] & (1U << (block % 32))))
+    {
+        return false;
+    }
+
+    blank[block / 32] &= ~(1U << (block % 32));
+
+    return true;
+}
+
+// Called from the program callbacks
+void LittleFlash::blank_clear(lfs_block_t block)
+{
+    if (blank)
+    {
+        blank[block / 32] &= ~(1U << (block % 32));
+    }
+}
+
+// ============================================================================
+// Blank sector checks
+// ============================================================================
+
+//
+// Erasing a sector takes tens of milliseconds, reading it back well under
+// one, so with blank_check set a sector that's already all 0xff, as after
+// a chip erase or on a fresh format, isn't erased again.  Reads go through
+// the device's own read callback and run in whatever mode it was set up
+// with.  Most sectors in use fail on the first word or two.
+//
+
+// Called from the erase callbacks, true if the sector reads back blank
+bool LittleFlash::blank_check(lfs_block_t block)
+{
+    // Encrypted flash doesn't read back 0xff after erasing
+    if (!cfg.blank_check || !(dev->info()->flags & BLOCK_DEVICE_ERASED_FF))
+    {
+        return false;
+    }
+
+    uint32_t buf[64];
+    for (lfs_off_t off = 0; off < sector_sz; off += sizeof(buf))
+    {
+        lfs_size_t len = std::min((lfs_size_t) sizeof(buf), (lfs_size_t) (sector_sz - off));
+        if (lfs_cfg.read(&lfs_cfg, block, off, buf, len) != LFS_ERR_OK)
+        {
+            return false;
+        }
+
+        for (lfs_size_t i = 0; i < len / sizeof(buf[0]); i++)
+        {
+            if (buf[i] != 0xffffffff)
+            {
+                return false;
+            }
+        }
+    }
+
+    stats.erases_skipped++;
+
+    return true;
+}
+
+// ============================================================================
+// Compressed files
+// ============================================================================
+
+// Writes path to out the way LittleFS resolves it, without "." or ".."
+// components or repeated slashes, and returns the number of components.
+// out needs room for strlen(path) + 1.
+size_t LittleFlash::path_normalize(const char *path, char *out)
+{
+    size_t len = 0;
+    size_t parts = 0;
+
+    while (true)
+    {
+        path += strspn(path, "/");
+        size_t n = strcspn(path, "/");
+        if (n == 0)
+        {
+            break;
+        }
+
+        if (n == 2 && path[0] == '.' && path[1] == '.')
+        {
+            while (len > 0 && out[--len] != '/')
+            {
+            }
+            parts -= parts > 0;
+        }
+        else if (n != 1 || path[0] != '.')
+        {
+            out[len++] = '/';
+            memcpy(out + len, path, n);
+            len += n;
+            parts++;
+        }
+
+        path += n;
+    }
+
+    out[len] = '\0';
+
+    return parts;
+}
+
+// Resolves path component by component, without a copy, setting how deep
+// it ends up and how many of its leading components match base, which
+// must already be normalized.  Matches are whole components, so "/zfoo"
+// doesn't match "/z".
+void LittleFlash::path_match(const char *path, const char *base, size_t *depth, size_t *matched)
+{
+    const char *next = base;    // base after the matched components
+
+    *depth = 0;
+    *matched = 0;
+
+    while (true)
+    {
+        path += strspn(path, "/");
+        size_t n = strcspn(path, "/");
+        if (n == 0)
+        {
+            break;
+        }
+
+        if (n == 2 && path[0] == '.' && path[1] == '.')
+        {
+            *depth -= *depth > 0;
+
+            // Backed out of the matched part, find where it ends now
+            if (*matched > *depth)
+            {
+                *matched = *depth;
+                next = base;
+                for (size_t i = 0; i < *matched; i++)
+                {
+                    next += 1 + strcspn(next + 1, "/");
+                }
+            }
+        }
+        else if (n != 1 || path[0] != '.')
+        {
+            if (*matched == *depth && next[0] == '/' &&
+                strcspn(next + 1, "/") == n && memcmp(next + 1, path, n) == 0)
+            {
+                (*matched)++;
+                next += 1 + n;
+            }
+            (*depth)++;
+        }
+
+        path += n;
+    }
+}
+
+// Is path at or below compress_prefix, however it's spelled?
+bool LittleFlash::compressed(const char *path)
+{
+    if (zprefix == NULL)
+    {
+        return false;
+    }
+
+    size_t depth;
+    size_t matched;
+    path_match(path, zprefix, &depth, &matched);
+
+    return matched == zprefix_parts;
+}
+
+// Would the rename move files into or out of the compressed area?
+bool LittleFlash::compress_crossed(const char *src, const char *dst)
+{
+    if (zprefix == NULL)
+    {
+        return false;
+    }
+
+    if (compressed(src) != compressed(dst))
+    {
+        return true;
+    }
+
+    // Renaming a parent of the compressed area, every component of the
+    // path matches the start of the prefix
+    size_t depth;
+    size_t matched;
+    path_match(src, zprefix, &depth, &matched);
+    if (matched == depth)
+    {
+        return true;
+    }
+
+    path_match(dst, zprefix, &depth, &matched);
+
+    return matched == depth;
+}
+
+// Must be called with lock held.  Replaces the stored size of a compressed
+// file with its uncompressed size.  Finding it means reading every chunk
+// header, so it's kept in the lookup cache until the file changes.
+int LittleFlash::zstat(const char *path, struct lfs_info *info)
+{
+    dentry_t *d = dentry_find(path);
+    if (d && d->zsized)
+    {
+        info->size = d->zsize;
+        return LFS_ERR_OK;
+    }
+
+    lfs_file_t file;
+    int err = file_open(&file, path, LFS_O_RDONLY);
+    if (err < 0)
+    {
+        return err;
+    }
+
+    zfile_t z = {};
+    err = zscan(&file, &z);
+    free(z.index);
+
+    file_close(&file);
+
+    if (err < 0)
+    {
+        return err;
+    }
 
-    lfs_ssize_t read = lfs_file_read(&that->lfs, that->fds[fd].file, dst, size);
+    info->size = z.size;
 
-    _lock_release(&that->lock);
+    if (d)
+    {
+        d->zsized = true;
+        d->zsize = z.size;
+    }
 
-    if (read < 0)
+    return LFS_ERR_OK;
+}
+
+// Must be called with lock held.  Builds the chunk index by walking the
+// chunk headers.
+int LittleFlash::zscan(lfs_file_t *file, zfile_t *z)
+{
+    lfs_soff_t end = lfs_file_size(&lfs, file);
+    if (end < 0)
     {
-        return map_lfs_error(read);
+        return end;
     }
 
-    return read;
+    lfs_off_t pos = 0;
+    lfs_off_t raw = 0;
+    while (pos < (lfs_off_t) end)
+    {
+        lfs_soff_t err = lfs_file_seek(&lfs, file, pos, LFS_SEEK_SET);
+        if (err < 0)
+        {
+            return err;
+        }
+
+        uint8_t hdr[COMPRESS_HDR];
+        lfs_ssize_t len = lfs_file_read(&lfs, file, hdr, sizeof(hdr));
+        if (len < 0)
+        {
+            return len;
+        }
+
+        size_t raw_len = hdr[0] | (hdr[1] << 8);
+        size_t stored_len = hdr[2] | (hdr[3] << 8);
+        if (len != sizeof(hdr) ||
+            raw_len == 0 || raw_len > COMPRESS_CHUNK ||
+            stored_len == 0 || stored_len > raw_len)
+        {
+            return LFS_ERR_CORRUPT;
+        }
+
+        if (z->chunks == z->cap)
+        {
+            size_t cap = z->cap ? z->cap * 2 : 8;
+            zchunk_t *index = (zchunk_t *) realloc(z->index, cap * sizeof(zchunk_t));
+            if (index == NULL)
+            {
+                return LFS_ERR_NOMEM;
+            }
+            z->index = index;
+            z->cap = cap;
+        }
+
+        z->index[z->chunks].raw = raw;
+        z->index[z->chunks].pos = pos;
+        z->chunks++;
+
+        raw += raw_len;
+        pos += COMPRESS_HDR + stored_len;
+    }
+
+    if (pos != (lfs_off_t) end)
+    {
+        return LFS_ERR_CORRUPT;
+    }
+
+    z->size = raw;
+    z->end = end;
+    z->start = raw;
+
+    return LFS_ERR_OK;
 }
 
-int LittleFlash::open_p(void *ctx, const char *path, int flags, int mode)
+// Must be called with lock held
+int LittleFlash::zload(lfs_file_t *file, zfile_t *z, size_t chunk)
 {
-    LittleFlash *that = (LittleFlash *) ctx;
+    lfs_soff_t err = lfs_file_seek(&lfs, file, z->index[chunk].pos, LFS_SEEK_SET);
+    if (err < 0)
+    {
+        return err;
+    }
 
-    int lfs_flags = 0;
-    if ((flags & O_ACCMODE) == O_RDONLY)
+    uint8_t hdr[COMPRESS_HDR];
+    lfs_ssize_t len = lfs_file_read(&lfs, file, hdr, sizeof(hdr));
+    if (len < 0)
     {
-        lfs_flags = LFS_O_RDONLY;
+        return len;
     }
-    else if ((flags & O_ACCMODE) == O_WRONLY)
+
+    size_t raw_len = hdr[0] | (hdr[1] << 8);
+    size_t stored_len = hdr[2] | (hdr[3] << 8);
+    if (len != sizeof(hdr) ||
+        raw_len == 0 || raw_len > COMPRESS_CHUNK ||
+        stored_len == 0 || stored_len > raw_len)
     {
-        lfs_flags = LFS_O_WRONLY;
+        return LFS_ERR_CORRUPT;
     }
-    else if ((flags & O_ACCMODE) == O_RDWR)
+
+    // Chunks that didn't compress are read straight into place
+    uint8_t *dst = stored_len == raw_len ? z->buf : zbuf;
+
+    len = lfs_file_read(&lfs, file, dst, stored_len);
+    if (len < 0)
     {
-        lfs_flags = LFS_O_RDWR;
+        return len;
     }
 
-    if (flags & O_CREAT)
+    if ((size_t) len != stored_len)
     {
-        lfs_flags |= LFS_O_CREAT;
+        return LFS_ERR_CORRUPT;
     }
 
-    if (flags & O_EXCL)
+    if (dst == zbuf && little_lz_decompress(zbuf, stored_len, z->buf, raw_len) != raw_len)
     {
-        lfs_flags |= LFS_O_EXCL;
+        return LFS_ERR_CORRUPT;
     }
 
-    if (flags & O_TRUNC)
+    z->start = z->index[chunk].raw;
+    z->len = raw_len;
+    z->tail = false;
+    z->flushed = 0;
+
+    return LFS_ERR_OK;
+}
+
+// Must be called with lock held.  Writes out any unwritten data at the end
+// of the file as a new chunk.  A chunk that isn't full yet stays in the
+// buffer, and is replaced by the merged chunk at the next flush rather
+// than leaving a small chunk behind for every sync.
+int LittleFlash::zflush(lfs_file_t *file, zfile_t *z)
+{
+    if (!z->tail || z->len == z->flushed)
     {
-        lfs_flags |= LFS_O_TRUNC;
+        return LFS_ERR_OK;
     }
-    
-    if (flags & O_APPEND)
+
+    if (z->flushed)
     {
-        lfs_flags |= LFS_O_APPEND;
+        z->flushed = 0;
+        z->chunks--;
+        z->end = z->index[z->chunks].pos;
+
+        int err = lfs_file_truncate(&lfs, file, z->end);
+        if (err < 0)
+        {
+            return err;
+        }
     }
 
-    lfs_file *file = (lfs_file *) malloc(sizeof(lfs_file));
-    if (file == NULL)
+    if (z->chunks == z->cap)
     {
-        errno = ENOMEM;
-        return -1;
+        size_t cap = z->cap ? z->cap * 2 : 8;
+        zchunk_t *index = (zchunk_t *) realloc(z->index, cap * sizeof(zchunk_t));
+        if (index == NULL)
+        {
+            return LFS_ERR_NOMEM;
+        }
+        z->index = index;
+        z->cap = cap;
     }
 
-    char *name = strdup(path);
-    if (name == NULL)
+    // Keep the data as is unless compressing actually saves something
+    size_t stored_len = little_lz_compress(z->buf, z->len, zbuf + COMPRESS_HDR, z->len - 1, zhtab);
+    if (stored_len == 0)
     {
-        free(file);
-        errno = ENOMEM;
-        return -1;
+        memcpy(zbuf + COMPRESS_HDR, z->buf, z->len);
+        stored_len = z->len;
     }
 
-    _lock_acquire(&that->lock);
+    zbuf[0] = z->len;
+    zbuf[1] = z->len >> 8;
+    zbuf[2] = stored_len;
+    zbuf[3] = stored_len >> 8;
 
-    int fd = that->get_free_fd();
-    if (fd == -1)
+    // Seeking flushes the file, so don't unless it's elsewhere
+    if (lfs_file_tell(&lfs, file) != (lfs_soff_t) z->end)
     {
-        _lock_release(&that->lock);
-        free(name);
-        free(file);
-        errno = ENFILE;
-        return -1;
+        lfs_soff_t err = lfs_file_seek(&lfs, file, z->end, LFS_SEEK_SET);
+        if (err < 0)
+        {
+            return err;
+        }
     }
 
-    int err = lfs_file_open(&that->lfs, file, path, lfs_flags);
-    if (err < 0)
+    lfs_ssize_t written = lfs_file_write(&lfs, file, zbuf, COMPRESS_HDR + stored_len);
+    if (written < 0)
     {
-        _lock_release(&that->lock);
-        free(name);
-        free(file);
-        return map_lfs_error(err);
+        return written;
     }
 
-    that->fds[fd].file = file;
-    that->fds[fd].name = name;
+    z->index[z->chunks].raw = z->start;
+    z->index[z->chunks].pos = z->end;
+    z->chunks++;
 
-    _lock_release(&that->lock);
+    z->end += written;
+    if (z->len == COMPRESS_CHUNK)
+    {
+        z->start += z->len;
+        z->len = 0;
+    }
+    else
+    {
+        z->flushed = z->len;
+    }
 
-    return fd;
+    return LFS_ERR_OK;
 }
 
-int LittleFlash::close_p(void *ctx, int fd)
+// Must be called with lock held
+lfs_ssize_t LittleFlash::zread(lfs_file_t *file, zfile_t *z, void *dst, size_t size)
 {
-    LittleFlash *that = (LittleFlash *) ctx;
+    size_t done = 0;
+
+    while (done < size && z->pos < z->size)
+    {
+        if (z->pos < z->start || z->pos >= z->start + z->len)
+        {
+            // The chunk is on flash, so the buffer is about to be reused
+            int err = zflush(file, z);
+            if (err < 0)
+            {
+                return err;
+            }
 
-    _lock_acquire(&that->lock);
+            // Find the last chunk starting at or before the position
+            size_t lo = 0;
+            size_t hi = z->chunks;
+            while (hi - lo > 1)
+            {
+                size_t mid = (lo + hi) / 2;
+                if (z->index[mid].raw <= z->pos)
+                {
+                    lo = mid;
+                }
+                else
+                {
+                    hi = mid;
+                }
+            }
 
-    if (that->fds[fd].file == NULL)
+            err = zload(file, z, lo);
+            if (err < 0)
+            {
+                return err;
+            }
+        }
+
+        size_t len = std::min(size - done, (size_t) (z->start + z->len - z->pos));
+        memcpy((uint8_t *) dst + done, z->buf + (z->pos - z->start), len);
+        done += len;
+        z->pos += len;
+    }
+
+    return done;
+}
+
+// Must be called with lock held.  Compressed files can only be written at
+// the end.
+lfs_ssize_t LittleFlash::zwrite(lfs_file_t *file, zfile_t *z, const void *src, size_t size, bool append)
+{
+    if (append)
     {
-        _lock_release(&that->lock);
-        errno = EBADF;
-        return -1;
+        z->pos = z->size;
     }
 
-    int err = lfs_file_close(&that->lfs, that->fds[fd].file);
+    if (z->pos != z->size)
+    {
+        return LFS_ERR_INVAL;
+    }
 
-    free(that->fds[fd].name);
-    free(that->fds[fd].file);
-    that->fds[fd] = {};
+    // Carry on filling the last chunk if it isn't full, otherwise start
+    // collecting a new one, dropping whatever chunk was read
+    if (!z->tail)
+    {
+        size_t last = z->chunks - 1;
+        if (z->chunks > 0 && z->size - z->index[last].raw < COMPRESS_CHUNK)
+        {
+            int err = zload(file, z, last);
+            if (err < 0)
+            {
+                return err;
+            }
+            z->flushed = z->len;
+        }
+        else
+        {
+            z->start = z->size;
+            z->len = 0;
+            z->flushed = 0;
+        }
+        z->tail = true;
+    }
 
-    _lock_release(&that->lock);
+    size_t done = 0;
+    while (done < size)
+    {
+        size_t len = std::min(size - done, COMPRESS_CHUNK - z->len);
+        memcpy(z->buf + z->len, (const uint8_t *) src + done, len);
+        z->len += len;
+        done += len;
 
-    return map_lfs_error(err);
+        z->pos += len;
+        z->size = z->pos;
+
+        if (z->len == COMPRESS_CHUNK)
+        {
+            int err = zflush(file, z);
+            if (err < 0)
+            {
+                return err;
+            }
+        }
+    }
+
+    return done;
 }
 
-int LittleFlash::fstat_p(void *ctx, int fd, struct stat *st)
+void LittleFlash::zfree(zfile_t *z)
 {
-    LittleFlash *that = (LittleFlash *) ctx;
+    if (z)
+    {
+        free(z->buf);
+        free(z->index);
+        free(z);
+    }
+}
 
-    _lock_acquire(&that->lock);
+// ============================================================================
+// Per-block erase counts
+// ============================================================================
 
-    if (that->fds[fd].file == NULL)
+int LittleFlash::wear_stats(little_flash_wear_t *wear)
+{
+    if (erase_counts == NULL)
     {
-        _lock_release(&that->lock);
-        errno = EBADF;
+        errno = ENOTSUP;
         return -1;
     }
 
-    lfs_info lfs_info;
-    int err = lfs_stat(&that->lfs, that->fds[fd].name, &lfs_info);
+    *wear = {};
+    wear->blocks = block_cnt;
+    wear->min = UINT32_MAX;
 
-    _lock_release(&that->lock);
+    lock_acquire();
 
-    if (err < 0)
+    for (size_t i = 0; i < block_cnt; i++)
     {
-        return map_lfs_error(err);
+        wear->min = std::min(wear->min, erase_counts[i]);
+        wear->max = std::max(wear->max, erase_counts[i]);
+        wear->total += erase_counts[i];
     }
 
-    *st = {};
-    st->st_size = lfs_info.size;
-    if (lfs_info.type == LFS_TYPE_DIR)
-    {
-        st->st_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
-    }
-    else
+    wear->mean = (float) wear->total / block_cnt;
+
+    float sum = 0;
+    for (size_t i = 0; i < block_cnt; i++)
     {
-        st->st_mode = S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO;
+        float diff = erase_counts[i] - wear->mean;
+        sum += diff * diff;
     }
 
+    _lock_release(&lock);
+
+    wear->stddev = sqrtf(sum / block_cnt);
+
     return 0;
 }
 
-int LittleFlash::stat_p(void *ctx, const char *path, struct stat *st)
+int LittleFlash::wear_counts(uint32_t *counts, size_t first, size_t count)
 {
-    LittleFlash *that = (LittleFlash *) ctx;
+    if (erase_counts == NULL)
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
 
-    _lock_acquire(&that->lock);
+    if (first >= block_cnt)
+    {
+        return 0;
+    }
 
-    struct lfs_info lfs_info;
-    int err = lfs_stat(&that->lfs, path, &lfs_info);
+    count = std::min(count, block_cnt - first);
 
-    _lock_release(&that->lock);
+    lock_acquire();
 
-    if (err < 0)
+    memcpy(counts, erase_counts + first, count * sizeof(uint32_t));
+
+    _lock_release(&lock);
+
+    return count;
+}
+
+// Renders the counts as rows of width characters, from ' ' for blocks
+// never erased to '@' for the most erased.  When the blocks don't all fit,
+// each character shows the most erased block of its group.  Returns the
+// number of blocks per character.
+int LittleFlash::wear_heatmap(char *buf, size_t size, int width)
+{
+    static const char ramp[] = " .:-=+*#%@";
+
+    if (erase_counts == NULL)
     {
-        return map_lfs_error(err);
+        errno = ENOTSUP;
+        return -1;
     }
 
-    *st = {};
-    st->st_size = lfs_info.size;
-    if (lfs_info.type == LFS_TYPE_DIR)
+    // Room for the newline ending each row and the terminator
+    size_t cells = width > 0 && size > 1 ? (size - 1) * width / (width + 1) : 0;
+    if (cells == 0)
     {
-        st->st_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
+        errno = EINVAL;
+        return -1;
     }
-    else
+
+    size_t per_cell = (block_cnt + cells - 1) / cells;
+    cells = (block_cnt + per_cell - 1) / per_cell;
+
+    lock_acquire();
+
+    uint32_t max = 1;
+    for (size_t i = 0; i < block_cnt; i++)
     {
-        st->st_mode = S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO;
+        max = std::max(max, erase_counts[i]);
     }
 
-    return 0;
+    char *p = buf;
+    for (size_t cell = 0; cell < cells; cell++)
+    {
+        uint32_t hot = 0;
+        for (size_t i = cell * per_cell; i < block_cnt && i < (cell + 1) * per_cell; i++)
+        {
+            hot = std::max(hot, erase_counts[i]);
+        }
+
+        *p++ = ramp[hot == 0 ? 0 : 1 + (uint64_t) hot * (sizeof(ramp) - 3) / max];
+
+        if ((cell + 1) % width == 0 || cell + 1 == cells)
+        {
+            *p++ = '\n';
+        }
+    }
+    *p = '\0';
+
+    _lock_release(&lock);
+
+    return per_cell;
 }
 
-int LittleFlash::unlink_p(void *ctx, const char *path)
+int LittleFlash::wear_save()
 {
-    LittleFlash *that = (LittleFlash *) ctx;
+    if (erase_counts == NULL)
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
 
-    _lock_acquire(&that->lock);
+    if (cfg.read_only)
+    {
+        errno = EROFS;
+        return -1;
+    }
 
-    int err = lfs_remove(&that->lfs, path);
+    lock_acquire();
 
-    _lock_release(&that->lock);
+    int err = wear_save_locked();
+
+    _lock_release(&lock);
 
     return map_lfs_error(err);
 }
 
-int LittleFlash::rename_p(void *ctx, const char *src, const char *dst)
+// Called after mounting
+void LittleFlash::wear_load()
 {
-    LittleFlash *that = (LittleFlash *) ctx;
+    lfs_file_t file;
+    int err = file_open(&file, WEAR_FILE, LFS_O_RDONLY);
+    if (err < 0)
+    {
+        return;
+    }
+
+    uint32_t hdr[2];
+    lfs_ssize_t len = lfs_file_read(&lfs, &file, hdr, sizeof(hdr));
+    if (len == sizeof(hdr) && hdr[0] == WEAR_MAGIC && hdr[1] == block_cnt)
+    {
+        // Erases done while mounting are added to what was saved
+        for (size_t i = 0; i < block_cnt; i++)
+        {
+            uint32_t count;
+            if (lfs_file_read(&lfs, &file, &count, sizeof(count)) != sizeof(count))
+            {
+                break;
+            }
+            erase_counts[i] += count;
+        }
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Ignoring erase counts saved for a different device");
+    }
 
-    _lock_acquire(&that->lock);
+    file_close(&file);
+}
 
-    int err = lfs_rename(&that->lfs, src, dst);
+// Is path the erase counts file, however it's spelled?
+bool LittleFlash::wear_file(const char *path)
+{
+    if (erase_counts == NULL)
+    {
+        return false;
+    }
 
-    _lock_release(&that->lock);
+    size_t depth;
+    size_t matched;
+    path_match(path, WEAR_FILE, &depth, &matched);
 
-    return map_lfs_error(err);
+    return depth == 1 && matched == 1;
 }
 
-DIR *LittleFlash::opendir_p(void *ctx, const char *name)
+// Must be called with lock held
+int LittleFlash::wear_save_locked()
 {
-    LittleFlash *that = (LittleFlash *) ctx;
-
-    vfs_lfs_dir_t *vfs_dir = (vfs_lfs_dir_t *) malloc(sizeof(vfs_lfs_dir_t));
-    if (vfs_dir == NULL)
+    lfs_file_t file;
+    int err = file_open(&file, WEAR_FILE, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err < 0)
     {
-        errno = ENOMEM;
-        return NULL;
+        return err;
     }
-    *vfs_dir = {};
 
-    _lock_acquire(&that->lock);
+    uint32_t hdr[2] = { WEAR_MAGIC, (uint32_t) block_cnt };
+    lfs_ssize_t written = lfs_file_write(&lfs, &file, hdr, sizeof(hdr));
+    if (written >= 0)
+    {
+        written = lfs_file_write(&lfs, &file, erase_counts, block_cnt * sizeof(uint32_t));
+    }
 
-    int err = lfs_dir_open(&that->lfs, &vfs_dir->lfs_dir, name);
+    err = file_close(&file);
+    if (written < 0)
+    {
+        err = written;
+    }
 
-    _lock_release(&that->lock);
+    invalidate(WEAR_FILE, false);
 
-    if (err != LFS_ERR_OK)
+    if (err == LFS_ERR_OK)
     {
-        free(vfs_dir);
-        vfs_dir = NULL;
-        map_lfs_error(err);
+        erases_unsaved = 0;
     }
 
-    return (DIR *) vfs_dir;
+    return err;
 }
 
-struct dirent *LittleFlash::readdir_p(void *ctx, DIR *pdir)
+// ============================================================================
+// Append optimized log files
+// ============================================================================
+
+little_flash_log_t *LittleFlash::log_open(const char *path, const little_flash_log_config_t *config)
 {
-    vfs_lfs_dir_t *vfs_dir = (vfs_lfs_dir_t *) pdir;
-    if (vfs_dir == NULL)
+    const char *lpath = lfs_path(path);
+    if (lpath == NULL || compressed(lpath))
     {
-        errno = EBADF;
+        errno = EINVAL;
         return NULL;
     }
 
-    struct dirent *out_dirent = NULL;
-
-    int err = readdir_r_p(ctx, pdir, &vfs_dir->dirent, &out_dirent);
-    if (err != 0)
+    if (cfg.read_only)
     {
-        errno = err;
+        errno = EROFS;
+        return NULL;
     }
 
-    return out_dirent;
-}
+    little_flash_log_t *log = (little_flash_log_t *) calloc(1, sizeof(little_flash_log_t));
+    if (log == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
 
-int LittleFlash::readdir_r_p(void *ctx, DIR *pdir, struct dirent *entry, struct dirent **out_dirent)
-{
-    LittleFlash *that = (LittleFlash *) ctx;
+    log->size = config->buffer_size ? config->buffer_size : sector_sz;
+    log->max_bytes = log->size;
+    if (config->max_bytes > 0 && config->max_bytes < log->size)
+    {
+        log->max_bytes = config->max_bytes;
+    }
+    log->max_ms = config->max_ms;
 
-    vfs_lfs_dir_t *vfs_dir = (vfs_lfs_dir_t *) pdir;
-    if (vfs_dir == NULL)
+    log->path = strdup(lpath);
+    log->buf = (uint8_t *) malloc(log->size);
+    if (log->path == NULL || log->buf == NULL)
     {
-        errno = EBADF;
-        return errno;
+        free(log->path);
+        free(log->buf);
+        free(log);
+        errno = ENOMEM;
+        return NULL;
     }
 
-    _lock_acquire(&that->lock);
+    lock_acquire();
 
-    struct lfs_info lfs_info;
-    int err = lfs_dir_read(&that->lfs, &vfs_dir->lfs_dir, &lfs_info);
+    int err = file_open(&log->file, lpath, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
 
-    _lock_release(&that->lock);
+    invalidate(lpath, false);
 
-    if (err == 0)
-    {
-        *out_dirent = NULL;
-        return 0;
-    }
+    _lock_release(&lock);
 
     if (err < 0)
     {
+        free(log->path);
+        free(log->buf);
+        free(log);
         map_lfs_error(err);
-        return errno;
+        return NULL;
     }
 
-    entry->d_ino = 0;
-    if (lfs_info.type == LFS_TYPE_REG)
-    {
-        entry->d_type = DT_REG;
-    }
-    else if (lfs_info.type == LFS_TYPE_DIR)
-    {
-        entry->d_type = DT_DIR;
-    }
-    else
-    {
-        entry->d_type = DT_UNKNOWN;
-    }
-    size_t len = strlcpy(entry->d_name, lfs_info.name, sizeof(entry->d_name));
+    _lock_acquire(&log_lock);
 
-    // This "shouldn't" happen, but the LFS name length can be customized and may
-    // be longer than what's provided in "struct dirent"
-    if (len >= sizeof(entry->d_name))
+    // The time bound is enforced by a single task shared by all logs
+    if (log->max_ms > 0 && log_task_handle == NULL)
     {
-        errno = ENAMETOOLONG;
-        return errno;
+        log_task_stop = false;
+        if (xTaskCreate(&log_task, "littleflash_log", LOG_TASK_STACK, this, LOG_TASK_PRIORITY, &log_task_handle) != pdPASS)
+        {
+            log_task_handle = NULL;
+            _lock_release(&log_lock);
+
+            lock_acquire();
+            file_close(&log->file);
+            _lock_release(&lock);
+
+            free(log->path);
+            free(log->buf);
+            free(log);
+            errno = ENOMEM;
+            return NULL;
+        }
     }
 
-    vfs_dir->off++;
+    log->next = logs;
+    logs = log;
 
-    *out_dirent = entry;
+    _lock_release(&log_lock);
 
-    return 0;
+    return log;
 }
 
-long LittleFlash::telldir_p(void *ctx, DIR *pdir)
+int LittleFlash::log_append(little_flash_log_t *log, const void *data, size_t size)
 {
-    vfs_lfs_dir_t *vfs_dir = (vfs_lfs_dir_t *) pdir;
-    if (vfs_dir == NULL)
-    {
-        errno = EBADF;
-        return errno;
-    }
+    bool wake = false;
 
-    return vfs_dir->off;
-}
+    _lock_acquire(&log_lock);
 
-void LittleFlash::seekdir_p(void *ctx, DIR *pdir, long offset)
-{
-    LittleFlash *that = (LittleFlash *) ctx;
+    // Report any failure from a background commit
+    int err = log->err;
+    log->err = LFS_ERR_OK;
 
-    vfs_lfs_dir_t *vfs_dir = (vfs_lfs_dir_t *) pdir;
-    if (vfs_dir == NULL)
+    if (err == LFS_ERR_OK && log->used + size > log->size)
     {
-        errno = EBADF;
-        return;
+        err = log_commit_locked(log);
     }
 
-    _lock_acquire(&that->lock);
-
-    // ESP32 VFS expects simple 0 to n counted directory offsets but lfs
-    // doesn't so we need to "translate"...
-    int err = lfs_dir_rewind(&that->lfs, &vfs_dir->lfs_dir);
-    if (err >= 0)
+    if (err == LFS_ERR_OK)
     {
-        for (vfs_dir->off = 0; vfs_dir->off < offset; ++vfs_dir->off)
+        if (size >= log->size)
         {
-            struct lfs_info lfs_info;
-            err = lfs_dir_read(&that->lfs, &vfs_dir->lfs_dir, &lfs_info);
-            if (err < 0)
+            // Too big to stage, so it becomes a batch of its own
+            lock_acquire();
+
+            lfs_ssize_t written = lfs_file_write(&lfs, &log->file, data, size);
+            err = written < 0 ? written : lfs_file_sync(&lfs, &log->file);
+
+            invalidate(log->path, false);
+
+            _lock_release(&lock);
+
+            if (err == LFS_ERR_OK)
             {
-                break;
+                log->stats.commits++;
+            }
+        }
+        else
+        {
+            if (log->used == 0)
+            {
+                log->first = xTaskGetTickCount();
+                wake = log->max_ms > 0;
+            }
+
+            memcpy(log->buf + log->used, data, size);
+            log->used += size;
+
+            if (log->used >= log->max_bytes)
+            {
+                err = log_commit_locked(log);
+                wake = false;
             }
         }
     }
 
-    _lock_release(&that->lock);
+    if (err == LFS_ERR_OK)
+    {
+        log->stats.records++;
+        log->stats.bytes += size;
+    }
 
-    if (err < 0)
+    _lock_release(&log_lock);
+
+    if (wake)
     {
-        map_lfs_error(err);
-        return;
+        xTaskNotifyGive(log_task_handle);
     }
 
-    return;
+    return map_lfs_error(err);
 }
 
-int LittleFlash::closedir_p(void *ctx, DIR *pdir)
+int LittleFlash::log_commit(little_flash_log_t *log)
 {
-    LittleFlash *that = (LittleFlash *) ctx;
+    _lock_acquire(&log_lock);
 
-    vfs_lfs_dir_t *vfs_dir = (vfs_lfs_dir_t *) pdir;
-    if (vfs_dir == NULL)
+    int err = log->err;
+    log->err = LFS_ERR_OK;
+
+    if (err == LFS_ERR_OK)
     {
-        errno = EBADF;
-        return -1;
+        err = log_commit_locked(log);
     }
 
-    _lock_acquire(&that->lock);
-
-    int err = lfs_dir_close(&that->lfs, &vfs_dir->lfs_dir);
-
-    _lock_release(&that->lock);
-
-    free(vfs_dir);
+    _lock_release(&log_lock);
 
     return map_lfs_error(err);
 }
 
-int LittleFlash::mkdir_p(void *ctx, const char *name, mode_t mode)
+int LittleFlash::log_close(little_flash_log_t *log)
 {
-    LittleFlash *that = (LittleFlash *) ctx;
+    _lock_acquire(&log_lock);
 
-    _lock_acquire(&that->lock);
+    for (little_flash_log_t **pp = &logs; *pp; pp = &(*pp)->next)
+    {
+        if (*pp == log)
+        {
+            *pp = log->next;
+            break;
+        }
+    }
 
-    int err = lfs_mkdir(&that->lfs, name);
+    int err = log->err;
+    int cerr = log_commit_locked(log);
+    if (err == LFS_ERR_OK)
+    {
+        err = cerr;
+    }
 
-    _lock_release(&that->lock);
+    _lock_release(&log_lock);
 
-    return map_lfs_error(err);
-}
+    lock_acquire();
 
-int LittleFlash::rmdir_p(void *ctx, const char *name)
-{
-    LittleFlash *that = (LittleFlash *) ctx;
+    cerr = file_close(&log->file);
 
-    _lock_acquire(&that->lock);
+    invalidate(log->path, false);
 
-    int err = lfs_remove(&that->lfs, name);
+    _lock_release(&lock);
 
-    _lock_release(&that->lock);
+    if (err == LFS_ERR_OK)
+    {
+        err = cerr;
+    }
+
+    free(log->path);
+    free(log->buf);
+    free(log);
 
     return map_lfs_error(err);
 }
 
-int LittleFlash::fsync_p(void *ctx, int fd)
+void LittleFlash::log_stats(little_flash_log_t *log, little_flash_log_stats_t *stats)
 {
-    LittleFlash *that = (LittleFlash *) ctx;
+    _lock_acquire(&log_lock);
 
-    _lock_acquire(&that->lock);
+    *stats = log->stats;
 
-    if (that->fds[fd].file == NULL)
+    _lock_release(&log_lock);
+}
+
+// Must be called with log_lock held
+int LittleFlash::log_commit_locked(little_flash_log_t *log)
+{
+    if (log->used == 0)
     {
-        _lock_release(&that->lock);
-        errno = EBADF;
-        return -1;
+        return LFS_ERR_OK;
     }
 
-    int err = lfs_file_sync(&that->lfs, that->fds[fd].file);
+    lock_acquire();
 
-    _lock_release(&that->lock);
-
-    return map_lfs_error(err);
-}
+    lfs_ssize_t written = lfs_file_write(&lfs, &log->file, log->buf, log->used);
+    int err = written < 0 ? written : lfs_file_sync(&lfs, &log->file);
 
-// ============================================================================
-// LFS disk interface for external flash
-// ============================================================================
+    invalidate(log->path, false);
 
-int LittleFlash::external_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
-{
-    ESP_LOGD(TAG, "%s - block=0x%08x off=0x%08x size=%d", __func__, block, off, size);
+    _lock_release(&lock);
 
-    LittleFlash *that = (LittleFlash *) c->context;
+    if (err < 0)
+    {
+        return err;
+    }
 
-    esp_err_t err = that->cfg.flash->read((block * that->sector_sz) + off, buffer, size);
+    log->used = 0;
+    log->stats.commits++;
 
-    return err == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
+    return LFS_ERR_OK;
 }
 
-int LittleFlash::external_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+void LittleFlash::log_task(void *arg)
 {
-    ESP_LOGD(TAG, "%s - block=0x%08x off=0x%08x size=%d", __func__, block, off, size);
+    LittleFlash *that = (LittleFlash *) arg;
 
-    LittleFlash *that = (LittleFlash *) c->context;
-
-    esp_err_t err = that->cfg.flash->write((block * that->sector_sz) + off, buffer, size);
+    while (!that->log_task_stop)
+    {
+        TickType_t wait = portMAX_DELAY;
 
-    return err == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
-}
+        _lock_acquire(&that->log_lock);
 
-int LittleFlash::external_erase(const struct lfs_config *c, lfs_block_t block)
-{
-    ESP_LOGD(TAG, "%s - block=0x%08x", __func__, block);
+        TickType_t now = xTaskGetTickCount();
+        for (little_flash_log_t *log = that->logs; log; log = log->next)
+        {
+            if (log->used == 0 || log->max_ms == 0)
+            {
+                continue;
+            }
 
-    LittleFlash *that = (LittleFlash *) c->context;
+            TickType_t limit = pdMS_TO_TICKS(log->max_ms);
+            TickType_t age = now - log->first;
+            if (age < limit)
+            {
+                wait = std::min(wait, limit - age);
+                continue;
+            }
 
-    esp_err_t err = that->cfg.flash->erase_sector(block);
+            // Failures are returned by the next append or commit
+            int err = that->log_commit_locked(log);
+            if (err < 0)
+            {
+                log->err = err;
+                log->first = now;
+                wait = std::min(wait, limit);
+            }
+        }
 
-    return err == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
-}
+        _lock_release(&that->log_lock);
 
-int LittleFlash::external_sync(const struct lfs_config *c)
-{
-    ESP_LOGD(TAG, "%s - c=%p", __func__, c);
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
 
-    return LFS_ERR_OK;
+    that->log_task_handle = NULL;
+    vTaskDelete(NULL);
 }
 
 // ============================================================================
-// LFS disk interface for internal flash
+// LFS disk interface
 // ============================================================================
 
-int LittleFlash::internal_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+int LittleFlash::dev_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
 {
     ESP_LOGD(TAG, "%s - block=0x%08x off=0x%08x size=%d", __func__, block, off, size);
 
     LittleFlash *that = (LittleFlash *) c->context;
 
-    esp_err_t err = esp_partition_read(that->part, (block * that->sector_sz) + off, buffer, size);
+    if (that->cfg.read_only)
+    {
+        _lock_acquire(&that->dev_lock);
+    }
+
+    esp_err_t err = that->dev->read((block * that->sector_sz) + off, buffer, size);
+
+    that->stats.reads++;
+    that->stats.read_bytes += size;
+
+    if (that->cfg.read_only)
+    {
+        _lock_release(&that->dev_lock);
+    }
 
     return err == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
 }
 
-int LittleFlash::internal_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+int LittleFlash::dev_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
 {
     ESP_LOGD(TAG, "%s - block=0x%08x off=0x%08x size=%d", __func__, block, off, size);
 
     LittleFlash *that = (LittleFlash *) c->context;
 
-    esp_err_t err = esp_partition_write(that->part, (block * that->sector_sz) + off, buffer, size);
+    that->blank_clear(block);
 
-    return err == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
+    esp_err_t err = that->dev->prog((block * that->sector_sz) + off, buffer, size);
+
+    that->stats.progs++;
+    that->stats.prog_bytes += size;
+
+    if (err != ESP_OK)
+    {
+        return LFS_ERR_IO;
+    }
+
+    // A mismatch makes LittleFS treat the block as bad and move the data
+    if (that->cfg.verify_writes)
+    {
+        uint8_t check[64];
+        for (lfs_size_t done = 0; done < size; done += sizeof(check))
+        {
+            lfs_size_t len = std::min((lfs_size_t) sizeof(check), size - done);
+            err = that->dev->read((block * that->sector_sz) + off + done, check, len);
+            if (err != ESP_OK)
+            {
+                return LFS_ERR_IO;
+            }
+
+            if (memcmp(check, (const uint8_t *) buffer + done, len) != 0)
+            {
+                ESP_LOGW(TAG, "Verify failed in block %d", block);
+                return LFS_ERR_CORRUPT;
+            }
+        }
+    }
+
+    return LFS_ERR_OK;
 }
 
-int LittleFlash::internal_erase(const struct lfs_config *c, lfs_block_t block)
+int LittleFlash::dev_erase(const struct lfs_config *c, lfs_block_t block)
 {
     ESP_LOGD(TAG, "%s - block=0x%08x", __func__, block);
 
     LittleFlash *that = (LittleFlash *) c->context;
 
-    esp_err_t err = esp_partition_erase_range(that->part, block * that->sector_sz, that->sector_sz);
+    // Still blank from preallocate(), or already blank
+    if (that->blank_take(block) || that->blank_check(block))
+    {
+        return LFS_ERR_OK;
+    }
+
+    esp_err_t err = that->dev->erase(block * that->sector_sz, that->sector_sz);
+
+    that->stats.erases++;
+    if (that->erase_counts)
+    {
+        that->erase_counts[block]++;
+        that->erases_unsaved++;
+    }
 
     return err == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
 }
 
-int LittleFlash::internal_sync(const struct lfs_config *c)
+int LittleFlash::dev_sync(const struct lfs_config *c)
 {
     ESP_LOGD(TAG, "%s", __func__);
 
-    return LFS_ERR_OK;
-}
+    LittleFlash *that = (LittleFlash *) c->context;
 
+    return that->dev->sync() == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
@@ -0,0 +1,1250 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/errno.h>
+#include <sys/lock.h>
+
+#include <algorithm>
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "littlekv.h"
+#include "littlecrc.h"
+
+static const char *TAG = "littlekv";
+
+#define KV_FLAG_DELETED 0x0001
+
+#define KV_SLOT(loc) ((loc) >> 24)
+#define KV_OFF(loc) ((loc) & 0x00ffffff)
+#define KV_LOC(slot, off) (((uint32_t) (slot) << 24) | (off))
+#define KV_OFF_MAX 0x00ffffff
+
+#define KV_COPY_SIZE 256
+
+#define COMPACT_TASK_STACK 3072
+#define COMPACT_TASK_PRIORITY 2
+
+LittleKV::LittleKV()
+{
+    dir = NULL;
+    name = NULL;
+    index = NULL;
+    segs = NULL;
+    copy_buf = NULL;
+    task = NULL;
+    initialized = false;
+}
+
+LittleKV::~LittleKV()
+{
+    term();
+}
+
+esp_err_t LittleKV::init(const little_kv_config_t *config)
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    cfg = *config;
+
+    if (cfg.fs == NULL || cfg.segments < 2 || cfg.segments > 255 || cfg.capacity == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const char *path = cfg.fs->lfs_path(cfg.path);
+    if (path == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (cfg.fs->cfg.read_only)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (cfg.segment_size == 0 || cfg.segment_size > KV_OFF_MAX)
+    {
+        cfg.segment_size = KV_OFF_MAX;
+    }
+
+    _lock_init(&lock);
+    initialized = true;
+
+    dir = strdup(path);
+
+    // Keep the load factor at or below 75%
+    for (index_size = 4; index_size < cfg.capacity + cfg.capacity / 3; index_size <<= 1)
+    {
+    }
+
+    index = (kv_entry_t *) calloc(index_size, sizeof(kv_entry_t));
+    segs = (kv_seg_t *) calloc(cfg.segments, sizeof(kv_seg_t));
+    copy_buf = (uint8_t *) malloc(KV_COPY_SIZE);
+    if (dir == NULL || index == NULL || segs == NULL || copy_buf == NULL)
+    {
+        term();
+        return ESP_ERR_NO_MEM;
+    }
+
+    size_t len = strlen(dir);
+    while (len > 0 && dir[len - 1] == '/')
+    {
+        dir[--len] = '\0';
+    }
+
+    // Room for the directory plus "/xxxxxxxx.kv"
+    name_size = len + 13;
+    name = (char *) malloc(name_size);
+    if (name == NULL)
+    {
+        term();
+        return ESP_ERR_NO_MEM;
+    }
+
+    keys = 0;
+    active = -1;
+    compacting = false;
+    iterating = NULL;
+
+    LittleFlash *fs = cfg.fs;
+
+    fs->lock_acquire();
+
+    int err = LFS_ERR_OK;
+    if (len > 0)
+    {
+        err = lfs_mkdir(&fs->lfs, dir);
+        if (err == LFS_ERR_EXIST)
+        {
+            err = LFS_ERR_OK;
+        }
+    }
+
+    // Collect the existing segment ids in ascending order
+    uint32_t *ids = (uint32_t *) calloc(cfg.segments, sizeof(uint32_t));
+    int found = 0;
+
+    lfs_dir_t lfs_dir;
+    if (err == LFS_ERR_OK && ids != NULL)
+    {
+        err = lfs_dir_open(&fs->lfs, &lfs_dir, len > 0 ? dir : "/");
+    }
+
+    if (err == LFS_ERR_OK && ids != NULL)
+    {
+        struct lfs_info info;
+        while ((err = lfs_dir_read(&fs->lfs, &lfs_dir, &info)) > 0)
+        {
+            char *end;
+            uint32_t id = strtoul(info.name, &end, 16);
+            if (info.type != LFS_TYPE_REG || end != info.name + 8 || strcmp(end, ".kv") != 0)
+            {
+                continue;
+            }
+
+            if (found == cfg.segments)
+            {
+                ESP_LOGE(TAG, "More than %d segments in '%s'", cfg.segments, cfg.path);
+                err = LFS_ERR_INVAL;
+                break;
+            }
+
+            int i;
+            for (i = found; i > 0 && ids[i - 1] > id; i--)
+            {
+                ids[i] = ids[i - 1];
+            }
+            ids[i] = id;
+            found++;
+        }
+        lfs_dir_close(&fs->lfs, &lfs_dir);
+    }
+
+    fs->lock_release();
+
+    if (ids == NULL)
+    {
+        term();
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Rebuild the index by replaying the segments oldest first
+    for (int slot = 0; err >= 0 && slot < found; slot++)
+    {
+        err = seg_open(slot, ids[slot], false);
+        if (err == LFS_ERR_OK)
+        {
+            err = seg_scan(slot);
+            active = slot;
+        }
+    }
+
+    free(ids);
+
+    if (err >= 0 && active < 0)
+    {
+        err = seg_start();
+    }
+
+    if (err < 0)
+    {
+        ESP_LOGE(TAG, "Unable to load '%s' (%d)", cfg.path, err);
+        term();
+        return err == LFS_ERR_NOMEM ? ESP_ERR_NO_MEM : ESP_FAIL;
+    }
+
+    if (cfg.compact_task)
+    {
+        task_stop = false;
+        if (xTaskCreate(&compact_task, "littlekv", COMPACT_TASK_STACK, this, COMPACT_TASK_PRIORITY, &task) != pdPASS)
+        {
+            task = NULL;
+            term();
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    return ESP_OK;
+}
+
+void LittleKV::term()
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (!initialized)
+    {
+        return;
+    }
+
+    if (task)
+    {
+        task_stop = true;
+        xTaskNotifyGive(task);
+        while (task)
+        {
+            vTaskDelay(1);
+        }
+    }
+
+    if (segs)
+    {
+        cfg.fs->lock_acquire();
+
+        for (int slot = 0; slot < cfg.segments; slot++)
+        {
+            if (segs[slot].open)
+            {
+                cfg.fs->file_close(&segs[slot].file);
+                seg_invalidate(segs[slot].id);
+            }
+        }
+
+        cfg.fs->lock_release();
+
+        free(segs);
+        segs = NULL;
+    }
+
+    free(copy_buf);
+    copy_buf = NULL;
+
+    free(index);
+    index = NULL;
+
+    free(name);
+    name = NULL;
+
+    free(dir);
+    dir = NULL;
+
+    _lock_close(&lock);
+    initialized = false;
+}
+
+ssize_t LittleKV::get(const char *key, void *value, size_t size)
+{
+    size_t key_len = strlen(key);
+    if (key_len == 0 || key_len > LITTLE_KV_KEY_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (reentered())
+    {
+        return -1;
+    }
+
+    uint32_t hash;
+    uint32_t check;
+    hash_key(key, key_len, &hash, &check);
+
+    _lock_acquire(&lock);
+
+    kv_entry_t *entry;
+    int err = find(key, key_len, hash, check, &entry);
+    if (err >= 0 && entry == NULL)
+    {
+        err = LFS_ERR_NOENT;
+    }
+
+    // find() just read the header and key, so the value is a sequential
+    // read from the same cache
+    kv_hdr_t hdr;
+    if (err >= 0)
+    {
+        kv_seg_t *seg = &segs[KV_SLOT(entry->loc)];
+        uint32_t off = KV_OFF(entry->loc);
+
+        err = read_at(seg, off, &hdr, sizeof(hdr));
+        if (err >= 0)
+        {
+            err = read_at(seg, off + sizeof(hdr) + key_len, value, std::min(size, (size_t) hdr.val_len));
+        }
+    }
+
+    _lock_release(&lock);
+
+    if (err < 0)
+    {
+        return LittleFlash::map_lfs_error(err);
+    }
+
+    return hdr.val_len;
+}
+
+int LittleKV::put(const char *key, const void *value, size_t size)
+{
+    size_t key_len = strlen(key);
+    if (key_len == 0 || key_len > LITTLE_KV_KEY_MAX || size > KV_OFF_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (reentered())
+    {
+        return -1;
+    }
+
+    uint32_t hash;
+    uint32_t check;
+    hash_key(key, key_len, &hash, &check);
+
+    _lock_acquire(&lock);
+
+    kv_entry_t *entry;
+    int err = find(key, key_len, hash, check, &entry);
+    if (err >= 0 && entry == NULL && keys >= cfg.capacity)
+    {
+        err = LFS_ERR_NOSPC;
+    }
+
+    uint32_t loc;
+    if (err >= 0)
+    {
+        err = append(key, key_len, value, size, 0, &loc);
+    }
+
+    if (err == LFS_ERR_OK)
+    {
+        if (entry)
+        {
+            segs[KV_SLOT(entry->loc)].live--;
+        }
+        else
+        {
+            entry = insert(hash, check);
+        }
+
+        entry->loc = loc;
+        segs[KV_SLOT(loc)].live++;
+    }
+
+    _lock_release(&lock);
+
+    return LittleFlash::map_lfs_error(err);
+}
+
+int LittleKV::del(const char *key)
+{
+    size_t key_len = strlen(key);
+    if (key_len == 0 || key_len > LITTLE_KV_KEY_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (reentered())
+    {
+        return -1;
+    }
+
+    uint32_t hash;
+    uint32_t check;
+    hash_key(key, key_len, &hash, &check);
+
+    _lock_acquire(&lock);
+
+    kv_entry_t *entry;
+    int err = find(key, key_len, hash, check, &entry);
+    if (err >= 0 && entry == NULL)
+    {
+        err = LFS_ERR_NOENT;
+    }
+
+    uint32_t loc;
+    if (err >= 0)
+    {
+        err = append(key, key_len, NULL, 0, KV_FLAG_DELETED, &loc);
+    }
+
+    if (err == LFS_ERR_OK)
+    {
+        segs[KV_SLOT(entry->loc)].live--;
+        remove(entry);
+    }
+
+    _lock_release(&lock);
+
+    return LittleFlash::map_lfs_error(err);
+}
+
+int LittleKV::iterate(little_kv_iter_t cb, void *ctx)
+{
+    struct
+    {
+        kv_hdr_t hdr;
+        char key[LITTLE_KV_KEY_MAX + 1];
+    } rec;
+
+    int err = LFS_ERR_OK;
+
+    _lock_acquire(&lock);
+
+    // Calls back into the store from cb would deadlock on the lock, so
+    // they're refused while this task is iterating
+    iterating = xTaskGetCurrentTaskHandle();
+
+    for (size_t i = 0; i < index_size && err >= 0; i++)
+    {
+        if (index[i].hash == 0)
+        {
+            continue;
+        }
+
+        kv_seg_t *seg = &segs[KV_SLOT(index[i].loc)];
+        uint32_t off = KV_OFF(index[i].loc);
+
+        err = read_at(seg, off, &rec.hdr, sizeof(rec.hdr));
+        if (err >= 0)
+        {
+            err = read_at(seg, off + sizeof(rec.hdr), rec.key, rec.hdr.key_len);
+        }
+
+        if (err >= 0)
+        {
+            rec.key[rec.hdr.key_len] = '\0';
+            if (cb(ctx, rec.key, rec.hdr.val_len) != 0)
+            {
+                break;
+            }
+        }
+    }
+
+    iterating = NULL;
+
+    _lock_release(&lock);
+
+    return LittleFlash::map_lfs_error(err < 0 ? err : 0);
+}
+
+int LittleKV::sync()
+{
+    if (reentered())
+    {
+        return -1;
+    }
+
+    _lock_acquire(&lock);
+    cfg.fs->lock_acquire();
+
+    int err = lfs_file_sync(&cfg.fs->lfs, &segs[active].file);
+
+    seg_invalidate(segs[active].id);
+
+    cfg.fs->lock_release();
+    _lock_release(&lock);
+
+    return LittleFlash::map_lfs_error(err);
+}
+
+size_t LittleKV::count()
+{
+    // The iterating task already holds the lock
+    if (iterating == xTaskGetCurrentTaskHandle())
+    {
+        return keys;
+    }
+
+    _lock_acquire(&lock);
+
+    size_t count = keys;
+
+    _lock_release(&lock);
+
+    return count;
+}
+
+// Compacts the oldest segment when it is mostly dead or when all segment
+// slots are in use.  Returns 1 if a segment was compacted, 0 if there was
+// nothing worth doing.
+int LittleKV::compact()
+{
+    if (reentered())
+    {
+        return -1;
+    }
+
+    _lock_acquire(&lock);
+
+    int slot = seg_oldest();
+    if (compacting || slot < 0)
+    {
+        _lock_release(&lock);
+        return 0;
+    }
+
+    kv_seg_t *seg = &segs[slot];
+    if (seg_count() < cfg.segments && seg->live * 2 > seg->records)
+    {
+        _lock_release(&lock);
+        return 0;
+    }
+
+    compacting = true;
+
+    _lock_release(&lock);
+
+    // Move one record at a time so gets and puts aren't held off for
+    // the whole segment
+    uint32_t off = 0;
+    int err;
+    do
+    {
+        _lock_acquire(&lock);
+        err = compact_locked(slot, &off);
+        _lock_release(&lock);
+    } while (err == 0);
+
+    _lock_acquire(&lock);
+    cfg.fs->lock_acquire();
+
+    // The copies must be durable before the originals go away
+    if (err > 0)
+    {
+        err = lfs_file_sync(&cfg.fs->lfs, &segs[active].file);
+        seg_invalidate(segs[active].id);
+    }
+
+    const char *path = seg_name(seg->id);
+    if (err >= 0 && path == NULL)
+    {
+        err = LFS_ERR_INVAL;
+    }
+
+    if (err >= 0)
+    {
+        cfg.fs->file_close(&seg->file);
+        err = lfs_remove(&cfg.fs->lfs, path);
+        seg_invalidate(seg->id);
+        *seg = {};
+    }
+
+    cfg.fs->lock_release();
+
+    compacting = false;
+
+    _lock_release(&lock);
+
+    if (err < 0)
+    {
+        return LittleFlash::map_lfs_error(err);
+    }
+
+    return 1;
+}
+
+// ============================================================================
+// Index
+// ============================================================================
+
+void LittleKV::hash_key(const char *key, size_t len, uint32_t *hash, uint32_t *check)
+{
+    // FNV-1a plus a differently seeded variant so two keys must collide
+    // in 64 bits before they're considered the same
+    uint32_t h = 2166136261u;
+    uint32_t c = 0x9e3779b9u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ (uint8_t) key[i]) * 16777619u;
+        c = (c ^ (uint8_t) key[i]) * 0x01000193u + (c >> 15);
+    }
+
+    *hash = h ? h : 1;
+    *check = c;
+}
+
+// Sets *entry to the key's entry or NULL if it isn't stored.  The hashes
+// only pick the candidates, the stored key is read back to confirm a match.
+int LittleKV::find(const char *key, size_t key_len, uint32_t hash, uint32_t check, kv_entry_t **entry)
+{
+    size_t mask = index_size - 1;
+
+    struct
+    {
+        kv_hdr_t hdr;
+        char key[LITTLE_KV_KEY_MAX];
+    } rec;
+
+    *entry = NULL;
+
+    for (size_t i = hash & mask; index[i].hash != 0; i = (i + 1) & mask)
+    {
+        if (index[i].hash != hash || index[i].check != check)
+        {
+            continue;
+        }
+
+        kv_seg_t *seg = &segs[KV_SLOT(index[i].loc)];
+        uint32_t off = KV_OFF(index[i].loc);
+
+        int err = read_at(seg, off, &rec.hdr, sizeof(rec.hdr));
+        if (err >= 0 && rec.hdr.key_len == key_len)
+        {
+            err = read_at(seg, off + sizeof(rec.hdr), rec.key, key_len);
+        }
+        if (err < 0)
+        {
+            return err;
+        }
+
+        if (rec.hdr.key_len == key_len && memcmp(rec.key, key, key_len) == 0)
+        {
+            *entry = &index[i];
+            break;
+        }
+    }
+
+    return LFS_ERR_OK;
+}
+
+// Finds the entry pointing at a known record, no need to read the key
+LittleKV::kv_entry_t *LittleKV::find_loc(uint32_t hash, uint32_t check, uint32_t loc)
+{
+    size_t mask = index_size - 1;
+
+    for (size_t i = hash & mask; index[i].hash != 0; i = (i + 1) & mask)
+    {
+        if (index[i].hash == hash && index[i].check == check && index[i].loc == loc)
+        {
+            return &index[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Adds a new entry, the caller has already checked that the key isn't
+// stored.  Keys with the same hashes get entries of their own.
+LittleKV::kv_entry_t *LittleKV::insert(uint32_t hash, uint32_t check)
+{
+    size_t mask = index_size - 1;
+    size_t i;
+
+    for (i = hash & mask; index[i].hash != 0; i = (i + 1) & mask)
+    {
+    }
+
+    if (keys >= cfg.capacity)
+    {
+        return NULL;
+    }
+
+    index[i].hash = hash;
+    index[i].check = check;
+    keys++;
+
+    return &index[i];
+}
+
+void LittleKV::remove(kv_entry_t *entry)
+{
+    size_t mask = index_size - 1;
+    size_t i = entry - index;
+
+    // Backward shift deletion keeps the probe sequences intact without
+    // leaving tombstones in the table
+    for (size_t j = (i + 1) & mask; index[j].hash != 0; j = (j + 1) & mask)
+    {
+        size_t home = index[j].hash & mask;
+        bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays)
+        {
+            index[i] = index[j];
+            i = j;
+        }
+    }
+
+    index[i] = {};
+    keys--;
+}
+
+// Only the task running iterate() can get here with the lock already held
+bool LittleKV::reentered()
+{
+    if (iterating == xTaskGetCurrentTaskHandle())
+    {
+        errno = EDEADLK;
+        return true;
+    }
+
+    return false;
+}
+
+// ============================================================================
+// Segments
+// ============================================================================
+
+// Returns the segment's path in the buffer sized for it by init(), or NULL
+// if it doesn't fit.  Only valid until the next call, so must be called
+// with the lock held (or from init and term).
+const char *LittleKV::seg_name(uint32_t id)
+{
+    int len = snprintf(name, name_size, "%s/%08x.kv", dir, id);
+    if (len < 0 || (size_t) len >= name_size)
+    {
+        ESP_LOGE(TAG, "Segment name for %08x doesn't fit", id);
+        return NULL;
+    }
+
+    return name;
+}
+
+// Must be called with the LittleFlash lock held
+void LittleKV::seg_invalidate(uint32_t id)
+{
+    const char *path = seg_name(id);
+    if (path)
+    {
+        cfg.fs->invalidate(path, false);
+    }
+}
+
+int LittleKV::seg_open(int slot, uint32_t id, bool create)
+{
+    const char *path = seg_name(id);
+    if (path == NULL)
+    {
+        return LFS_ERR_INVAL;
+    }
+
+    kv_seg_t *seg = &segs[slot];
+    *seg = {};
+
+    cfg.fs->lock_acquire();
+
+    int flags = LFS_O_RDWR | (create ? LFS_O_CREAT | LFS_O_EXCL : 0);
+    int err = cfg.fs->file_open(&seg->file, path, flags);
+    if (err == LFS_ERR_OK)
+    {
+        seg->size = lfs_file_size(&cfg.fs->lfs, &seg->file);
+    }
+
+    if (create)
+    {
+        cfg.fs->invalidate(path, false);
+    }
+
+    cfg.fs->lock_release();
+
+    if (err < 0)
+    {
+        return err;
+    }
+
+    seg->id = id;
+    seg->open = true;
+
+    return LFS_ERR_OK;
+}
+
+int LittleKV::seg_scan(int slot)
+{
+    kv_seg_t *seg = &segs[slot];
+    uint32_t off = 0;
+
+    while (off + sizeof(kv_hdr_t) <= seg->size)
+    {
+        kv_hdr_t hdr;
+        char key[LITTLE_KV_KEY_MAX];
+
+        int err = read_at(seg, off, &hdr, sizeof(hdr));
+        if (err < 0)
+        {
+            return err;
+        }
+
+        uint32_t rec_len = sizeof(hdr) + hdr.key_len + hdr.val_len;
+        if (hdr.key_len == 0 || hdr.key_len > LITTLE_KV_KEY_MAX || off + rec_len > seg->size)
+        {
+            break;
+        }
+
+        err = read_at(seg, off + sizeof(hdr), key, hdr.key_len);
+        if (err < 0)
+        {
+            return err;
+        }
+
+        uint32_t crc = 0xffffffff;
+        lfs_crc(&crc, &hdr.key_len, sizeof(hdr) - sizeof(hdr.crc));
+        lfs_crc(&crc, key, hdr.key_len);
+        for (uint32_t done = 0; done < hdr.val_len; )
+        {
+            size_t len = std::min((uint32_t) KV_COPY_SIZE, hdr.val_len - done);
+            err = read_at(seg, off + sizeof(hdr) + hdr.key_len + done, copy_buf, len);
+            if (err < 0)
+            {
+                return err;
+            }
+            lfs_crc(&crc, copy_buf, len);
+            done += len;
+        }
+
+        if (crc != hdr.crc)
+        {
+            break;
+        }
+
+        uint32_t hash;
+        uint32_t check;
+        hash_key(key, hdr.key_len, &hash, &check);
+
+        kv_entry_t *entry;
+        err = find(key, hdr.key_len, hash, check, &entry);
+        if (err < 0)
+        {
+            return err;
+        }
+
+        if (entry)
+        {
+            segs[KV_SLOT(entry->loc)].live--;
+        }
+
+        if (hdr.flags & KV_FLAG_DELETED)
+        {
+            if (entry)
+            {
+                remove(entry);
+            }
+        }
+        else
+        {
+            if (entry == NULL)
+            {
+                entry = insert(hash, check);
+                if (entry == NULL)
+                {
+                    return LFS_ERR_NOSPC;
+                }
+            }
+
+            entry->loc = KV_LOC(slot, off);
+            seg->live++;
+        }
+
+        seg->records++;
+        off += rec_len;
+    }
+
+    // Drop a torn record left by an interrupted put
+    if (off < seg->size)
+    {
+        ESP_LOGW(TAG, "Truncating segment %08x at %u", seg->id, off);
+
+        cfg.fs->lock_acquire();
+
+        int err = lfs_file_truncate(&cfg.fs->lfs, &seg->file, off);
+        if (err == LFS_ERR_OK)
+        {
+            err = lfs_file_sync(&cfg.fs->lfs, &seg->file);
+        }
+        seg_invalidate(seg->id);
+
+        cfg.fs->lock_release();
+
+        if (err < 0)
+        {
+            return err;
+        }
+
+        seg->size = off;
+        seg->at_end = false;
+    }
+
+    return LFS_ERR_OK;
+}
+
+int LittleKV::seg_start()
+{
+    int slot;
+    uint32_t id = 0;
+
+    for (slot = 0; slot < cfg.segments && segs[slot].open; slot++)
+    {
+    }
+
+    for (int i = 0; i < cfg.segments; i++)
+    {
+        if (segs[i].open && segs[i].id > id)
+        {
+            id = segs[i].id;
+        }
+    }
+
+    if (slot == cfg.segments)
+    {
+        return LFS_ERR_NOSPC;
+    }
+
+    // Seal the current segment before moving on
+    if (active >= 0)
+    {
+        cfg.fs->lock_acquire();
+
+        int err = lfs_file_sync(&cfg.fs->lfs, &segs[active].file);
+
+        seg_invalidate(segs[active].id);
+
+        cfg.fs->lock_release();
+
+        if (err < 0)
+        {
+            return err;
+        }
+    }
+
+    int err = seg_open(slot, id + 1, true);
+    if (err < 0)
+    {
+        return err;
+    }
+
+    segs[slot].at_end = true;
+    active = slot;
+
+    if (task)
+    {
+        xTaskNotifyGive(task);
+    }
+
+    return LFS_ERR_OK;
+}
+
+int LittleKV::seg_oldest()
+{
+    int oldest = -1;
+
+    for (int slot = 0; slot < cfg.segments; slot++)
+    {
+        if (segs[slot].open && slot != active && (oldest < 0 || segs[slot].id < segs[oldest].id))
+        {
+            oldest = slot;
+        }
+    }
+
+    return oldest;
+}
+
+int LittleKV::seg_count()
+{
+    int count = 0;
+
+    for (int slot = 0; slot < cfg.segments; slot++)
+    {
+        if (segs[slot].open)
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+int LittleKV::read_at(kv_seg_t *seg, uint32_t off, void *buffer, size_t size)
+{
+    LittleFlash *fs = cfg.fs;
+
+    fs->lock_acquire();
+
+    // Seeking flushes the file, so skip it when already positioned
+    int err = LFS_ERR_OK;
+    if (lfs_file_tell(&fs->lfs, &seg->file) != (lfs_soff_t) off)
+    {
+        err = lfs_file_seek(&fs->lfs, &seg->file, off, LFS_SEEK_SET);
+        seg->at_end = false;
+    }
+
+    if (err >= 0)
+    {
+        lfs_ssize_t read = lfs_file_read(&fs->lfs, &seg->file, buffer, size);
+        if (read >= 0 && (size_t) read != size)
+        {
+            err = LFS_ERR_CORRUPT;
+        }
+        else if (read < 0)
+        {
+            err = read;
+        }
+        seg->at_end = off + size == seg->size;
+    }
+
+    fs->lock_release();
+
+    return err < 0 ? err : LFS_ERR_OK;
+}
+
+int LittleKV::append(const char *key, size_t key_len, const void *value, size_t val_len, uint16_t flags, uint32_t *loc)
+{
+    kv_seg_t *seg = &segs[active];
+    size_t rec_len = sizeof(kv_hdr_t) + key_len + val_len;
+
+    // Segments are soft limited, but offsets must fit in the index
+    if (seg->size + rec_len > cfg.segment_size && seg->size > 0)
+    {
+        int err = seg_start();
+        if (err == LFS_ERR_OK)
+        {
+            seg = &segs[active];
+        }
+        else if (err != LFS_ERR_NOSPC || seg->size + rec_len > KV_OFF_MAX)
+        {
+            return err;
+        }
+    }
+
+    kv_hdr_t hdr;
+    hdr.key_len = key_len;
+    hdr.flags = flags;
+    hdr.val_len = val_len;
+    hdr.crc = 0xffffffff;
+    lfs_crc(&hdr.crc, &hdr.key_len, sizeof(hdr) - sizeof(hdr.crc));
+    lfs_crc(&hdr.crc, key, key_len);
+    lfs_crc(&hdr.crc, value, val_len);
+
+    LittleFlash *fs = cfg.fs;
+
+    fs->lock_acquire();
+
+    int err = LFS_ERR_OK;
+    if (!seg->at_end)
+    {
+        err = lfs_file_seek(&fs->lfs, &seg->file, 0, LFS_SEEK_END);
+    }
+
+    lfs_ssize_t written = 0;
+    if (err >= 0)
+    {
+        written = lfs_file_write(&fs->lfs, &seg->file, &hdr, sizeof(hdr));
+    }
+    if (err >= 0 && written >= 0)
+    {
+        written = lfs_file_write(&fs->lfs, &seg->file, key, key_len);
+    }
+    if (err >= 0 && written >= 0 && val_len > 0)
+    {
+        written = lfs_file_write(&fs->lfs, &seg->file, value, val_len);
+    }
+    if (err >= 0 && written < 0)
+    {
+        err = written;
+    }
+
+    if (err >= 0 && cfg.sync_writes)
+    {
+        err = lfs_file_sync(&fs->lfs, &seg->file);
+        seg_invalidate(seg->id);
+    }
+
+    if (err < 0)
+    {
+        // The partial record will fail its CRC and be dropped at the next
+        // load, but make sure the next append repositions first
+        seg->at_end = false;
+        seg->size = lfs_file_size(&fs->lfs, &seg->file);
+    }
+
+    fs->lock_release();
+
+    if (err < 0)
+    {
+        return err;
+    }
+
+    *loc = KV_LOC(active, seg->size);
+    seg->size += rec_len;
+    seg->records++;
+    seg->at_end = true;
+
+    return LFS_ERR_OK;
+}
+
+// Moves the record at *off in the given segment to the active segment if
+// it's still live.  Returns 0 to continue, 1 when the segment is done.
+int LittleKV::compact_locked(int slot, uint32_t *off)
+{
+    kv_seg_t *seg = &segs[slot];
+
+    if (*off + sizeof(kv_hdr_t) > seg->size)
+    {
+        return 1;
+    }
+
+    struct
+    {
+        kv_hdr_t hdr;
+        char key[LITTLE_KV_KEY_MAX];
+    } rec;
+
+    int err = read_at(seg, *off, &rec.hdr, sizeof(rec.hdr));
+    if (err >= 0)
+    {
+        err = read_at(seg, *off + sizeof(rec.hdr), rec.key, rec.hdr.key_len);
+    }
+    if (err < 0)
+    {
+        return err;
+    }
+
+    uint32_t rec_len = sizeof(rec.hdr) + rec.hdr.key_len + rec.hdr.val_len;
+
+    // Tombstones in the oldest segment have nothing left to hide
+    kv_entry_t *entry = NULL;
+    if (!(rec.hdr.flags & KV_FLAG_DELETED))
+    {
+        uint32_t hash;
+        uint32_t check;
+        hash_key(rec.key, rec.hdr.key_len, &hash, &check);
+        entry = find_loc(hash, check, KV_LOC(slot, *off));
+    }
+
+    if (entry == NULL)
+    {
+        *off += rec_len;
+        return 0;
+    }
+
+    kv_seg_t *dst = &segs[active];
+    if (dst->size + rec_len > cfg.segment_size && seg_count() < cfg.segments)
+    {
+        err = seg_start();
+        if (err < 0)
+        {
+            return err;
+        }
+        dst = &segs[active];
+    }
+
+    LittleFlash *fs = cfg.fs;
+
+    fs->lock_acquire();
+
+    if (!dst->at_end)
+    {
+        err = lfs_file_seek(&fs->lfs, &dst->file, 0, LFS_SEEK_END);
+    }
+
+    lfs_ssize_t written = 0;
+    if (err >= 0)
+    {
+        written = lfs_file_write(&fs->lfs, &dst->file, &rec, sizeof(rec.hdr) + rec.hdr.key_len);
+    }
+
+    fs->lock_release();
+
+    for (uint32_t done = 0; err >= 0 && written >= 0 && done < rec.hdr.val_len; )
+    {
+        size_t len = std::min((uint32_t) KV_COPY_SIZE, rec.hdr.val_len - done);
+        err = read_at(seg, *off + sizeof(rec.hdr) + rec.hdr.key_len + done, copy_buf, len);
+        if (err >= 0)
+        {
+            fs->lock_acquire();
+            written = lfs_file_write(&fs->lfs, &dst->file, copy_buf, len);
+            fs->lock_release();
+        }
+        done += len;
+    }
+
+    if (err >= 0 && written < 0)
+    {
+        err = written;
+    }
+
+    if (err < 0)
+    {
+        fs->lock_acquire();
+
+        dst->at_end = false;
+        dst->size = lfs_file_size(&fs->lfs, &dst->file);
+
+        fs->lock_release();
+
+        return err;
+    }
+
+    entry->loc = KV_LOC(active, dst->size);
+    dst->size += rec_len;
+    dst->records++;
+    dst->live++;
+    dst->at_end = true;
+    seg->live--;
+
+    *off += rec_len;
+
+    return 0;
+}
+
+void LittleKV::compact_task(void *arg)
+{
+    LittleKV *that = (LittleKV *) arg;
+
+    while (!that->task_stop)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (!that->task_stop && that->compact() > 0)
+        {
+        }
+    }
+
+    that->task = NULL;
+    vTaskDelete(NULL);
+}
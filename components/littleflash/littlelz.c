@@ -0,0 +1,202 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include "littlelz.h"
+
+//
+// The stream is a sequence of:
+//
+//   000LLLLL                       literal run of L+1 bytes
+//   LLLOOOOO OOOOOOOO              copy L+2 bytes from O+1 bytes back (L 1-6)
+//   111OOOOO LLLLLLLL OOOOOOOO     copy L+9 bytes from O+1 bytes back
+//
+
+#define HASH_LOG 10
+#define MAX_LIT 32
+#define MAX_OFF 8192
+#define MAX_REF 264
+
+static inline uint32_t hash3(const uint8_t *p)
+{
+    uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+size_t little_lz_compress(const void *in, size_t in_len, void *out, size_t out_len, uint16_t *htab)
+{
+    const uint8_t *base = (const uint8_t *) in;
+    const uint8_t *ip = base;
+    const uint8_t *in_end = ip + in_len;
+    uint8_t *op = (uint8_t *) out;
+    uint8_t *out_end = op + out_len;
+    uint8_t *lit_ctl;
+    size_t lit = 0;
+
+    if (in_len == 0 || in_len > LITTLE_LZ_MAX_INPUT || out_len == 0)
+    {
+        return 0;
+    }
+
+    // Positions are stored plus one so zero means empty
+    memset(htab, 0, LITTLE_LZ_HASH_SIZE * sizeof(uint16_t));
+
+    // Reserve the control byte of the first literal run
+    lit_ctl = op++;
+
+    while (ip < in_end)
+    {
+        if (ip + 3 <= in_end)
+        {
+            uint32_t h = hash3(ip);
+            size_t cand = htab[h];
+            htab[h] = (uint16_t) (ip - base + 1);
+
+            const uint8_t *ref = cand ? base + cand - 1 : NULL;
+            if (ref && (size_t) (ip - ref) <= MAX_OFF &&
+                ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2])
+            {
+                size_t max = in_end - ip;
+                if (max > MAX_REF)
+                {
+                    max = MAX_REF;
+                }
+
+                size_t len = 3;
+                while (len < max && ref[len] == ip[len])
+                {
+                    len++;
+                }
+
+                // Close the literal run or give back its unused control byte
+                if (lit)
+                {
+                    *lit_ctl = (uint8_t) (lit - 1);
+                }
+                else
+                {
+                    op--;
+                }
+
+                // The reference plus the next run's control byte
+                if (op + 4 > out_end)
+                {
+                    return 0;
+                }
+
+                size_t off = ip - ref - 1;
+                size_t l = len - 2;
+                if (l < 7)
+                {
+                    *op++ = (uint8_t) ((l << 5) | (off >> 8));
+                }
+                else
+                {
+                    *op++ = (uint8_t) ((7 << 5) | (off >> 8));
+                    *op++ = (uint8_t) (l - 7);
+                }
+                *op++ = (uint8_t) off;
+
+                lit = 0;
+                lit_ctl = op++;
+                ip += len;
+                continue;
+            }
+        }
+
+        if (op >= out_end)
+        {
+            return 0;
+        }
+
+        *op++ = *ip++;
+        if (++lit == MAX_LIT)
+        {
+            *lit_ctl = (uint8_t) (lit - 1);
+            lit = 0;
+            lit_ctl = op++;
+        }
+    }
+
+    if (lit)
+    {
+        *lit_ctl = (uint8_t) (lit - 1);
+    }
+    else
+    {
+        op--;
+    }
+
+    return op - (uint8_t *) out;
+}
+
+size_t little_lz_decompress(const void *in, size_t in_len, void *out, size_t out_len)
+{
+    const uint8_t *ip = (const uint8_t *) in;
+    const uint8_t *in_end = ip + in_len;
+    uint8_t *op = (uint8_t *) out;
+    uint8_t *out_end = op + out_len;
+
+    while (ip < in_end)
+    {
+        size_t c = *ip++;
+
+        if (c < 32)
+        {
+            c++;
+            if (ip + c > in_end || op + c > out_end)
+            {
+                return 0;
+            }
+
+            memcpy(op, ip, c);
+            op += c;
+            ip += c;
+            continue;
+        }
+
+        size_t len = c >> 5;
+        if (len == 7)
+        {
+            if (ip >= in_end)
+            {
+                return 0;
+            }
+            len += *ip++;
+        }
+        len += 2;
+
+        if (ip >= in_end)
+        {
+            return 0;
+        }
+
+        size_t dist = (((c & 0x1f) << 8) | *ip++) + 1;
+        if (dist > (size_t) (op - (uint8_t *) out) || op + len > out_end)
+        {
+            return 0;
+        }
+
+        // Overlapping copies repeat the pattern, so go a byte at a time
+        const uint8_t *ref = op - dist;
+        while (len--)
+        {
+            *op++ = *ref++;
+        }
+    }
+
+    return op - (uint8_t *) out;
+}
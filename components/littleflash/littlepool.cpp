@@ -0,0 +1,300 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <stdlib.h>
+#include <sys/lock.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_err.h"
+
+#include "littlepool.h"
+#include "littleflash.h"
+
+LittlePool::LittlePool()
+{
+    initialized = false;
+}
+
+LittlePool::~LittlePool()
+{
+    term();
+}
+
+esp_err_t LittlePool::init(size_t budget)
+{
+    if (budget == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    this->budget = budget;
+    stats = {};
+    for (int i = 0; i < LITTLE_POOL_MOUNTS; i++)
+    {
+        clients[i] = {};
+    }
+
+    _lock_init(&lock);
+    initialized = true;
+
+    return ESP_OK;
+}
+
+// Mounts using the pool must be terminated first
+void LittlePool::term()
+{
+    if (initialized)
+    {
+        _lock_close(&lock);
+        initialized = false;
+    }
+}
+
+void LittlePool::get_stats(const LittleFlash *fs, little_pool_stats_t *stats)
+{
+    _lock_acquire(&lock);
+
+    *stats = {};
+    if (fs == NULL)
+    {
+        *stats = this->stats;
+    }
+    else
+    {
+        for (int i = 0; i < LITTLE_POOL_MOUNTS; i++)
+        {
+            if (clients[i].fs == fs)
+            {
+                *stats = clients[i].stats;
+                break;
+            }
+        }
+    }
+
+    _lock_release(&lock);
+}
+
+// Counts start over, what's in use now stays
+void LittlePool::reset_stats()
+{
+    _lock_acquire(&lock);
+
+    stats = { stats.used, stats.used };
+    for (int i = 0; i < LITTLE_POOL_MOUNTS; i++)
+    {
+        clients[i].stats = { clients[i].stats.used, clients[i].stats.used };
+    }
+
+    _lock_release(&lock);
+}
+
+// Returns the mount's id, or -1 if the pool has no room for another
+int LittlePool::attach(LittleFlash *fs, size_t limit)
+{
+    _lock_acquire(&lock);
+
+    int id = -1;
+    for (int i = 0; i < LITTLE_POOL_MOUNTS; i++)
+    {
+        if (clients[i].fs == NULL)
+        {
+            clients[i] = {};
+            clients[i].fs = fs;
+            clients[i].limit = limit;
+            id = i;
+            break;
+        }
+    }
+
+    _lock_release(&lock);
+
+    return id;
+}
+
+// The mount has given back everything by now
+void LittlePool::detach(int id)
+{
+    set_reclaimable(id, false);
+
+    _lock_acquire(&lock);
+
+    clients[id] = {};
+
+    _lock_release(&lock);
+}
+
+// A mount is only reclaimable once it's fully initialized, and stops being
+// so before it's terminated.  Turning it off waits for reclaims already
+// calling into the mount, so it can be torn down once this returns.
+void LittlePool::set_reclaimable(int id, bool reclaimable)
+{
+    _lock_acquire(&lock);
+
+    clients[id].reclaimable = reclaimable;
+    while (!reclaimable && clients[id].busy > 0)
+    {
+        _lock_release(&lock);
+        vTaskDelay(1);
+        _lock_acquire(&lock);
+    }
+
+    _lock_release(&lock);
+}
+
+// Must be called with lock held
+bool LittlePool::fits(int id, size_t size)
+{
+    client_t *c = &clients[id];
+
+    return stats.used + size <= budget && (c->limit == 0 || c->stats.used + size <= c->limit);
+}
+
+// Charges size bytes to the mount, taking memory back from the others if
+// the pool is full.  A mount at its own limit has to make room itself.
+bool LittlePool::charge(int id, size_t size)
+{
+    client_t *c = &clients[id];
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        _lock_acquire(&lock);
+
+        if (fits(id, size))
+        {
+            stats.used += size;
+            stats.peak = std::max(stats.peak, stats.used);
+            stats.charges++;
+            c->stats.used += size;
+            c->stats.peak = std::max(c->stats.peak, c->stats.used);
+            c->stats.charges++;
+
+            _lock_release(&lock);
+            return true;
+        }
+
+        bool over_limit = c->limit && c->stats.used + size > c->limit;
+
+        _lock_release(&lock);
+
+        if (pass > 0 || over_limit || size > budget)
+        {
+            break;
+        }
+
+        reclaim(id, size);
+    }
+
+    _lock_acquire(&lock);
+    stats.failures++;
+    c->stats.failures++;
+    _lock_release(&lock);
+
+    return false;
+}
+
+void LittlePool::uncharge(int id, size_t size)
+{
+    _lock_acquire(&lock);
+
+    stats.used -= size;
+    clients[id].stats.used -= size;
+
+    _lock_release(&lock);
+}
+
+void *LittlePool::alloc(int id, size_t size)
+{
+    if (!charge(id, size))
+    {
+        return NULL;
+    }
+
+    void *buf = malloc(size);
+    if (buf == NULL)
+    {
+        uncharge(id, size);
+    }
+
+    return buf;
+}
+
+void LittlePool::release(int id, void *buf, size_t size)
+{
+    if (buf)
+    {
+        free(buf);
+        uncharge(id, size);
+    }
+}
+
+// Takes memory back from the other mounts, least recently used first.
+// Their locks are only tried, so a mount that's busy right now keeps what
+// it has and two mounts reclaiming from each other can't deadlock.  Each
+// mount is marked busy while it's called, so it can't be terminated then.
+void LittlePool::reclaim(int id, size_t size)
+{
+    LittleFlash *order[LITTLE_POOL_MOUNTS];
+    uint32_t ticks[LITTLE_POOL_MOUNTS];
+    int ids[LITTLE_POOL_MOUNTS];
+    int count = 0;
+
+    _lock_acquire(&lock);
+
+    size_t need = stats.used + size > budget ? stats.used + size - budget : 0;
+    for (int i = 0; i < LITTLE_POOL_MOUNTS; i++)
+    {
+        if (clients[i].fs == NULL || !clients[i].reclaimable || i == id)
+        {
+            continue;
+        }
+        clients[i].busy++;
+
+        // Insertion sort on when each was last used
+        uint32_t tick = clients[i].fs->pool_last_used();
+        int j = count++;
+        while (j > 0 && ticks[j - 1] > tick)
+        {
+            order[j] = order[j - 1];
+            ticks[j] = ticks[j - 1];
+            ids[j] = ids[j - 1];
+            j--;
+        }
+        order[j] = clients[i].fs;
+        ticks[j] = tick;
+        ids[j] = i;
+    }
+
+    _lock_release(&lock);
+
+    for (int i = 0; i < count; i++)
+    {
+        size_t freed = need > 0 ? order[i]->pool_reclaim(need) : 0;
+
+        _lock_acquire(&lock);
+        clients[ids[i]].busy--;
+        if (freed > 0)
+        {
+            stats.reclaims++;
+            stats.reclaimed += freed;
+            clients[ids[i]].stats.reclaims++;
+            clients[ids[i]].stats.reclaimed += freed;
+        }
+        _lock_release(&lock);
+
+        need = freed >= need ? 0 : need - freed;
+    }
+}
@@ -0,0 +1,426 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "bench_lfs.h"
+
+#define BENCH_DIR "/bench"
+#define FILL_DIR "/fill"
+#define IO_SIZE 4096
+#define FILL_FILE_SIZE (64 * 1024)
+#define SMALL_FILE_SIZE 64
+#define RECORD_SIZE 64
+
+#define BENCH_CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            fprintf(stderr, "bench: '%s' failed at line %d\n", #expr, __LINE__); \
+            return -1; \
+        } \
+    } while (0)
+
+typedef struct
+{
+    const bench_ops_t *ops;
+    const bench_config_t *cfg;
+    size_t file_size;
+    int random_ops;
+    int small_files;
+    int records;
+    uint8_t *buf;
+    uint32_t rng;
+    int results;
+    int fill;
+    int fill_files;
+} bench_t;
+
+// Same sequence everywhere so runs are comparable
+static uint32_t bench_rand(bench_t *b)
+{
+    b->rng ^= b->rng << 13;
+    b->rng ^= b->rng >> 17;
+    b->rng ^= b->rng << 5;
+
+    return b->rng;
+}
+
+static void bench_report(bench_t *b, const char *name, uint32_t ops, uint64_t bytes, uint64_t us)
+{
+    double s = (us ? us : 1) / 1e6;
+
+    if (b->cfg->format == BENCH_JSON)
+    {
+        printf("%s\n    {\"name\": \"%s\", \"fill\": %d, \"ops\": %u, \"bytes\": %llu, \"us\": %llu, "
+               "\"ops_per_s\": %.1f, \"mb_per_s\": %.3f}",
+               b->results ? "," : "",
+               name,
+               b->fill,
+               (unsigned) ops,
+               (unsigned long long) bytes,
+               (unsigned long long) us,
+               ops / s,
+               bytes / (1024.0 * 1024.0) / s);
+    }
+    else
+    {
+        printf("%s,%s,%d,%u,%llu,%llu,%.1f,%.3f\n",
+               b->cfg->suite,
+               name,
+               b->fill,
+               (unsigned) ops,
+               (unsigned long long) bytes,
+               (unsigned long long) us,
+               ops / s,
+               bytes / (1024.0 * 1024.0) / s);
+    }
+    fflush(stdout);
+
+    b->results++;
+}
+
+static int bench_write_file(bench_t *b, const char *path, size_t size)
+{
+    const bench_ops_t *ops = b->ops;
+
+    int fd = ops->open(ops->ctx, path, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int err = 0;
+    for (size_t done = 0; err == 0 && done < size; done += IO_SIZE)
+    {
+        size_t len = size - done < IO_SIZE ? size - done : IO_SIZE;
+        if (ops->write(ops->ctx, fd, b->buf, len) != (ssize_t) len)
+        {
+            err = -1;
+        }
+    }
+
+    if (ops->close(ops->ctx, fd) != 0)
+    {
+        err = -1;
+    }
+
+    return err;
+}
+
+static int bench_sequential(bench_t *b)
+{
+    const bench_ops_t *ops = b->ops;
+    const char *path = BENCH_DIR "/seq";
+
+    uint64_t start = ops->now_us(ops->ctx);
+    BENCH_CHECK(bench_write_file(b, path, b->file_size) == 0);
+    bench_report(b, "seq_write", b->file_size / IO_SIZE, b->file_size, ops->now_us(ops->ctx) - start);
+
+    start = ops->now_us(ops->ctx);
+    int fd = ops->open(ops->ctx, path, O_RDONLY);
+    BENCH_CHECK(fd >= 0);
+    size_t done = 0;
+    ssize_t len;
+    while ((len = ops->read(ops->ctx, fd, b->buf, IO_SIZE)) > 0)
+    {
+        done += len;
+    }
+    BENCH_CHECK(ops->close(ops->ctx, fd) == 0);
+    BENCH_CHECK(len == 0 && done == b->file_size);
+    bench_report(b, "seq_read", b->file_size / IO_SIZE, b->file_size, ops->now_us(ops->ctx) - start);
+
+    BENCH_CHECK(ops->unlink(ops->ctx, path) == 0);
+
+    return 0;
+}
+
+static int bench_random(bench_t *b)
+{
+    const bench_ops_t *ops = b->ops;
+    const char *path = BENCH_DIR "/random";
+    size_t blocks = b->file_size / IO_SIZE;
+
+    BENCH_CHECK(bench_write_file(b, path, b->file_size) == 0);
+
+    uint64_t start = ops->now_us(ops->ctx);
+    int fd = ops->open(ops->ctx, path, O_RDWR);
+    BENCH_CHECK(fd >= 0);
+    for (int i = 0; i < b->random_ops; i++)
+    {
+        off_t off = (off_t) (bench_rand(b) % blocks) * IO_SIZE;
+        BENCH_CHECK(ops->seek(ops->ctx, fd, off) == off);
+        BENCH_CHECK(ops->write(ops->ctx, fd, b->buf, IO_SIZE) == IO_SIZE);
+    }
+    BENCH_CHECK(ops->fsync(ops->ctx, fd) == 0);
+    bench_report(b, "rand_write_4k", b->random_ops, (uint64_t) b->random_ops * IO_SIZE, ops->now_us(ops->ctx) - start);
+
+    start = ops->now_us(ops->ctx);
+    for (int i = 0; i < b->random_ops; i++)
+    {
+        off_t off = (off_t) (bench_rand(b) % blocks) * IO_SIZE;
+        BENCH_CHECK(ops->seek(ops->ctx, fd, off) == off);
+        BENCH_CHECK(ops->read(ops->ctx, fd, b->buf, IO_SIZE) == IO_SIZE);
+    }
+    bench_report(b, "rand_read_4k", b->random_ops, (uint64_t) b->random_ops * IO_SIZE, ops->now_us(ops->ctx) - start);
+
+    BENCH_CHECK(ops->close(ops->ctx, fd) == 0);
+    BENCH_CHECK(ops->unlink(ops->ctx, path) == 0);
+
+    return 0;
+}
+
+static int bench_small_files(bench_t *b)
+{
+    const bench_ops_t *ops = b->ops;
+    const char *dir = BENCH_DIR "/small";
+    char path[32];
+
+    BENCH_CHECK(ops->mkdir(ops->ctx, dir) == 0);
+
+    uint64_t start = ops->now_us(ops->ctx);
+    for (int i = 0; i < b->small_files; i++)
+    {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        BENCH_CHECK(bench_write_file(b, path, SMALL_FILE_SIZE) == 0);
+    }
+    bench_report(b, "create", b->small_files, (uint64_t) b->small_files * SMALL_FILE_SIZE, ops->now_us(ops->ctx) - start);
+
+    start = ops->now_us(ops->ctx);
+    for (int i = 0; i < b->small_files; i++)
+    {
+        size_t size;
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        BENCH_CHECK(ops->stat(ops->ctx, path, &size) == 0 && size == SMALL_FILE_SIZE);
+    }
+    bench_report(b, "stat", b->small_files, 0, ops->now_us(ops->ctx) - start);
+
+    start = ops->now_us(ops->ctx);
+    int entries = ops->list(ops->ctx, dir);
+    BENCH_CHECK(entries == b->small_files);
+    bench_report(b, "list", entries, 0, ops->now_us(ops->ctx) - start);
+
+    start = ops->now_us(ops->ctx);
+    for (int i = 0; i < b->small_files; i++)
+    {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        BENCH_CHECK(ops->unlink(ops->ctx, path) == 0);
+    }
+    bench_report(b, "unlink", b->small_files, 0, ops->now_us(ops->ctx) - start);
+
+    BENCH_CHECK(ops->rmdir(ops->ctx, dir) == 0);
+
+    return 0;
+}
+
+static int bench_log(bench_t *b)
+{
+    const bench_ops_t *ops = b->ops;
+    const char *path = BENCH_DIR "/log";
+
+    uint64_t start = ops->now_us(ops->ctx);
+    int fd = ops->open(ops->ctx, path, O_WRONLY | O_CREAT | O_APPEND);
+    BENCH_CHECK(fd >= 0);
+    for (int i = 0; i < b->records; i++)
+    {
+        BENCH_CHECK(ops->write(ops->ctx, fd, b->buf, RECORD_SIZE) == RECORD_SIZE);
+        BENCH_CHECK(ops->fsync(ops->ctx, fd) == 0);
+    }
+    BENCH_CHECK(ops->close(ops->ctx, fd) == 0);
+    bench_report(b, "append_fsync", b->records, (uint64_t) b->records * RECORD_SIZE, ops->now_us(ops->ctx) - start);
+
+    BENCH_CHECK(ops->unlink(ops->ctx, path) == 0);
+
+    return 0;
+}
+
+static int bench_mount(bench_t *b)
+{
+    const bench_ops_t *ops = b->ops;
+
+    BENCH_CHECK(ops->unmount(ops->ctx) == 0);
+
+    uint64_t start = ops->now_us(ops->ctx);
+    BENCH_CHECK(ops->mount(ops->ctx) == 0);
+    bench_report(b, "mount", 1, 0, ops->now_us(ops->ctx) - start);
+
+    return 0;
+}
+
+// Blocks a file takes in LittleFS, whose blocks also hold the file's skip
+// list pointers (two on average)
+static size_t bench_blocks(size_t size, size_t block_size)
+{
+    return size / (block_size - 8) + 1;
+}
+
+// Adds filler files until the blocks in use reach the level.  The level
+// is clipped to leave room for what the suite writes while the filler is
+// in place: the random I/O file twice over since rewriting it copies on
+// write, a block per small file, the log, directories and some slack.
+static int bench_fill(bench_t *b, int level)
+{
+    const bench_ops_t *ops = b->ops;
+    size_t capacity = ops->capacity(ops->ctx);
+    size_t block_size = ops->block_size(ops->ctx);
+    size_t reserve = (2 * bench_blocks(b->file_size, block_size) +
+                      b->small_files +
+                      bench_blocks((size_t) b->records * RECORD_SIZE, block_size) +
+                      16) * block_size;
+    size_t target = capacity / 100 * level;
+    size_t limit = capacity > reserve ? capacity - reserve : 0;
+    size_t file = bench_blocks(FILL_FILE_SIZE, block_size) * block_size;
+    char path[32];
+
+    int clipped = target > limit;
+    if (clipped)
+    {
+        target = limit;
+    }
+
+    size_t used = ops->used(ops->ctx);
+    BENCH_CHECK(used > 0);
+    while (used + file <= target)
+    {
+        snprintf(path, sizeof(path), FILL_DIR "/%d", b->fill_files);
+        if (bench_write_file(b, path, FILL_FILE_SIZE) != 0)
+        {
+            ops->unlink(ops->ctx, path);
+            break;
+        }
+        b->fill_files++;
+
+        used = ops->used(ops->ctx);
+        BENCH_CHECK(used > 0);
+    }
+
+    b->fill = (int) ((uint64_t) used * 100 / capacity);
+    if (clipped)
+    {
+        fprintf(stderr, "bench: fill %d%% clipped to %d%% to leave room for the suite\n", level, b->fill);
+    }
+
+    return 0;
+}
+
+static int bench_unfill(bench_t *b)
+{
+    const bench_ops_t *ops = b->ops;
+    char path[32];
+
+    for (int i = 0; i < b->fill_files; i++)
+    {
+        snprintf(path, sizeof(path), FILL_DIR "/%d", i);
+        BENCH_CHECK(ops->unlink(ops->ctx, path) == 0);
+    }
+    b->fill_files = 0;
+
+    BENCH_CHECK(ops->rmdir(ops->ctx, FILL_DIR) == 0);
+
+    return 0;
+}
+
+int bench_run(const bench_ops_t *ops, const bench_config_t *cfg)
+{
+    static const int default_fills[] = { 10, 50, 90 };
+
+    bench_t b = { 0 };
+    b.ops = ops;
+    b.cfg = cfg;
+    b.file_size = cfg->file_size ? cfg->file_size / IO_SIZE * IO_SIZE : 256 * 1024;
+    b.random_ops = cfg->random_ops ? cfg->random_ops : 64;
+    b.small_files = cfg->small_files ? cfg->small_files : 100;
+    b.records = cfg->records ? cfg->records : 200;
+    b.rng = 0x12345678;
+
+    const int *fills = cfg->fills ? cfg->fills : default_fills;
+    int fill_count = cfg->fills ? cfg->fill_count : (int) (sizeof(default_fills) / sizeof(default_fills[0]));
+
+    b.buf = (uint8_t *) malloc(IO_SIZE);
+    BENCH_CHECK(b.buf != NULL);
+    for (int i = 0; i < IO_SIZE; i++)
+    {
+        b.buf[i] = bench_rand(&b);
+    }
+
+    if (cfg->format == BENCH_JSON)
+    {
+        printf("{\"suite\": \"%s\", \"results\": [", cfg->suite);
+    }
+    else
+    {
+        printf("suite,name,fill,ops,bytes,us,ops_per_s,mb_per_s\n");
+    }
+
+    int err = ops->mkdir(ops->ctx, BENCH_DIR);
+    if (err == 0)
+    {
+        err = ops->mkdir(ops->ctx, FILL_DIR);
+    }
+
+    if (err == 0)
+    {
+        err = bench_sequential(&b);
+    }
+
+    // Everything else is repeated as the filesystem fills up
+    for (int level = -1; err == 0 && level < fill_count; level++)
+    {
+        if (level >= 0)
+        {
+            err = bench_fill(&b, fills[level]);
+        }
+
+        if (err == 0)
+        {
+            err = bench_random(&b);
+        }
+
+        if (err == 0)
+        {
+            err = bench_small_files(&b);
+        }
+
+        if (err == 0)
+        {
+            err = bench_log(&b);
+        }
+
+        if (err == 0)
+        {
+            err = bench_mount(&b);
+        }
+    }
+
+    if (err == 0)
+    {
+        err = bench_unfill(&b);
+    }
+
+    if (err == 0)
+    {
+        err = ops->rmdir(ops->ctx, BENCH_DIR);
+    }
+
+    if (cfg->format == BENCH_JSON)
+    {
+        printf("\n]}\n");
+    }
+
+    free(b.buf);
+
+    return err == 0 ? 0 : -1;
+}
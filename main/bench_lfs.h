@@ -0,0 +1,82 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+//
+// Filesystem benchmark suite.  It only talks to the filesystem through
+// bench_ops_t, so the same suite runs on the target through the VFS and
+// on the host against a simulated flash device (tools/lfsbench).
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct
+{
+    void *ctx;
+
+    // Paths are relative to the root of the filesystem, like "/bench/f1"
+    int (*mount)(void *ctx);
+    int (*unmount)(void *ctx);
+    int (*open)(void *ctx, const char *path, int flags);    // O_* flags
+    int (*close)(void *ctx, int fd);
+    ssize_t (*read)(void *ctx, int fd, void *buf, size_t size);
+    ssize_t (*write)(void *ctx, int fd, const void *buf, size_t size);
+    off_t (*seek)(void *ctx, int fd, off_t off);            // SEEK_SET
+    int (*fsync)(void *ctx, int fd);
+    int (*stat)(void *ctx, const char *path, size_t *size);
+    int (*unlink)(void *ctx, const char *path);
+    int (*mkdir)(void *ctx, const char *path);
+    int (*rmdir)(void *ctx, const char *path);
+    int (*list)(void *ctx, const char *path);               // returns entries listed
+    size_t (*capacity)(void *ctx);                          // filesystem size in bytes
+    size_t (*block_size)(void *ctx);                        // filesystem block size in bytes
+    size_t (*used)(void *ctx);                              // bytes in blocks in use
+    uint64_t (*now_us)(void *ctx);
+} bench_ops_t;
+
+typedef enum
+{
+    BENCH_JSON,
+    BENCH_CSV,
+} bench_format_t;
+
+typedef struct
+{
+    bench_format_t format;
+    const char *suite;          // name recorded with the results
+    size_t file_size;           // size of the random I/O file, 0=256KB
+    int random_ops;             // random reads and writes per run, 0=64
+    int small_files;            // files created, stated and removed, 0=100
+    int records;                // appended and synced log records, 0=200
+    const int *fills;           // fill levels in percent, NULL=10, 50 and 90,
+                                // clipped to leave room for the suite
+    int fill_count;
+} bench_config_t;
+
+// Runs the whole suite, printing results to stdout as they complete.
+// Returns 0, or -1 if an operation failed.
+int bench_run(const bench_ops_t *ops, const bench_config_t *cfg);
+
+#ifdef __cplusplus
+}
+#endif
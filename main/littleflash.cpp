@@ -13,11 +13,27 @@
 // limitations under the License.
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "esp_err.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "lwip/sockets.h"
+#if defined(ESP_IDF_VERSION_MAJOR) && ESP_IDF_VERSION_MAJOR >= 4
+#include "esp_netif.h"
+#else
+#include "tcpip_adapter.h"
+#endif
 
 #include "extflash.h"
 #include "wb_w25q_dual.h"
@@ -27,11 +43,14 @@
 #include "wb_w25q_qpi.h"
 
 #include "littleflash.h"
+#include "littlekv.h"
+#include "littlecrc.h"
 
 extern "C"
 {
 #include "unity.h"
 #include "test_lfs_common.h"
+#include "bench_lfs.h"
 }
 
 #define PIN_SPI_MOSI    GPIO_NUM_23     // PIN 5 - IO0 - DI
@@ -82,7 +101,7 @@ static void test_extflash_teardown()
 #endif
 }
 
-static void test_littleflash_setup(int openfiles)
+static little_flash_config_t test_littleflash_config(int openfiles)
 {
     const little_flash_config_t little_cfg =
     {
@@ -96,10 +115,28 @@ static void test_littleflash_setup(int openfiles)
         .base_path = MOUNT_POINT,
         .open_files = openfiles,
         .auto_format = true,
-        .lookahead = 32
+        .lookahead = 32,
+        .dentry_cache = 0,
+        .compress_prefix = NULL,
+        .wear_stats = false,
+        .ram_size = 0,
+        .prog_size = 0,
+        .verify_writes = false,
+        .read_only = false,
+        .handle_cache = 0,
+        .blank_check = false,
+        .device = NULL,
+        .pool = NULL,
+        .pool_limit = 0,
+        .file_buffers = 0
     };
 
-    TST(littleflash.init(&little_cfg) == ESP_OK, "LittleFlash initialization failed");
+    return little_cfg;
+}
+
+static void test_littleflash_setup(const little_flash_config_t *little_cfg)
+{
+    TST(littleflash.init(little_cfg) == ESP_OK, "LittleFlash initialization failed");
 }
 
 static void test_littleflash_teardown()
@@ -122,10 +159,16 @@ static void test_format()
 #endif
 }
 
-static void test_setup(int openfiles)
+static void test_setup(const little_flash_config_t *little_cfg)
 {
     test_extflash_setup();
-    test_littleflash_setup(openfiles);
+    test_littleflash_setup(little_cfg);
+}
+
+static void test_setup(int openfiles)
+{
+    little_flash_config_t little_cfg = test_littleflash_config(openfiles);
+    test_setup(&little_cfg);
 }
 
 static void test_teardown()
@@ -259,6 +302,2935 @@ TEST_CASE(can_read_write, "write/read speed test", "[fatfs][wear_levelling]")
     test_teardown();
 }
 
+static float test_elapsed(const struct timeval *tv_start)
+{
+    struct timeval tv_end;
+    gettimeofday(&tv_end, NULL);
+
+    return tv_end.tv_sec - tv_start->tv_sec + 1e-6f * (tv_end.tv_usec - tv_start->tv_usec);
+}
+
+static void test_log_speed(const char *file, size_t record_size, size_t records, bool batched)
+{
+    uint8_t record[128];
+    TEST_ASSERT(record_size <= sizeof(record));
+    memset(record, 0x5a, sizeof(record));
+
+    unlink(file);
+
+    littleflash.reset_stats();
+
+    struct timeval tv_start;
+    gettimeofday(&tv_start, NULL);
+
+    if (batched)
+    {
+        const little_flash_log_config_t log_cfg =
+        {
+            .buffer_size = 0,
+            .max_bytes = 0,
+            .max_ms = 1000
+        };
+
+        little_flash_log_t *log = littleflash.log_open(file, &log_cfg);
+        TEST_ASSERT_NOT_NULL(log);
+        for (size_t i = 0; i < records; ++i)
+        {
+            TEST_ASSERT_EQUAL(0, littleflash.log_append(log, record, record_size));
+        }
+        TEST_ASSERT_EQUAL(0, littleflash.log_close(log));
+    }
+    else
+    {
+        int fd = open(file, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        TEST_ASSERT(fd >= 0);
+        for (size_t i = 0; i < records; ++i)
+        {
+            TEST_ASSERT_EQUAL(record_size, write(fd, record, record_size));
+            if ((i + 1) % 16 == 0)
+            {
+                TEST_ASSERT_EQUAL(0, fsync(fd));
+            }
+        }
+        TEST_ASSERT_EQUAL(0, close(fd));
+    }
+
+    float t_s = test_elapsed(&tv_start);
+
+    little_flash_stats_t stats;
+    littleflash.get_stats(&stats);
+
+    struct stat st;
+    TEST_ASSERT_EQUAL(0, stat(file, &st));
+    TEST_ASSERT_EQUAL(record_size * records, st.st_size);
+
+    printf("%s %d records of %d bytes in %.3fms (%.0f records/s, %.1f flash bytes/record)\n",
+           batched ? "Logged" : "Wrote", (int) records, (int) record_size, t_s * 1e3,
+           records / t_s, (float) stats.prog_bytes / records);
+
+    unlink(file);
+}
+
+TEST_CASE(can_log, "append log speed test", "[littleflash]")
+{
+    test_setup(OPENFILES);
+
+    const char *file = MOUNT_POINT "/log.bin";
+
+    test_log_speed(file, 32, 2048, false);
+    test_log_speed(file, 32, 2048, true);
+    test_log_speed(file, 128, 2048, false);
+    test_log_speed(file, 128, 2048, true);
+
+    test_teardown();
+}
+
+static int test_kv_reenter(void *ctx, const char *key, size_t size)
+{
+    LittleKV *kv = (LittleKV *) ctx;
+    uint8_t value[8];
+
+    TEST_ASSERT_EQUAL(-1, kv->get(key, value, sizeof(value)));
+    TEST_ASSERT_EQUAL(EDEADLK, errno);
+    TEST_ASSERT_EQUAL(-1, kv->put(key, value, sizeof(value)));
+    TEST_ASSERT_EQUAL(EDEADLK, errno);
+
+    return 1;
+}
+
+static void test_kv_speed(int keys)
+{
+    const char *dir = MOUNT_POINT "/kvfiles";
+    char key[32];
+    char path[64];
+    uint32_t value[8];
+    struct timeval tv_start;
+    float t_s;
+
+    const little_kv_config_t kv_cfg =
+    {
+        .fs = &littleflash,
+        .path = MOUNT_POINT "/kv",
+        .segments = 4,
+        .segment_size = 32 * 1024,
+        .capacity = (size_t) keys,
+        .sync_writes = false,
+        .compact_task = false
+    };
+
+    // One file per key through the VFS
+    mkdir(dir, 0777);
+
+    gettimeofday(&tv_start, NULL);
+    for (int i = 0; i < keys; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/key%d", dir, i);
+        value[0] = i;
+        FILE *f = fopen(path, "wb");
+        TEST_ASSERT_NOT_NULL(f);
+        TEST_ASSERT_EQUAL(1, fwrite(value, sizeof(value), 1, f));
+        TEST_ASSERT_EQUAL(0, fclose(f));
+    }
+    t_s = test_elapsed(&tv_start);
+    printf("Files: %d puts in %.3fms (%.0f puts/s)\n", keys, t_s * 1e3, keys / t_s);
+
+    gettimeofday(&tv_start, NULL);
+    for (int i = 0; i < keys; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/key%d", dir, i);
+        FILE *f = fopen(path, "rb");
+        TEST_ASSERT_NOT_NULL(f);
+        TEST_ASSERT_EQUAL(1, fread(value, sizeof(value), 1, f));
+        TEST_ASSERT_EQUAL(0, fclose(f));
+        TEST_ASSERT_EQUAL(i, value[0]);
+    }
+    t_s = test_elapsed(&tv_start);
+    printf("Files: %d gets in %.3fms (%.0f gets/s)\n", keys, t_s * 1e3, keys / t_s);
+
+    for (int i = 0; i < keys; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/key%d", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+
+    // Key-value store
+    LittleKV kv;
+
+    TEST_ASSERT_EQUAL(ESP_OK, kv.init(&kv_cfg));
+
+    gettimeofday(&tv_start, NULL);
+    for (int i = 0; i < keys; ++i)
+    {
+        snprintf(key, sizeof(key), "key%d", i);
+        value[0] = i;
+        TEST_ASSERT_EQUAL(0, kv.put(key, value, sizeof(value)));
+    }
+    TEST_ASSERT_EQUAL(0, kv.sync());
+    t_s = test_elapsed(&tv_start);
+    printf("KV: %d puts in %.3fms (%.0f puts/s)\n", keys, t_s * 1e3, keys / t_s);
+
+    gettimeofday(&tv_start, NULL);
+    for (int i = 0; i < keys; ++i)
+    {
+        snprintf(key, sizeof(key), "key%d", i);
+        TEST_ASSERT_EQUAL(sizeof(value), kv.get(key, value, sizeof(value)));
+        TEST_ASSERT_EQUAL(i, value[0]);
+    }
+    t_s = test_elapsed(&tv_start);
+    printf("KV: %d gets in %.3fms (%.0f gets/s)\n", keys, t_s * 1e3, keys / t_s);
+
+    // Overwrite everything so there's something to compact
+    for (int i = 0; i < keys; ++i)
+    {
+        snprintf(key, sizeof(key), "key%d", i);
+        value[0] = i + 1;
+        TEST_ASSERT_EQUAL(0, kv.put(key, value, sizeof(value)));
+    }
+    TEST_ASSERT_EQUAL(0, kv.del("key0"));
+    TEST_ASSERT_EQUAL(-1, kv.get("key0", value, sizeof(value)));
+    while (kv.compact() > 0)
+    {
+    }
+    kv.term();
+
+    gettimeofday(&tv_start, NULL);
+    TEST_ASSERT_EQUAL(ESP_OK, kv.init(&kv_cfg));
+    t_s = test_elapsed(&tv_start);
+    printf("KV: loaded %d keys in %.3fms\n", (int) kv.count(), t_s * 1e3);
+
+    TEST_ASSERT_EQUAL(keys - 1, kv.count());
+    for (int i = 1; i < keys; ++i)
+    {
+        snprintf(key, sizeof(key), "key%d", i);
+        TEST_ASSERT_EQUAL(sizeof(value), kv.get(key, value, sizeof(value)));
+        TEST_ASSERT_EQUAL(i + 1, value[0]);
+    }
+
+    // Calls back into the store from the iterator are refused, not deadlocked
+    TEST_ASSERT_EQUAL(0, kv.iterate(test_kv_reenter, &kv));
+
+    for (int i = 1; i < keys; ++i)
+    {
+        snprintf(key, sizeof(key), "key%d", i);
+        TEST_ASSERT_EQUAL(0, kv.del(key));
+    }
+    kv.term();
+}
+
+TEST_CASE(can_kv, "key-value store speed test", "[littleflash]")
+{
+    test_setup(OPENFILES);
+
+    test_kv_speed(500);
+
+    test_teardown();
+
+    // Time the mount separately from the KV load
+    struct timeval tv_start;
+    gettimeofday(&tv_start, NULL);
+    test_setup(OPENFILES);
+    float t_s = test_elapsed(&tv_start);
+    printf("Mounted in %.3fms\n", t_s * 1e3);
+    test_teardown();
+}
+
+static void test_dentry_speed(const char *file, int lookups)
+{
+    struct stat st;
+    little_flash_stats_t stats;
+
+    littleflash.reset_stats();
+
+    struct timeval tv_start;
+    gettimeofday(&tv_start, NULL);
+    for (int i = 0; i < lookups; ++i)
+    {
+        TEST_ASSERT_EQUAL(0, stat(file, &st));
+    }
+    float t_s = test_elapsed(&tv_start);
+
+    littleflash.get_stats(&stats);
+    printf("%d stats in %.3fms (%.0f stats/s, %u flash reads)\n",
+           lookups, t_s * 1e3, lookups / t_s, stats.reads);
+}
+
+TEST_CASE(can_dentry, "path lookup cache", "[littleflash]")
+{
+    const char *dirs[] =
+    {
+        MOUNT_POINT "/www",
+        MOUNT_POINT "/www/static",
+        MOUNT_POINT "/www/static/js",
+    };
+    const char *file = MOUNT_POINT "/www/static/js/app.js";
+    struct stat st;
+    little_flash_stats_t stats;
+
+    for (int cached = 0; cached < 2; ++cached)
+    {
+        little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+        little_cfg.dentry_cache = cached ? 16 : 0;
+        test_setup(&little_cfg);
+
+        for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); ++i)
+        {
+            mkdir(dirs[i], 0777);
+        }
+        test_lfs_create_file_with_text(file, lfs_test_hello_str);
+
+        printf("%s:\n", cached ? "Cached" : "Uncached");
+        test_dentry_speed(file, 1000);
+
+        if (cached)
+        {
+            // Warm lookups must not touch flash
+            littleflash.reset_stats();
+            TEST_ASSERT_EQUAL(0, stat(file, &st));
+            littleflash.get_stats(&stats);
+            TEST_ASSERT_EQUAL(0, stats.reads);
+            TEST_ASSERT_EQUAL(strlen(lfs_test_hello_str), st.st_size);
+        }
+
+        // Changes must be seen through the cache
+        TEST_ASSERT_EQUAL(0, unlink(file));
+        TEST_ASSERT_EQUAL(-1, stat(file, &st));
+        TEST_ASSERT_NULL(fopen(file, "rb"));
+        test_lfs_create_file_with_text(file, "x");
+        TEST_ASSERT_EQUAL(0, stat(file, &st));
+        TEST_ASSERT_EQUAL(1, st.st_size);
+        TEST_ASSERT_EQUAL(0, rename(dirs[2], MOUNT_POINT "/www/static/lib"));
+        TEST_ASSERT_EQUAL(-1, stat(file, &st));
+        TEST_ASSERT_EQUAL(0, stat(MOUNT_POINT "/www/static/lib/app.js", &st));
+
+        unlink(MOUNT_POINT "/www/static/lib/app.js");
+        rmdir(MOUNT_POINT "/www/static/lib");
+        rmdir(dirs[1]);
+        rmdir(dirs[0]);
+
+        test_teardown();
+    }
+}
+
+TEST_CASE(can_list, "bulk directory listing", "[littleflash]")
+{
+    const char *dir = MOUNT_POINT "/list";
+    const int files = 200;
+    char path[64];
+    struct timeval tv_start;
+    float t_s;
+
+    little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+    little_cfg.dentry_cache = 32;
+    test_setup(&little_cfg);
+
+    mkdir(dir, 0777);
+    for (int i = 0; i < files; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        FILE *f = fopen(path, "wb");
+        TEST_ASSERT_NOT_NULL(f);
+        TEST_ASSERT_EQUAL(i, fwrite(path, 1, i, f));
+        TEST_ASSERT_EQUAL(0, fclose(f));
+    }
+
+    // readdir() plus stat() for every entry
+    size_t total = 0;
+    gettimeofday(&tv_start, NULL);
+    DIR *d = opendir(dir);
+    TEST_ASSERT_NOT_NULL(d);
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        TEST_ASSERT_EQUAL(0, stat(path, &st));
+        if (de->d_type == DT_REG)
+        {
+            total += st.st_size;
+        }
+    }
+    TEST_ASSERT_EQUAL(0, closedir(d));
+    t_s = test_elapsed(&tv_start);
+    printf("readdir/stat: %d entries in %.3fms\n", files, t_s * 1e3);
+    TEST_ASSERT_EQUAL(files * (files - 1) / 2, total);
+
+    // Batches of 32 under a single lock each
+    little_flash_dirent_t *entries = (little_flash_dirent_t *) malloc(32 * sizeof(little_flash_dirent_t));
+    TEST_ASSERT_NOT_NULL(entries);
+
+    total = 0;
+    gettimeofday(&tv_start, NULL);
+    d = opendir(dir);
+    TEST_ASSERT_NOT_NULL(d);
+    ssize_t count;
+    while ((count = littleflash.readdir_bulk(d, entries, 32)) > 0)
+    {
+        for (ssize_t i = 0; i < count; ++i)
+        {
+            if (entries[i].type == DT_REG)
+            {
+                total += entries[i].size;
+            }
+        }
+    }
+    TEST_ASSERT_EQUAL(0, count);
+    TEST_ASSERT_EQUAL(0, closedir(d));
+    t_s = test_elapsed(&tv_start);
+    printf("readdir_bulk: %d entries in %.3fms\n", files, t_s * 1e3);
+    TEST_ASSERT_EQUAL(files * (files - 1) / 2, total);
+
+    free(entries);
+
+    // The listing left the sizes in the lookup cache
+    little_flash_stats_t stats;
+    struct stat st;
+    littleflash.reset_stats();
+    snprintf(path, sizeof(path), "%s/f%d", dir, files - 1);
+    TEST_ASSERT_EQUAL(0, stat(path, &st));
+    TEST_ASSERT_EQUAL(files - 1, st.st_size);
+    littleflash.get_stats(&stats);
+    TEST_ASSERT_EQUAL(0, stats.reads);
+
+    for (int i = 0; i < files; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+
+    test_teardown();
+}
+
+static void test_tree_create(const char *root, int dirs, int files)
+{
+    char path[64];
+
+    TEST_ASSERT_EQUAL(0, mkdir(root, 0777));
+    for (int d = 0; d < dirs; ++d)
+    {
+        snprintf(path, sizeof(path), "%s/d%d", root, d);
+        TEST_ASSERT_EQUAL(0, mkdir(path, 0777));
+        for (int i = 0; i < files; ++i)
+        {
+            snprintf(path, sizeof(path), "%s/d%d/f%d", root, d, i);
+            FILE *f = fopen(path, "wb");
+            TEST_ASSERT_NOT_NULL(f);
+            TEST_ASSERT_EQUAL(16, fwrite(path, 1, 16, f));
+            TEST_ASSERT_EQUAL(0, fclose(f));
+        }
+    }
+}
+
+// What a caller without remove_tree()/usage() has to do
+static void test_tree_walk(const char *path, little_flash_usage_t *usage, bool remove)
+{
+    char child[64];
+
+    DIR *d = opendir(path);
+    TEST_ASSERT_NOT_NULL(d);
+    usage->dirs++;
+
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        struct stat st;
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+        TEST_ASSERT_EQUAL(0, stat(child, &st));
+        if (S_ISDIR(st.st_mode))
+        {
+            test_tree_walk(child, usage, remove);
+            if (remove)
+            {
+                TEST_ASSERT_EQUAL(0, rmdir(child));
+            }
+        }
+        else
+        {
+            usage->files++;
+            usage->bytes += st.st_size;
+            if (remove)
+            {
+                TEST_ASSERT_EQUAL(0, unlink(child));
+            }
+        }
+
+        // Don't rely on the position surviving a removal
+        if (remove)
+        {
+            rewinddir(d);
+        }
+    }
+    TEST_ASSERT_EQUAL(0, closedir(d));
+}
+
+TEST_CASE(can_tree, "recursive delete and disk usage", "[littleflash]")
+{
+    const char *root = MOUNT_POINT "/tree";
+    const int dirs = 10;
+    const int files = 100;
+    little_flash_usage_t usage;
+    struct timeval tv_start;
+    struct stat st;
+    float t_s;
+
+    test_setup(OPENFILES);
+
+    test_tree_create(root, dirs, files);
+
+    usage = {};
+    gettimeofday(&tv_start, NULL);
+    test_tree_walk(root, &usage, false);
+    t_s = test_elapsed(&tv_start);
+    printf("readdir/stat usage: %d files in %.3fms\n", dirs * files, t_s * 1e3);
+    TEST_ASSERT_EQUAL(dirs * files, usage.files);
+    TEST_ASSERT_EQUAL(dirs + 1, usage.dirs);
+    TEST_ASSERT_EQUAL(dirs * files * 16, usage.bytes);
+
+    gettimeofday(&tv_start, NULL);
+    TEST_ASSERT_EQUAL(0, littleflash.usage(root, &usage));
+    t_s = test_elapsed(&tv_start);
+    printf("usage(): %d files in %.3fms\n", dirs * files, t_s * 1e3);
+    TEST_ASSERT_EQUAL(dirs * files, usage.files);
+    TEST_ASSERT_EQUAL(dirs + 1, usage.dirs);
+    TEST_ASSERT_EQUAL(dirs * files * 16, usage.bytes);
+
+    usage = {};
+    gettimeofday(&tv_start, NULL);
+    test_tree_walk(root, &usage, true);
+    TEST_ASSERT_EQUAL(0, rmdir(root));
+    t_s = test_elapsed(&tv_start);
+    printf("unlink/rmdir: %d files in %.3fms\n", dirs * files, t_s * 1e3);
+    TEST_ASSERT_EQUAL(-1, stat(root, &st));
+
+    test_tree_create(root, dirs, files);
+
+    gettimeofday(&tv_start, NULL);
+    TEST_ASSERT_EQUAL(0, littleflash.remove_tree(root));
+    t_s = test_elapsed(&tv_start);
+    printf("remove_tree(): %d files in %.3fms\n", dirs * files, t_s * 1e3);
+    TEST_ASSERT_EQUAL(-1, stat(root, &st));
+    TEST_ASSERT_EQUAL(ENOENT, errno);
+
+    TEST_ASSERT_EQUAL(-1, littleflash.remove_tree(root));
+    TEST_ASSERT_EQUAL(ENOENT, errno);
+
+    test_teardown();
+}
+
+TEST_CASE(can_copy, "in-filesystem copy speed test", "[littleflash]")
+{
+    const char *src = MOUNT_POINT "/fw.bin";
+    const char *dst = MOUNT_POINT "/fw2.bin";
+    const size_t file_size = 1024 * 1024;
+    const size_t buf_size = 4 * 1024;
+    struct timeval tv_start;
+    struct stat st;
+    float t_s;
+
+    test_setup(OPENFILES);
+
+    uint32_t *buf = (uint32_t *) malloc(buf_size);
+    uint32_t *cmp = (uint32_t *) malloc(buf_size);
+    TEST_ASSERT_NOT_NULL(buf);
+    TEST_ASSERT_NOT_NULL(cmp);
+
+    FILE *f = fopen(src, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    for (size_t n = 0; n < file_size; n += buf_size)
+    {
+        for (size_t i = 0; i < buf_size / 4; ++i)
+        {
+            buf[i] = n + i;
+        }
+        TEST_ASSERT_EQUAL(buf_size, fwrite(buf, 1, buf_size, f));
+    }
+    TEST_ASSERT_EQUAL(0, fclose(f));
+
+    // What a caller has to do without copy()
+    gettimeofday(&tv_start, NULL);
+    FILE *in = fopen(src, "rb");
+    FILE *out = fopen(dst, "wb");
+    TEST_ASSERT_NOT_NULL(in);
+    TEST_ASSERT_NOT_NULL(out);
+    size_t len;
+    while ((len = fread(buf, 1, buf_size, in)) > 0)
+    {
+        TEST_ASSERT_EQUAL(len, fwrite(buf, 1, len, out));
+    }
+    TEST_ASSERT_EQUAL(0, fclose(in));
+    TEST_ASSERT_EQUAL(0, fclose(out));
+    t_s = test_elapsed(&tv_start);
+    printf("fread/fwrite: copied %d bytes in %.3fms (%.3f MB/s)\n",
+           (int) file_size, t_s * 1e3, file_size / (1024.0f * 1024.0f * t_s));
+    TEST_ASSERT_EQUAL(0, unlink(dst));
+
+    gettimeofday(&tv_start, NULL);
+    TEST_ASSERT_EQUAL(0, littleflash.copy(src, dst));
+    t_s = test_elapsed(&tv_start);
+    printf("copy(): copied %d bytes in %.3fms (%.3f MB/s)\n",
+           (int) file_size, t_s * 1e3, file_size / (1024.0f * 1024.0f * t_s));
+
+    TEST_ASSERT_EQUAL(0, stat(dst, &st));
+    TEST_ASSERT_EQUAL(file_size, st.st_size);
+
+    in = fopen(src, "rb");
+    out = fopen(dst, "rb");
+    TEST_ASSERT_NOT_NULL(in);
+    TEST_ASSERT_NOT_NULL(out);
+    while ((len = fread(buf, 1, buf_size, in)) > 0)
+    {
+        TEST_ASSERT_EQUAL(len, fread(cmp, 1, buf_size, out));
+        TEST_ASSERT_EQUAL(0, memcmp(buf, cmp, len));
+    }
+    TEST_ASSERT_EQUAL(0, fclose(in));
+    TEST_ASSERT_EQUAL(0, fclose(out));
+
+    TEST_ASSERT_EQUAL(-1, littleflash.copy(src, src));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+    TEST_ASSERT_EQUAL(-1, littleflash.copy(MOUNT_POINT "/missing", dst));
+    TEST_ASSERT_EQUAL(ENOENT, errno);
+
+    unlink(dst);
+    unlink(src);
+
+    free(cmp);
+    free(buf);
+
+    test_teardown();
+}
+
+// Fills buf with lines that look like a device log
+static size_t test_log_lines(char *buf, size_t size, int *line)
+{
+    static const char *msgs[] =
+    {
+        "wifi: sta connected, rssi=%d",
+        "http: GET /api/status 200 in %dms",
+        "sensor: temp=%d.%d humidity=%d%%",
+        "mqtt: published %d bytes to telemetry/device",
+    };
+
+    size_t len = 0;
+    while (true)
+    {
+        char tmp[128];
+        int n = snprintf(tmp, sizeof(tmp), "I (%d) ", 1000 + *line * 37);
+        n += snprintf(tmp + n, sizeof(tmp) - n, msgs[*line % 4], *line % 60, *line % 10, 40 + *line % 20);
+        n += snprintf(tmp + n, sizeof(tmp) - n, "\n");
+        if (len + n > size)
+        {
+            break;
+        }
+        memcpy(buf + len, tmp, n);
+        len += n;
+        (*line)++;
+    }
+
+    return len;
+}
+
+static void test_compress_speed(const char *file, char *buf, size_t buf_size, size_t file_size)
+{
+    little_flash_stats_t stats;
+    struct timeval tv_start;
+    int line = 0;
+    size_t total = 0;
+
+    littleflash.reset_stats();
+    gettimeofday(&tv_start, NULL);
+    FILE *f = fopen(file, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    while (total < file_size)
+    {
+        size_t len = test_log_lines(buf, buf_size, &line);
+        TEST_ASSERT_EQUAL(len, fwrite(buf, 1, len, f));
+        total += len;
+    }
+    TEST_ASSERT_EQUAL(0, fclose(f));
+    float t_s = test_elapsed(&tv_start);
+    littleflash.get_stats(&stats);
+    printf("%s: wrote %d bytes in %.3fms (%.3f MB/s), programmed %d bytes\n",
+           file, (int) total, t_s * 1e3, total / (1024.0f * 1024.0f * t_s), (int) stats.prog_bytes);
+
+    struct stat st;
+    TEST_ASSERT_EQUAL(0, stat(file, &st));
+    TEST_ASSERT_EQUAL(total, st.st_size);
+
+    littleflash.reset_stats();
+    gettimeofday(&tv_start, NULL);
+    f = fopen(file, "rb");
+    TEST_ASSERT_NOT_NULL(f);
+    char *cmp = (char *) malloc(buf_size);
+    TEST_ASSERT_NOT_NULL(cmp);
+    line = 0;
+    size_t len;
+    while ((len = test_log_lines(cmp, buf_size, &line)) > 0 && total > 0)
+    {
+        TEST_ASSERT_EQUAL(len, fread(buf, 1, len, f));
+        TEST_ASSERT_EQUAL(0, memcmp(buf, cmp, len));
+        total -= len;
+    }
+    TEST_ASSERT_EQUAL(0, fclose(f));
+    t_s = test_elapsed(&tv_start);
+    littleflash.get_stats(&stats);
+    printf("%s: read %d bytes in %.3fms (%.3f MB/s), read %d bytes from flash\n",
+           file, (int) st.st_size, t_s * 1e3, st.st_size / (1024.0f * 1024.0f * t_s), (int) stats.read_bytes);
+
+    free(cmp);
+}
+
+TEST_CASE(can_compress, "compressed file speed test", "[littleflash]")
+{
+    const char *zfile = MOUNT_POINT "/z/log.txt";
+    const char *file = MOUNT_POINT "/log.txt";
+    const size_t buf_size = 1024;
+    const size_t file_size = 256 * 1024;
+    char tmp[32];
+    struct stat st;
+
+    little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+    little_cfg.compress_prefix = "/z";
+    test_setup(&little_cfg);
+
+    char *buf = (char *) malloc(buf_size);
+    TEST_ASSERT_NOT_NULL(buf);
+
+    mkdir(MOUNT_POINT "/z", 0777);
+    test_compress_speed(file, buf, buf_size, file_size);
+    test_compress_speed(zfile, buf, buf_size, file_size);
+
+    // Random reads go through the chunk index
+    FILE *f = fopen(zfile, "rb");
+    FILE *p = fopen(file, "rb");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_NOT_NULL(p);
+    for (int i = 0; i < 32; ++i)
+    {
+        long off = (esp_random() % file_size) & ~15;
+        TEST_ASSERT_EQUAL(0, fseek(f, off, SEEK_SET));
+        TEST_ASSERT_EQUAL(0, fseek(p, off, SEEK_SET));
+        TEST_ASSERT_EQUAL(sizeof(tmp), fread(tmp, 1, sizeof(tmp), f));
+        TEST_ASSERT_EQUAL(sizeof(tmp), fread(buf, 1, sizeof(tmp), p));
+        TEST_ASSERT_EQUAL(0, memcmp(tmp, buf, sizeof(tmp)));
+    }
+    TEST_ASSERT_EQUAL(0, fclose(p));
+    TEST_ASSERT_EQUAL(0, fclose(f));
+
+    // Appends add to the end, other writes are refused
+    TEST_ASSERT_EQUAL(0, stat(zfile, &st));
+    f = fopen(zfile, "ab");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL(5, fwrite("tail\n", 1, 5, f));
+    TEST_ASSERT_EQUAL(0, fclose(f));
+    f = fopen(zfile, "rb");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL(0, fseek(f, -5, SEEK_END));
+    TEST_ASSERT_EQUAL(5, fread(tmp, 1, 5, f));
+    TEST_ASSERT_EQUAL(0, memcmp(tmp, "tail\n", 5));
+    TEST_ASSERT_EQUAL(0, fclose(f));
+    int fd = open(zfile, O_WRONLY);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL(-1, write(fd, "x", 1));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+    TEST_ASSERT_EQUAL(0, close(fd));
+    struct stat st2;
+    TEST_ASSERT_EQUAL(0, stat(zfile, &st2));
+    TEST_ASSERT_EQUAL(st.st_size + 5, st2.st_size);
+
+    TEST_ASSERT_EQUAL(-1, rename(zfile, MOUNT_POINT "/log2.txt"));
+    TEST_ASSERT_EQUAL(EXDEV, errno);
+
+    // Other spellings of the compressed area are compressed too, but a
+    // name that only starts the same isn't
+    little_flash_usage_t usage;
+    TEST_ASSERT_EQUAL(0, stat(MOUNT_POINT "/y/../z//log.txt", &st));
+    TEST_ASSERT_EQUAL(st2.st_size, st.st_size);
+    f = fopen(MOUNT_POINT "/zfoo", "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL(5, fwrite("tail\n", 1, 5, f));
+    TEST_ASSERT_EQUAL(0, fclose(f));
+    TEST_ASSERT_EQUAL(0, littleflash.usage(MOUNT_POINT "/zfoo", &usage));
+    TEST_ASSERT_EQUAL(5, usage.bytes);
+    unlink(MOUNT_POINT "/zfoo");
+
+    // Syncs don't leave a small chunk behind each time
+    fd = open(MOUNT_POINT "/z/sync.txt", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    TEST_ASSERT_TRUE(fd >= 0);
+    for (int i = 0; i < 10; ++i)
+    {
+        TEST_ASSERT_EQUAL(10, write(fd, "0123456789", 10));
+        TEST_ASSERT_EQUAL(0, fsync(fd));
+    }
+    TEST_ASSERT_EQUAL(0, close(fd));
+    TEST_ASSERT_EQUAL(0, stat(MOUNT_POINT "/z/sync.txt", &st));
+    TEST_ASSERT_EQUAL(100, st.st_size);
+    TEST_ASSERT_EQUAL(0, littleflash.usage(MOUNT_POINT "/z/sync.txt", &usage));
+    TEST_ASSERT_TRUE(usage.bytes <= 4 + 100);
+    unlink(MOUNT_POINT "/z/sync.txt");
+
+    unlink(zfile);
+    unlink(file);
+    rmdir(MOUNT_POINT "/z");
+
+    free(buf);
+
+    test_teardown();
+}
+
+TEST_CASE(can_wear, "erase counts on a simulated device", "[littleflash]")
+{
+    const int blocks = 32;
+    const int iterations = 2000;
+    little_flash_stats_t stats;
+    little_flash_wear_t wear;
+    struct timeval tv_start;
+    char path[32];
+    char rec[48];
+
+    little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+    little_cfg.flash = NULL;
+    little_cfg.part_label = NULL;
+    little_cfg.ram_size = blocks * SPI_FLASH_SEC_SIZE;
+    little_cfg.wear_stats = true;
+    test_littleflash_setup(&little_cfg);
+
+    littleflash.reset_stats();
+
+    // A settings file rewritten in place, a log that rotates and a pile of
+    // files that's only written once
+    gettimeofday(&tv_start, NULL);
+    for (int i = 0; i < 8; ++i)
+    {
+        snprintf(path, sizeof(path), MOUNT_POINT "/static%d", i);
+        test_lfs_create_file_with_text(path, lfs_test_hello_str);
+    }
+    for (int i = 0; i < iterations; ++i)
+    {
+        FILE *f = fopen(MOUNT_POINT "/settings", "wb");
+        TEST_ASSERT_NOT_NULL(f);
+        TEST_ASSERT_EQUAL(sizeof(i), fwrite(&i, 1, sizeof(i), f));
+        TEST_ASSERT_EQUAL(0, fclose(f));
+
+        f = fopen(MOUNT_POINT "/log", "ab");
+        TEST_ASSERT_NOT_NULL(f);
+        int len = snprintf(rec, sizeof(rec), "I (%d) iteration %d\n", i * 10, i);
+        TEST_ASSERT_EQUAL(len, fwrite(rec, 1, len, f));
+        TEST_ASSERT_EQUAL(0, fclose(f));
+
+        if (i % 500 == 499)
+        {
+            unlink(MOUNT_POINT "/log.old");
+            TEST_ASSERT_EQUAL(0, rename(MOUNT_POINT "/log", MOUNT_POINT "/log.old"));
+        }
+    }
+    float t_s = test_elapsed(&tv_start);
+
+    littleflash.get_stats(&stats);
+    TEST_ASSERT_EQUAL(0, littleflash.wear_stats(&wear));
+    printf("%d iterations in %.3fms, %d erases\n", iterations, t_s * 1e3, stats.erases);
+    printf("erases per block: min %d max %d mean %.1f stddev %.1f\n",
+           wear.min, wear.max, wear.mean, wear.stddev);
+    TEST_ASSERT_EQUAL(blocks, wear.blocks);
+    TEST_ASSERT_TRUE(wear.total >= stats.erases);
+    TEST_ASSERT_TRUE(wear.max >= wear.min);
+
+    char map[64];
+    int per_cell = littleflash.wear_heatmap(map, sizeof(map), 16);
+    TEST_ASSERT_EQUAL(1, per_cell);
+    printf("heatmap, one block per character:\n%s", map);
+
+    uint32_t counts[blocks];
+    TEST_ASSERT_EQUAL(blocks, littleflash.wear_counts(counts, 0, blocks));
+    uint64_t total = 0;
+    for (int i = 0; i < blocks; ++i)
+    {
+        total += counts[i];
+    }
+    TEST_ASSERT_EQUAL(wear.total, total);
+
+    // Counts are kept in a file
+    struct stat st;
+    TEST_ASSERT_EQUAL(0, littleflash.wear_save());
+    TEST_ASSERT_EQUAL(0, stat(MOUNT_POINT "/.wear", &st));
+    TEST_ASSERT_EQUAL(8 + blocks * sizeof(uint32_t), st.st_size);
+
+    // ...which is hidden from listings and can't be removed or written
+    DIR *dir = opendir(MOUNT_POINT);
+    TEST_ASSERT_NOT_NULL(dir);
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+    {
+        TEST_ASSERT_NOT_EQUAL(0, strcmp(de->d_name, ".wear"));
+    }
+    TEST_ASSERT_EQUAL(0, closedir(dir));
+    TEST_ASSERT_EQUAL(-1, unlink(MOUNT_POINT "//.wear"));
+    TEST_ASSERT_EQUAL(EPERM, errno);
+    TEST_ASSERT_EQUAL(-1, open(MOUNT_POINT "/.wear", O_WRONLY | O_TRUNC));
+    TEST_ASSERT_EQUAL(EACCES, errno);
+    TEST_ASSERT_EQUAL(-1, littleflash.truncate(MOUNT_POINT "/.wear", 0));
+    TEST_ASSERT_EQUAL(EACCES, errno);
+    int fd = open(MOUNT_POINT "/.wear", O_RDONLY);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL(0, close(fd));
+    TEST_ASSERT_EQUAL(0, littleflash.remove_tree(MOUNT_POINT));
+    TEST_ASSERT_EQUAL(0, stat(MOUNT_POINT "/.wear", &st));
+
+    test_littleflash_teardown();
+}
+
+//
+// Benchmark suite operations through the VFS
+//
+static little_flash_config_t bench_cfg;
+
+static const char *bench_path(char *buf, size_t size, const char *path)
+{
+    snprintf(buf, size, MOUNT_POINT "%s", path);
+
+    return buf;
+}
+
+static int bench_mount(void *ctx)
+{
+    return littleflash.init(&bench_cfg) == ESP_OK ? 0 : -1;
+}
+
+static int bench_unmount(void *ctx)
+{
+    littleflash.term();
+
+    return 0;
+}
+
+static int bench_open(void *ctx, const char *path, int flags)
+{
+    char buf[64];
+
+    return open(bench_path(buf, sizeof(buf), path), flags, 0666);
+}
+
+static int bench_close(void *ctx, int fd)
+{
+    return close(fd);
+}
+
+static ssize_t bench_read(void *ctx, int fd, void *buf, size_t size)
+{
+    return read(fd, buf, size);
+}
+
+static ssize_t bench_write(void *ctx, int fd, const void *buf, size_t size)
+{
+    return write(fd, buf, size);
+}
+
+static off_t bench_seek(void *ctx, int fd, off_t off)
+{
+    return lseek(fd, off, SEEK_SET);
+}
+
+static int bench_fsync(void *ctx, int fd)
+{
+    return fsync(fd);
+}
+
+static int bench_stat(void *ctx, const char *path, size_t *size)
+{
+    char buf[64];
+    struct stat st;
+
+    if (stat(bench_path(buf, sizeof(buf), path), &st) != 0)
+    {
+        return -1;
+    }
+    *size = st.st_size;
+
+    return 0;
+}
+
+static int bench_unlink(void *ctx, const char *path)
+{
+    char buf[64];
+
+    return unlink(bench_path(buf, sizeof(buf), path));
+}
+
+static int bench_mkdir(void *ctx, const char *path)
+{
+    char buf[64];
+
+    return mkdir(bench_path(buf, sizeof(buf), path), 0777);
+}
+
+static int bench_rmdir(void *ctx, const char *path)
+{
+    char buf[64];
+
+    return rmdir(bench_path(buf, sizeof(buf), path));
+}
+
+static int bench_list(void *ctx, const char *path)
+{
+    char buf[64];
+
+    DIR *dir = opendir(bench_path(buf, sizeof(buf), path));
+    if (dir == NULL)
+    {
+        return -1;
+    }
+
+    int entries = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+        {
+            entries++;
+        }
+    }
+    closedir(dir);
+
+    return entries;
+}
+
+static size_t bench_capacity(void *ctx)
+{
+#if !defined(CONFIG_LITTLEFS_PARTITION_LABEL)
+    return extflash.chip_size();
+#else
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                           ESP_PARTITION_SUBTYPE_ANY,
+                                                           CONFIG_LITTLEFS_PARTITION_LABEL);
+    return part ? part->size : 0;
+#endif
+}
+
+static size_t bench_block_size(void *ctx)
+{
+    little_flash_space_t space;
+
+    return littleflash.space(&space) == 0 ? space.block_size : 0;
+}
+
+static size_t bench_used(void *ctx)
+{
+    little_flash_space_t space;
+
+    return littleflash.space(&space) == 0 ? (size_t) space.used * space.block_size : 0;
+}
+
+static uint64_t bench_now_us(void *ctx)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+TEST_CASE(can_bench, "benchmark suite", "[littleflash]")
+{
+    /* Erase partition before running the test to get consistent results */
+    test_format();
+
+    bench_cfg = test_littleflash_config(OPENFILES);
+    test_setup(&bench_cfg);
+
+    bench_ops_t ops = {};
+    ops.mount = bench_mount;
+    ops.unmount = bench_unmount;
+    ops.open = bench_open;
+    ops.close = bench_close;
+    ops.read = bench_read;
+    ops.write = bench_write;
+    ops.seek = bench_seek;
+    ops.fsync = bench_fsync;
+    ops.stat = bench_stat;
+    ops.unlink = bench_unlink;
+    ops.mkdir = bench_mkdir;
+    ops.rmdir = bench_rmdir;
+    ops.list = bench_list;
+    ops.capacity = bench_capacity;
+    ops.block_size = bench_block_size;
+    ops.used = bench_used;
+    ops.now_us = bench_now_us;
+
+    bench_config_t cfg = {};
+    cfg.format = BENCH_JSON;
+    cfg.suite = "littleflash";
+
+    TEST_ASSERT_EQUAL(0, bench_run(&ops, &cfg));
+
+    test_teardown();
+}
+
+//
+// Concurrency scaling
+//
+#define SCALE_OPS 200
+#define SCALE_IO_SIZE 512
+#define SCALE_FILE_SIZE (16 * 1024)
+
+typedef struct
+{
+    char file[32];
+    uint32_t seed;
+    uint32_t lat[SCALE_OPS];
+    bool ok;
+    SemaphoreHandle_t start;
+    SemaphoreHandle_t done;
+} scale_task_arg_t;
+
+static int scale_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Half reads, some writes and some stats of the task's own file
+static void scale_task(void *param)
+{
+    scale_task_arg_t *args = (scale_task_arg_t *) param;
+    uint8_t buf[SCALE_IO_SIZE];
+    struct timeval tv_start;
+    struct stat st;
+
+    args->ok = false;
+
+    int fd = open(args->file, O_RDWR);
+
+    xSemaphoreTake(args->start, portMAX_DELAY);
+
+    if (fd >= 0)
+    {
+        args->ok = true;
+        for (int i = 0; args->ok && i < SCALE_OPS; ++i)
+        {
+            args->seed = args->seed * 1103515245 + 12345;
+            int op = (args->seed >> 16) % 10;
+            off_t off = ((args->seed >> 8) % (SCALE_FILE_SIZE / SCALE_IO_SIZE)) * SCALE_IO_SIZE;
+
+            gettimeofday(&tv_start, NULL);
+            if (op < 5)
+            {
+                args->ok = lseek(fd, off, SEEK_SET) == off && read(fd, buf, sizeof(buf)) == sizeof(buf);
+            }
+            else if (op < 8)
+            {
+                memset(buf, op, sizeof(buf));
+                args->ok = lseek(fd, off, SEEK_SET) == off && write(fd, buf, sizeof(buf)) == sizeof(buf);
+            }
+            else
+            {
+                args->ok = stat(args->file, &st) == 0;
+            }
+            args->lat[i] = test_elapsed(&tv_start) * 1e6;
+        }
+
+        args->ok = close(fd) == 0 && args->ok;
+    }
+
+    xSemaphoreGive(args->done);
+    vTaskDelay(1);
+    vTaskDelete(NULL);
+}
+
+static void test_scale(int tasks, bool pinned)
+{
+    scale_task_arg_t *args = (scale_task_arg_t *) calloc(tasks, sizeof(scale_task_arg_t));
+    TEST_ASSERT_NOT_NULL(args);
+
+    SemaphoreHandle_t start = xSemaphoreCreateCounting(tasks, 0);
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(tasks, 0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_NOT_NULL(done);
+
+    for (int i = 0; i < tasks; ++i)
+    {
+        snprintf(args[i].file, sizeof(args[i].file), MOUNT_POINT "/scale%d", i);
+        args[i].seed = i + 1;
+        args[i].start = start;
+        args[i].done = done;
+
+        TEST_ASSERT_EQUAL(pdPASS, xTaskCreatePinnedToCore(&scale_task,
+                                                          "scale",
+                                                          4096,
+                                                          &args[i],
+                                                          3,
+                                                          NULL,
+                                                          pinned ? i % portNUM_PROCESSORS : tskNO_AFFINITY));
+    }
+
+    // Let them all open their files before starting the clock
+    vTaskDelay(100 / portTICK_PERIOD_MS);
+
+    little_flash_stats_t stats;
+    struct timeval tv_start;
+    littleflash.reset_stats();
+    gettimeofday(&tv_start, NULL);
+
+    for (int i = 0; i < tasks; ++i)
+    {
+        xSemaphoreGive(start);
+    }
+    for (int i = 0; i < tasks; ++i)
+    {
+        xSemaphoreTake(done, portMAX_DELAY);
+    }
+
+    float t_s = test_elapsed(&tv_start);
+    littleflash.get_stats(&stats);
+
+    printf("%d task(s), %s: %.0f ops/s, lock waited %.1fms (%d of %d acquires contended)\n",
+           tasks,
+           pinned ? "pinned" : "unpinned",
+           tasks * SCALE_OPS / t_s,
+           stats.lock_wait_us / 1e3,
+           stats.lock_contended,
+           stats.lock_acquires);
+
+    for (int i = 0; i < tasks; ++i)
+    {
+        TEST_ASSERT_TRUE(args[i].ok);
+
+        qsort(args[i].lat, SCALE_OPS, sizeof(uint32_t), scale_cmp);
+        printf("  task %d latency: p50 %dus p90 %dus p99 %dus max %dus\n",
+               i,
+               args[i].lat[SCALE_OPS * 50 / 100],
+               args[i].lat[SCALE_OPS * 90 / 100],
+               args[i].lat[SCALE_OPS * 99 / 100],
+               args[i].lat[SCALE_OPS - 1]);
+    }
+
+    vSemaphoreDelete(done);
+    vSemaphoreDelete(start);
+    free(args);
+}
+
+TEST_CASE(can_scale, "concurrency scaling benchmark", "[littleflash]")
+{
+    static const int counts[] = { 1, 2, 4, 8 };
+    char path[32];
+
+    test_setup(OPENFILES + 8);
+
+    uint8_t *buf = (uint8_t *) malloc(SCALE_FILE_SIZE);
+    TEST_ASSERT_NOT_NULL(buf);
+    memset(buf, 0x55, SCALE_FILE_SIZE);
+    for (int i = 0; i < 8; ++i)
+    {
+        snprintf(path, sizeof(path), MOUNT_POINT "/scale%d", i);
+        FILE *f = fopen(path, "wb");
+        TEST_ASSERT_NOT_NULL(f);
+        TEST_ASSERT_EQUAL(SCALE_FILE_SIZE, fwrite(buf, 1, SCALE_FILE_SIZE, f));
+        TEST_ASSERT_EQUAL(0, fclose(f));
+    }
+    free(buf);
+
+    for (int pinned = 0; pinned < 2; ++pinned)
+    {
+        for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i)
+        {
+            test_scale(counts[i], pinned);
+        }
+    }
+
+    for (int i = 0; i < 8; ++i)
+    {
+        snprintf(path, sizeof(path), MOUNT_POINT "/scale%d", i);
+        unlink(path);
+    }
+
+    test_teardown();
+}
+
+TEST_CASE(can_prog_size, "flash bytes programmed per small fsync", "[littleflash]")
+{
+    const int records = 200;
+    const lfs_size_t sizes[] = { 0, 256, 16 };
+    little_flash_stats_t stats;
+    struct timeval tv_start;
+    char rec[64];
+
+    // The RAM device programs with the same granularity rules as internal
+    // flash, so the numbers don't depend on the configured backend
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+        little_cfg.flash = NULL;
+        little_cfg.part_label = NULL;
+        little_cfg.ram_size = 32 * SPI_FLASH_SEC_SIZE;
+        little_cfg.prog_size = sizes[s];
+        test_littleflash_setup(&little_cfg);
+
+        int fd = open(MOUNT_POINT "/records", O_WRONLY | O_CREAT | O_APPEND, 0);
+        TEST_ASSERT_TRUE(fd >= 0);
+
+        littleflash.reset_stats();
+        gettimeofday(&tv_start, NULL);
+        for (int i = 0; i < records; ++i)
+        {
+            int len = snprintf(rec, sizeof(rec), "record %d\n", i);
+            TEST_ASSERT_EQUAL(len, write(fd, rec, len));
+            TEST_ASSERT_EQUAL(0, fsync(fd));
+        }
+        float t_s = test_elapsed(&tv_start);
+        littleflash.get_stats(&stats);
+
+        TEST_ASSERT_EQUAL(0, close(fd));
+
+        printf("prog_size %4d: %d records in %.3fms, %d bytes programmed per fsync\n",
+               sizes[s] ? sizes[s] : SPI_FLASH_SEC_SIZE, records, t_s * 1e3,
+               (int) (stats.prog_bytes / records));
+
+        test_littleflash_teardown();
+    }
+
+    // Sizes that don't divide the sector are refused
+    little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+    little_cfg.flash = NULL;
+    little_cfg.part_label = NULL;
+    little_cfg.ram_size = 32 * SPI_FLASH_SEC_SIZE;
+    little_cfg.prog_size = 24;
+    LittleFlash bad;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, bad.init(&little_cfg));
+}
+
+#define SERVE_FILES 4
+#define SERVE_FILE_SIZE (16 * 1024)
+#define SERVE_REQUESTS 20
+#define SERVE_CHUNK 1024
+
+typedef struct
+{
+    int id;
+    bool ok;
+    uint32_t bytes;
+    SemaphoreHandle_t start;
+    SemaphoreHandle_t done;
+} serve_task_arg_t;
+
+// Serves whole files like a static HTTP handler would: open, read in chunks
+// until the end, close
+static void serve_task(void *param)
+{
+    serve_task_arg_t *args = (serve_task_arg_t *) param;
+    uint8_t buf[SERVE_CHUNK];
+    char path[32];
+
+    args->ok = true;
+    args->bytes = 0;
+
+    xSemaphoreTake(args->start, portMAX_DELAY);
+
+    for (int i = 0; args->ok && i < SERVE_REQUESTS; ++i)
+    {
+        snprintf(path, sizeof(path), MOUNT_POINT "/asset%d", (args->id + i) % SERVE_FILES);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            args->ok = false;
+            break;
+        }
+
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0)
+        {
+            args->bytes += len;
+        }
+
+        args->ok = len == 0 && close(fd) == 0;
+    }
+
+    xSemaphoreGive(args->done);
+    vTaskDelay(1);
+    vTaskDelete(NULL);
+}
+
+static void test_serve(int tasks, const char *mode)
+{
+    serve_task_arg_t *args = (serve_task_arg_t *) calloc(tasks, sizeof(serve_task_arg_t));
+    TEST_ASSERT_NOT_NULL(args);
+
+    SemaphoreHandle_t start = xSemaphoreCreateCounting(tasks, 0);
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(tasks, 0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_NOT_NULL(done);
+
+    for (int i = 0; i < tasks; ++i)
+    {
+        args[i].id = i;
+        args[i].start = start;
+        args[i].done = done;
+
+        TEST_ASSERT_EQUAL(pdPASS, xTaskCreate(&serve_task, "serve", 4096, &args[i], 3, NULL));
+    }
+
+    little_flash_stats_t stats;
+    struct timeval tv_start;
+    littleflash.reset_stats();
+    gettimeofday(&tv_start, NULL);
+
+    for (int i = 0; i < tasks; ++i)
+    {
+        xSemaphoreGive(start);
+    }
+    for (int i = 0; i < tasks; ++i)
+    {
+        xSemaphoreTake(done, portMAX_DELAY);
+    }
+
+    float t_s = test_elapsed(&tv_start);
+    littleflash.get_stats(&stats);
+
+    uint64_t bytes = 0;
+    for (int i = 0; i < tasks; ++i)
+    {
+        TEST_ASSERT_TRUE(args[i].ok);
+        bytes += args[i].bytes;
+    }
+    TEST_ASSERT_EQUAL(tasks * SERVE_REQUESTS * SERVE_FILE_SIZE, bytes);
+
+    printf("%s, %d task(s): %.1f KB/s, lock waited %.1fms (%d of %d acquires contended)\n",
+           mode,
+           tasks,
+           bytes / 1024.0 / t_s,
+           stats.lock_wait_us / 1e3,
+           stats.lock_contended,
+           stats.lock_acquires);
+
+    vSemaphoreDelete(done);
+    vSemaphoreDelete(start);
+    free(args);
+}
+
+TEST_CASE(can_read_only, "read-only mount and concurrent read benchmark", "[littleflash]")
+{
+    static const int counts[] = { 1, 2, 4, 8 };
+    char path[32];
+
+    little_flash_config_t little_cfg = test_littleflash_config(OPENFILES + 8);
+    test_setup(&little_cfg);
+
+    uint8_t *buf = (uint8_t *) malloc(SERVE_FILE_SIZE);
+    TEST_ASSERT_NOT_NULL(buf);
+    for (int i = 0; i < SERVE_FILES; ++i)
+    {
+        memset(buf, 'a' + i, SERVE_FILE_SIZE);
+        snprintf(path, sizeof(path), MOUNT_POINT "/asset%d", i);
+        FILE *f = fopen(path, "wb");
+        TEST_ASSERT_NOT_NULL(f);
+        TEST_ASSERT_EQUAL(SERVE_FILE_SIZE, fwrite(buf, 1, SERVE_FILE_SIZE, f));
+        TEST_ASSERT_EQUAL(0, fclose(f));
+    }
+    free(buf);
+
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i)
+    {
+        test_serve(counts[i], "read-write");
+    }
+
+    test_littleflash_teardown();
+    little_cfg.read_only = true;
+    test_littleflash_setup(&little_cfg);
+
+    // Nothing can be changed
+    errno = 0;
+    TEST_ASSERT_EQUAL(-1, open(MOUNT_POINT "/asset0", O_WRONLY));
+    TEST_ASSERT_EQUAL(EROFS, errno);
+    TEST_ASSERT_EQUAL(-1, open(MOUNT_POINT "/new", O_RDONLY | O_CREAT, 0));
+    TEST_ASSERT_EQUAL(-1, unlink(MOUNT_POINT "/asset0"));
+    TEST_ASSERT_EQUAL(-1, rename(MOUNT_POINT "/asset0", MOUNT_POINT "/asset9"));
+    TEST_ASSERT_EQUAL(-1, mkdir(MOUNT_POINT "/dir", 0755));
+    TEST_ASSERT_EQUAL(-1, littleflash.copy(MOUNT_POINT "/asset0", MOUNT_POINT "/asset9"));
+    TEST_ASSERT_EQUAL(EROFS, errno);
+
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i)
+    {
+        test_serve(counts[i], "read-only");
+    }
+
+    test_littleflash_teardown();
+    little_cfg.read_only = false;
+    test_littleflash_setup(&little_cfg);
+
+    for (int i = 0; i < SERVE_FILES; ++i)
+    {
+        snprintf(path, sizeof(path), MOUNT_POINT "/asset%d", i);
+        TEST_ASSERT_EQUAL(0, unlink(path));
+    }
+
+    test_teardown();
+}
+
+#define RECORD_SIZE (128 * 1024)
+#define RECORD_WRITE 512
+#define RECORD_SYNC (8 * 1024)
+
+// Returns the erases done while recording
+static uint32_t test_record(const char *path, bool prealloc)
+{
+    const int writes = RECORD_SIZE / RECORD_WRITE;
+    uint32_t *lat = (uint32_t *) malloc(writes * sizeof(uint32_t));
+    uint8_t *buf = (uint8_t *) malloc(RECORD_WRITE);
+    TEST_ASSERT_NOT_NULL(lat);
+    TEST_ASSERT_NOT_NULL(buf);
+    memset(buf, 0xa5, RECORD_WRITE);
+
+    little_flash_stats_t stats;
+    struct timeval tv_start;
+    float prealloc_s = 0;
+
+    unlink(path);
+
+    if (prealloc)
+    {
+        gettimeofday(&tv_start, NULL);
+        TEST_ASSERT_EQUAL(0, littleflash.preallocate(path, RECORD_SIZE));
+        prealloc_s = test_elapsed(&tv_start);
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0);
+    TEST_ASSERT_TRUE(fd >= 0);
+
+    littleflash.reset_stats();
+    for (int i = 0; i < writes; ++i)
+    {
+        gettimeofday(&tv_start, NULL);
+        TEST_ASSERT_EQUAL(RECORD_WRITE, write(fd, buf, RECORD_WRITE));
+        if ((i + 1) * RECORD_WRITE % RECORD_SYNC == 0)
+        {
+            TEST_ASSERT_EQUAL(0, fsync(fd));
+        }
+        lat[i] = test_elapsed(&tv_start) * 1e6;
+    }
+    littleflash.get_stats(&stats);
+    TEST_ASSERT_EQUAL(0, close(fd));
+
+    qsort(lat, writes, sizeof(uint32_t), scale_cmp);
+    printf("%s: %d erases while recording, write latency p50 %dus p99 %dus max %dus",
+           prealloc ? "preallocated" : "not preallocated",
+           stats.erases,
+           lat[writes * 50 / 100],
+           lat[writes * 99 / 100],
+           lat[writes - 1]);
+    if (prealloc)
+    {
+        printf(", preallocate took %.3fms", prealloc_s * 1e3);
+    }
+    printf("\n");
+
+    TEST_ASSERT_EQUAL(0, unlink(path));
+
+    free(buf);
+    free(lat);
+
+    return stats.erases;
+}
+
+TEST_CASE(can_truncate, "truncate files and preallocate space", "[littleflash]")
+{
+    const char *path = MOUNT_POINT "/trunc.txt";
+    struct stat st;
+    char buf[16];
+
+    test_setup(OPENFILES);
+
+    test_lfs_create_file_with_text(path, lfs_test_hello_str);
+
+    // Shrink, then grow with zeros
+    TEST_ASSERT_EQUAL(0, littleflash.truncate(path, 5));
+    TEST_ASSERT_EQUAL(0, stat(path, &st));
+    TEST_ASSERT_EQUAL(5, st.st_size);
+    TEST_ASSERT_EQUAL(0, littleflash.truncate(path, 8));
+    TEST_ASSERT_EQUAL(0, stat(path, &st));
+    TEST_ASSERT_EQUAL(8, st.st_size);
+
+    int fd = open(path, O_RDONLY);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL(8, read(fd, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(0, memcmp(buf, lfs_test_hello_str, 5));
+    TEST_ASSERT_EQUAL(0, buf[5] | buf[6] | buf[7]);
+    TEST_ASSERT_EQUAL(0, close(fd));
+
+    TEST_ASSERT_EQUAL(-1, littleflash.truncate(MOUNT_POINT "/missing", 0));
+    TEST_ASSERT_EQUAL(ENOENT, errno);
+
+#if defined(ESP_IDF_VERSION_MAJOR) && ESP_IDF_VERSION_MAJOR >= 5
+    fd = open(path, O_RDWR);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL(0, ftruncate(fd, 2));
+    TEST_ASSERT_EQUAL(0, fstat(fd, &st));
+    TEST_ASSERT_EQUAL(2, st.st_size);
+    TEST_ASSERT_EQUAL(0, close(fd));
+#endif
+
+    TEST_ASSERT_EQUAL(0, unlink(path));
+
+    // Asking for more than the device holds fails before anything is written
+    TEST_ASSERT_EQUAL(-1, littleflash.preallocate(path, 64 * 1024 * 1024));
+    TEST_ASSERT_EQUAL(ENOSPC, errno);
+
+    // Blocks erased up front shouldn't need erasing again while recording
+    uint32_t plain = test_record(MOUNT_POINT "/record", false);
+    uint32_t prealloc = test_record(MOUNT_POINT "/record", true);
+    TEST_ASSERT_TRUE(prealloc <= plain);
+
+    test_teardown();
+}
+
+#define HANDLE_FILES 30
+#define HANDLE_ROUNDS 10
+
+static void test_handle_opens(int cache)
+{
+    little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+    little_cfg.handle_cache = cache;
+    test_littleflash_setup(&little_cfg);
+
+    little_flash_stats_t stats;
+    struct timeval tv_start;
+    char path[32];
+    char buf[256];
+
+    littleflash.reset_stats();
+    gettimeofday(&tv_start, NULL);
+    for (int r = 0; r < HANDLE_ROUNDS; ++r)
+    {
+        for (int i = 0; i < HANDLE_FILES; ++i)
+        {
+            snprintf(path, sizeof(path), MOUNT_POINT "/handle%d", i);
+            int fd = open(path, O_RDONLY);
+            TEST_ASSERT_TRUE(fd >= 0);
+            TEST_ASSERT_EQUAL(sizeof(buf), read(fd, buf, sizeof(buf)));
+            TEST_ASSERT_EQUAL(0, close(fd));
+        }
+    }
+    float t_s = test_elapsed(&tv_start);
+    littleflash.get_stats(&stats);
+
+    printf("handle_cache %2d: %.0f opens/s, %d of %d opens from the cache, %d flash reads\n",
+           cache,
+           HANDLE_ROUNDS * HANDLE_FILES / t_s,
+           stats.handle_hits,
+           HANDLE_ROUNDS * HANDLE_FILES,
+           stats.reads);
+
+    test_littleflash_teardown();
+}
+
+TEST_CASE(can_handle_cache, "open handle cache", "[littleflash]")
+{
+    static const int caches[] = { 0, 8, 32 };
+    const char *path = MOUNT_POINT "/handle0";
+    char path_n[32];
+    char buf[256];
+
+    little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+    little_cfg.handle_cache = 4;
+    test_setup(&little_cfg);
+
+    memset(buf, 'x', sizeof(buf));
+    for (int i = 0; i < HANDLE_FILES; ++i)
+    {
+        snprintf(path_n, sizeof(path_n), MOUNT_POINT "/handle%d", i);
+        FILE *f = fopen(path_n, "wb");
+        TEST_ASSERT_NOT_NULL(f);
+        TEST_ASSERT_EQUAL(sizeof(buf), fwrite(buf, 1, sizeof(buf), f));
+        TEST_ASSERT_EQUAL(0, fclose(f));
+    }
+
+    // A cached handle is reused from the start of the file
+    little_flash_stats_t stats;
+    littleflash.reset_stats();
+    for (int i = 0; i < 2; ++i)
+    {
+        int fd = open(path, O_RDONLY);
+        TEST_ASSERT_TRUE(fd >= 0);
+        TEST_ASSERT_EQUAL(sizeof(buf), read(fd, buf, sizeof(buf)));
+        TEST_ASSERT_EQUAL('x', buf[0]);
+        TEST_ASSERT_EQUAL(0, close(fd));
+    }
+    littleflash.get_stats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.handle_hits);
+
+    // Rewriting the file drops its handle, even one that's open right now
+    int fd = open(path, O_RDONLY);
+    TEST_ASSERT_TRUE(fd >= 0);
+    test_lfs_create_file_with_text(path, lfs_test_hello_str);
+    TEST_ASSERT_EQUAL(0, close(fd));
+    test_lfs_read_file(path);
+
+    // As does removing it
+    TEST_ASSERT_EQUAL(0, unlink(path));
+    TEST_ASSERT_EQUAL(-1, open(path, O_RDONLY));
+    TEST_ASSERT_EQUAL(ENOENT, errno);
+
+    // Also when it's removed under another spelling of its path
+    test_lfs_create_file_with_text(path, lfs_test_hello_str);
+    test_lfs_read_file(path);
+    TEST_ASSERT_EQUAL(0, unlink(MOUNT_POINT "/./handle0"));
+    TEST_ASSERT_EQUAL(-1, open(path, O_RDONLY));
+    TEST_ASSERT_EQUAL(ENOENT, errno);
+
+    FILE *f = fopen(path, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    memset(buf, 'x', sizeof(buf));
+    TEST_ASSERT_EQUAL(sizeof(buf), fwrite(buf, 1, sizeof(buf), f));
+    TEST_ASSERT_EQUAL(0, fclose(f));
+
+    test_littleflash_teardown();
+
+    for (size_t i = 0; i < sizeof(caches) / sizeof(caches[0]); ++i)
+    {
+        test_handle_opens(caches[i]);
+    }
+
+    test_littleflash_setup(&little_cfg);
+    for (int i = 0; i < HANDLE_FILES; ++i)
+    {
+        snprintf(path_n, sizeof(path_n), MOUNT_POINT "/handle%d", i);
+        TEST_ASSERT_EQUAL(0, unlink(path_n));
+    }
+
+    test_teardown();
+}
+
+#define SEND_FILE_SIZE (256 * 1024)
+#define SEND_CHUNK 1024
+#define SEND_PORT 8765
+
+typedef struct
+{
+    int listener;
+    uint32_t bytes;
+    SemaphoreHandle_t done;
+} send_drain_arg_t;
+
+static int sink_null(void *ctx, const void *data, size_t size)
+{
+    *(uint32_t *) ctx += size;
+
+    return 0;
+}
+
+static int sink_socket(void *ctx, const void *data, size_t size)
+{
+    int sock = *(int *) ctx;
+    const uint8_t *p = (const uint8_t *) data;
+
+    while (size > 0)
+    {
+        int len = send(sock, p, size, 0);
+        if (len < 0)
+        {
+            return -1;
+        }
+        p += len;
+        size -= len;
+    }
+
+    return 0;
+}
+
+// The other end of the loopback connection, throwing away what it gets
+static void send_drain_task(void *param)
+{
+    send_drain_arg_t *args = (send_drain_arg_t *) param;
+    uint8_t buf[512];
+
+    int sock = accept(args->listener, NULL, NULL);
+    if (sock >= 0)
+    {
+        int len;
+        while ((len = recv(sock, buf, sizeof(buf), 0)) > 0)
+        {
+            args->bytes += len;
+        }
+        closesocket(sock);
+    }
+
+    xSemaphoreGive(args->done);
+    vTaskDelay(1);
+    vTaskDelete(NULL);
+}
+
+// Copies the file through a user buffer, like a server without sendfile().
+// Reads a block at a time, the same as sendfile(), so only the paths differ.
+static ssize_t send_read(const char *path, little_flash_sink_t sink, void *ctx)
+{
+    little_flash_space_t space;
+    ssize_t sent = 0;
+
+    if (littleflash.space(&space) != 0)
+    {
+        return -1;
+    }
+
+    uint8_t *buf = (uint8_t *) malloc(space.block_size);
+    if (buf == NULL)
+    {
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        free(buf);
+        return -1;
+    }
+
+    ssize_t len;
+    while ((len = read(fd, buf, space.block_size)) > 0)
+    {
+        if (sink(ctx, buf, len) < 0)
+        {
+            len = -1;
+            break;
+        }
+        sent += len;
+    }
+
+    close(fd);
+    free(buf);
+
+    return len < 0 ? -1 : sent;
+}
+
+static void test_send_socket(const char *path, bool use_sendfile)
+{
+    send_drain_arg_t args = {};
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SEND_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    args.listener = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT_TRUE(args.listener >= 0);
+    int on = 1;
+    setsockopt(args.listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    TEST_ASSERT_EQUAL(0, bind(args.listener, (struct sockaddr *) &addr, sizeof(addr)));
+    TEST_ASSERT_EQUAL(0, listen(args.listener, 1));
+
+    args.done = xSemaphoreCreateBinary();
+    TEST_ASSERT_NOT_NULL(args.done);
+    TEST_ASSERT_EQUAL(pdPASS, xTaskCreate(&send_drain_task, "drain", 4096, &args, 4, NULL));
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT_TRUE(sock >= 0);
+    TEST_ASSERT_EQUAL(0, connect(sock, (struct sockaddr *) &addr, sizeof(addr)));
+
+    struct timeval tv_start;
+    gettimeofday(&tv_start, NULL);
+    ssize_t sent;
+    if (use_sendfile)
+    {
+        sent = littleflash.sendfile(path, 0, SIZE_MAX, sink_socket, &sock);
+    }
+    else
+    {
+        sent = send_read(path, sink_socket, &sock);
+    }
+    closesocket(sock);
+    xSemaphoreTake(args.done, portMAX_DELAY);
+    float t_s = test_elapsed(&tv_start);
+
+    TEST_ASSERT_EQUAL(SEND_FILE_SIZE, sent);
+    TEST_ASSERT_EQUAL(SEND_FILE_SIZE, args.bytes);
+    printf("%s to loopback socket: %.1f KB/s\n",
+           use_sendfile ? "sendfile" : "read+send",
+           sent / 1024.0 / t_s);
+
+    closesocket(args.listener);
+    vSemaphoreDelete(args.done);
+}
+
+TEST_CASE(can_sendfile, "stream files to a sink", "[littleflash]")
+{
+    const char *path = MOUNT_POINT "/send.bin";
+    struct timeval tv_start;
+    uint32_t bytes;
+
+    test_setup(OPENFILES);
+
+    uint8_t *buf = (uint8_t *) malloc(SEND_CHUNK);
+    TEST_ASSERT_NOT_NULL(buf);
+    FILE *f = fopen(path, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    for (int i = 0; i < SEND_FILE_SIZE / SEND_CHUNK; ++i)
+    {
+        memset(buf, i, SEND_CHUNK);
+        TEST_ASSERT_EQUAL(SEND_CHUNK, fwrite(buf, 1, SEND_CHUNK, f));
+    }
+    TEST_ASSERT_EQUAL(0, fclose(f));
+    free(buf);
+
+    // Ranges stop at the end of the file
+    bytes = 0;
+    TEST_ASSERT_EQUAL(100, littleflash.sendfile(path, SEND_FILE_SIZE - 100, 1000, sink_null, &bytes));
+    TEST_ASSERT_EQUAL(0, littleflash.sendfile(path, SEND_FILE_SIZE, 1000, sink_null, &bytes));
+    TEST_ASSERT_EQUAL(-1, littleflash.sendfile(MOUNT_POINT "/missing", 0, 1000, sink_null, &bytes));
+    TEST_ASSERT_EQUAL(ENOENT, errno);
+
+    bytes = 0;
+    gettimeofday(&tv_start, NULL);
+    TEST_ASSERT_EQUAL(SEND_FILE_SIZE, send_read(path, sink_null, &bytes));
+    float t_s = test_elapsed(&tv_start);
+    printf("read+copy to null sink: %.1f KB/s\n", bytes / 1024.0 / t_s);
+
+    bytes = 0;
+    gettimeofday(&tv_start, NULL);
+    TEST_ASSERT_EQUAL(SEND_FILE_SIZE, littleflash.sendfile(path, 0, SIZE_MAX, sink_null, &bytes));
+    t_s = test_elapsed(&tv_start);
+    printf("sendfile to null sink: %.1f KB/s\n", bytes / 1024.0 / t_s);
+
+#if defined(ESP_IDF_VERSION_MAJOR) && ESP_IDF_VERSION_MAJOR >= 4
+    esp_netif_init();
+#else
+    tcpip_adapter_init();
+#endif
+    test_send_socket(path, false);
+    test_send_socket(path, true);
+
+    TEST_ASSERT_EQUAL(0, unlink(path));
+
+    test_teardown();
+}
+
+#define VEC_RECORDS 500
+#define VEC_PAYLOAD 64
+
+typedef struct
+{
+    uint32_t seq;
+    uint16_t type;
+    uint16_t len;
+} vec_hdr_t;
+
+static void test_vec_records(const char *path, bool vectored)
+{
+    vec_hdr_t hdr = {};
+    uint8_t payload[VEC_PAYLOAD];
+    uint32_t crc;
+    struct timeval tv_start;
+    little_flash_stats_t stats;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0);
+    TEST_ASSERT_TRUE(fd >= 0);
+
+    littleflash.reset_stats();
+    gettimeofday(&tv_start, NULL);
+    for (int i = 0; i < VEC_RECORDS; ++i)
+    {
+        hdr.seq = i;
+        hdr.type = 1;
+        hdr.len = sizeof(payload);
+        memset(payload, i, sizeof(payload));
+        crc = i * 2654435761u;
+
+        if (vectored)
+        {
+            struct iovec iov[] =
+            {
+                { &hdr, sizeof(hdr) },
+                { payload, sizeof(payload) },
+                { &crc, sizeof(crc) },
+            };
+            TEST_ASSERT_EQUAL(sizeof(hdr) + sizeof(payload) + sizeof(crc), littleflash.writev(fd, iov, 3));
+        }
+        else
+        {
+            TEST_ASSERT_EQUAL(sizeof(hdr), write(fd, &hdr, sizeof(hdr)));
+            TEST_ASSERT_EQUAL(sizeof(payload), write(fd, payload, sizeof(payload)));
+            TEST_ASSERT_EQUAL(sizeof(crc), write(fd, &crc, sizeof(crc)));
+        }
+    }
+    TEST_ASSERT_EQUAL(0, fsync(fd));
+    float t_s = test_elapsed(&tv_start);
+    littleflash.get_stats(&stats);
+    TEST_ASSERT_EQUAL(0, close(fd));
+
+    printf("%s: %.0f records/s, %d lock acquires\n",
+           vectored ? "writev" : "3 x write",
+           VEC_RECORDS / t_s,
+           stats.lock_acquires);
+}
+
+TEST_CASE(can_vector, "vectored reads and writes", "[littleflash]")
+{
+    const char *path = MOUNT_POINT "/records.bin";
+    vec_hdr_t hdr;
+    uint8_t payload[VEC_PAYLOAD];
+    uint32_t crc;
+
+    test_setup(OPENFILES);
+
+    test_vec_records(path, false);
+    test_vec_records(path, true);
+
+    // Read the records back the same way
+    int fd = open(path, O_RDONLY);
+    TEST_ASSERT_TRUE(fd >= 0);
+    for (int i = 0; i < VEC_RECORDS; ++i)
+    {
+        struct iovec iov[] =
+        {
+            { &hdr, sizeof(hdr) },
+            { payload, sizeof(payload) },
+            { &crc, sizeof(crc) },
+        };
+        TEST_ASSERT_EQUAL(sizeof(hdr) + sizeof(payload) + sizeof(crc), littleflash.readv(fd, iov, 3));
+        TEST_ASSERT_EQUAL(i, hdr.seq);
+        TEST_ASSERT_EQUAL(i & 0xff, payload[VEC_PAYLOAD - 1]);
+        TEST_ASSERT_EQUAL(i * 2654435761u, crc);
+    }
+
+    // Short at the end of the file
+    struct iovec iov[] =
+    {
+        { &hdr, sizeof(hdr) },
+        { payload, sizeof(payload) },
+    };
+    TEST_ASSERT_EQUAL(0, littleflash.readv(fd, iov, 2));
+    TEST_ASSERT_EQUAL(0, close(fd));
+
+    TEST_ASSERT_EQUAL(-1, littleflash.readv(fd, iov, 2));
+    TEST_ASSERT_EQUAL(EBADF, errno);
+
+    TEST_ASSERT_EQUAL(0, unlink(path));
+
+    test_teardown();
+}
+
+#define PAGE_SIZE 4096
+#define PAGE_COUNT 32
+#define PAGE_OPS 100
+
+static void test_pages(const char *path, bool positional)
+{
+    uint8_t *page = (uint8_t *) malloc(PAGE_SIZE);
+    TEST_ASSERT_NOT_NULL(page);
+
+    little_flash_stats_t stats;
+    struct timeval tv_start;
+    uint32_t seed = 1;
+
+    int fd = open(path, O_RDWR);
+    TEST_ASSERT_TRUE(fd >= 0);
+
+    littleflash.reset_stats();
+    gettimeofday(&tv_start, NULL);
+    for (int i = 0; i < PAGE_OPS; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        off_t off = ((seed >> 16) % PAGE_COUNT) * PAGE_SIZE;
+        bool write_op = (seed >> 8) & 1;
+
+        if (write_op)
+        {
+            memset(page, i, PAGE_SIZE);
+        }
+
+        if (positional && write_op)
+        {
+            TEST_ASSERT_EQUAL(PAGE_SIZE, littleflash.pwrite(fd, page, PAGE_SIZE, off));
+        }
+        else if (positional)
+        {
+            TEST_ASSERT_EQUAL(PAGE_SIZE, littleflash.pread(fd, page, PAGE_SIZE, off));
+        }
+        else
+        {
+            TEST_ASSERT_EQUAL(off, lseek(fd, off, SEEK_SET));
+            if (write_op)
+            {
+                TEST_ASSERT_EQUAL(PAGE_SIZE, write(fd, page, PAGE_SIZE));
+            }
+            else
+            {
+                TEST_ASSERT_EQUAL(PAGE_SIZE, read(fd, page, PAGE_SIZE));
+            }
+        }
+    }
+    TEST_ASSERT_EQUAL(0, fsync(fd));
+    float t_s = test_elapsed(&tv_start);
+    littleflash.get_stats(&stats);
+    TEST_ASSERT_EQUAL(0, close(fd));
+
+    printf("%s: %.1f pages/s, %d lock acquires\n",
+           positional ? "pread/pwrite" : "lseek+read/write",
+           PAGE_OPS / t_s,
+           stats.lock_acquires);
+
+    free(page);
+}
+
+TEST_CASE(can_pread, "positional reads and writes", "[littleflash]")
+{
+    const char *path = MOUNT_POINT "/pages.bin";
+    char buf[8];
+
+    test_setup(OPENFILES);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL(10, write(fd, "0123456789", 10));
+
+    // The file position isn't touched
+    TEST_ASSERT_EQUAL(2, lseek(fd, 2, SEEK_SET));
+    TEST_ASSERT_EQUAL(3, littleflash.pread(fd, buf, 3, 5));
+    TEST_ASSERT_EQUAL(0, memcmp(buf, "567", 3));
+    TEST_ASSERT_EQUAL(2, littleflash.pwrite(fd, "ab", 2, 8));
+    TEST_ASSERT_EQUAL(2, read(fd, buf, 2));
+    TEST_ASSERT_EQUAL(0, memcmp(buf, "23", 2));
+    TEST_ASSERT_EQUAL(4, lseek(fd, 0, SEEK_CUR));
+    TEST_ASSERT_EQUAL(4, littleflash.pread(fd, buf, 8, 6));
+    TEST_ASSERT_EQUAL(0, memcmp(buf, "67ab", 4));
+    TEST_ASSERT_EQUAL(0, littleflash.pread(fd, buf, 8, 10));
+    TEST_ASSERT_EQUAL(-1, littleflash.pread(fd, buf, 8, -1));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+    TEST_ASSERT_EQUAL(0, close(fd));
+
+    // A page store, read and written at random
+    uint8_t *page = (uint8_t *) calloc(1, PAGE_SIZE);
+    TEST_ASSERT_NOT_NULL(page);
+    FILE *f = fopen(path, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    for (int i = 0; i < PAGE_COUNT; ++i)
+    {
+        TEST_ASSERT_EQUAL(PAGE_SIZE, fwrite(page, 1, PAGE_SIZE, f));
+    }
+    TEST_ASSERT_EQUAL(0, fclose(f));
+    free(page);
+
+    test_pages(path, false);
+    test_pages(path, true);
+
+    TEST_ASSERT_EQUAL(0, unlink(path));
+
+    test_teardown();
+}
+
+#define MIXED_FILE_SIZE (128 * 1024)
+#define MIXED_IO_SIZE 256
+#define MIXED_SMALL_FILES 6
+#define MIXED_RECORD_EVERY 16
+
+static void test_mixed(size_t cache)
+{
+    uint8_t buf[MIXED_IO_SIZE];
+    char path[32];
+    int small[MIXED_SMALL_FILES];
+    struct timeval tv_start;
+
+    // Footprint of the open handles, with the big file's cache
+    size_t heap = esp_get_free_heap_size();
+    int fd = littleflash.open_cached(MOUNT_POINT "/segment.bin", O_WRONLY | O_CREAT | O_TRUNC, cache);
+    TEST_ASSERT_TRUE(fd >= 0);
+    for (int i = 0; i < MIXED_SMALL_FILES; ++i)
+    {
+        snprintf(path, sizeof(path), MOUNT_POINT "/small%d.cfg", i);
+        small[i] = open(path, O_WRONLY | O_CREAT | O_APPEND, 0);
+        TEST_ASSERT_TRUE(small[i] >= 0);
+    }
+    size_t footprint = heap - esp_get_free_heap_size();
+
+    // The big file is streamed while small records land in the others
+    gettimeofday(&tv_start, NULL);
+    for (int i = 0; i < MIXED_FILE_SIZE / MIXED_IO_SIZE; ++i)
+    {
+        memset(buf, i, sizeof(buf));
+        TEST_ASSERT_EQUAL(MIXED_IO_SIZE, write(fd, buf, MIXED_IO_SIZE));
+        if (i % MIXED_RECORD_EVERY == 0)
+        {
+            int s = (i / MIXED_RECORD_EVERY) % MIXED_SMALL_FILES;
+            TEST_ASSERT_EQUAL(32, write(small[s], buf, 32));
+        }
+    }
+    TEST_ASSERT_EQUAL(0, close(fd));
+    float write_s = test_elapsed(&tv_start);
+
+    for (int i = 0; i < MIXED_SMALL_FILES; ++i)
+    {
+        TEST_ASSERT_EQUAL(0, close(small[i]));
+    }
+
+    fd = littleflash.open_cached(MOUNT_POINT "/segment.bin", O_RDONLY, cache);
+    TEST_ASSERT_TRUE(fd >= 0);
+    gettimeofday(&tv_start, NULL);
+    for (int i = 0; i < MIXED_FILE_SIZE / MIXED_IO_SIZE; ++i)
+    {
+        TEST_ASSERT_EQUAL(MIXED_IO_SIZE, read(fd, buf, MIXED_IO_SIZE));
+        TEST_ASSERT_EQUAL((uint8_t) i, buf[0]);
+        TEST_ASSERT_EQUAL((uint8_t) i, buf[MIXED_IO_SIZE - 1]);
+    }
+    TEST_ASSERT_EQUAL(0, read(fd, buf, MIXED_IO_SIZE));
+    float read_s = test_elapsed(&tv_start);
+
+    // Writes on a read-only fd fail before reaching the cache
+    if (cache)
+    {
+        errno = 0;
+        TEST_ASSERT_EQUAL(-1, write(fd, buf, 1));
+        TEST_ASSERT_EQUAL(EBADF, errno);
+        TEST_ASSERT_EQUAL(0, read(fd, buf, MIXED_IO_SIZE));
+    }
+    TEST_ASSERT_EQUAL(0, close(fd));
+
+    printf("cache %5d: %d bytes for %d open files, write %.1fKB/s, read %.1fKB/s\n",
+           (int) cache,
+           (int) footprint,
+           MIXED_SMALL_FILES + 1,
+           MIXED_FILE_SIZE / 1024 / write_s,
+           MIXED_FILE_SIZE / 1024 / read_s);
+}
+
+TEST_CASE(can_file_cache, "per-file cache sizes", "[littleflash]")
+{
+    static const size_t caches[] = { 0, SPI_FLASH_SEC_SIZE, 4 * SPI_FLASH_SEC_SIZE };
+    const char *path = MOUNT_POINT "/cached.bin";
+    struct stat st;
+    char buf[16];
+
+    little_flash_config_t little_cfg = test_littleflash_config(OPENFILES + MIXED_SMALL_FILES);
+    test_littleflash_setup(&little_cfg);
+
+    // Buffered data is seen by the file's own reads, seeks and stats
+    int fd = littleflash.open_cached(path, O_RDWR | O_CREAT | O_TRUNC, 64);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL(10, write(fd, "0123456789", 10));
+    TEST_ASSERT_EQUAL(0, fstat(fd, &st));
+    TEST_ASSERT_EQUAL(10, st.st_size);
+    TEST_ASSERT_EQUAL(2, lseek(fd, 2, SEEK_SET));
+    TEST_ASSERT_EQUAL(3, read(fd, buf, 3));
+    TEST_ASSERT_EQUAL(0, memcmp(buf, "234", 3));
+    TEST_ASSERT_EQUAL(2, write(fd, "ab", 2));
+    TEST_ASSERT_EQUAL(0, lseek(fd, 0, SEEK_SET));
+    TEST_ASSERT_EQUAL(10, read(fd, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(0, memcmp(buf, "01234ab789", 10));
+    TEST_ASSERT_EQUAL(0, littleflash.set_cache(fd, 0));
+    TEST_ASSERT_EQUAL(0, close(fd));
+
+    for (int c = 0; c < sizeof(caches) / sizeof(caches[0]); ++c)
+    {
+        test_mixed(caches[c]);
+    }
+
+    TEST_ASSERT_EQUAL(0, unlink(path));
+
+    test_littleflash_teardown();
+}
+
+#define BLANK_FILL_SIZE (256 * 1024)
+#define BLANK_SECTORS (2 * BLANK_FILL_SIZE / SPI_FLASH_SEC_SIZE)
+
+// Erases the start of the test device, where a fresh filesystem allocates
+static void test_erase(int sectors)
+{
+#if !defined(CONFIG_LITTLEFS_PARTITION_LABEL)
+    test_extflash_setup();
+    for (int i = 0; i < sectors; ++i)
+    {
+        TEST_ASSERT_EQUAL(ESP_OK, extflash.erase_sector(i));
+    }
+    test_extflash_teardown();
+#else
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                           ESP_PARTITION_SUBTYPE_ANY,
+                                                           CONFIG_LITTLEFS_PARTITION_LABEL);
+    TEST_ASSERT_NOT_NULL(part);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_partition_erase_range(part, 0, sectors * SPI_FLASH_SEC_SIZE));
+#endif
+}
+
+TEST_CASE(can_blank_check, "skip erasing blank sectors", "[littleflash]")
+{
+    uint8_t *buf = (uint8_t *) malloc(SPI_FLASH_SEC_SIZE);
+    TEST_ASSERT_NOT_NULL(buf);
+
+    little_flash_stats_t stats;
+    struct timeval tv_start;
+
+    for (int check = 0; check < 2; ++check)
+    {
+        test_erase(BLANK_SECTORS);
+
+        little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+        little_cfg.blank_check = check;
+
+        // Mounting the erased device formats it
+        gettimeofday(&tv_start, NULL);
+        test_setup(&little_cfg);
+        float format_s = test_elapsed(&tv_start);
+
+        littleflash.reset_stats();
+        gettimeofday(&tv_start, NULL);
+        int fd = open(MOUNT_POINT "/fill.bin", O_WRONLY | O_CREAT | O_TRUNC, 0);
+        TEST_ASSERT_TRUE(fd >= 0);
+        for (int i = 0; i < BLANK_FILL_SIZE / SPI_FLASH_SEC_SIZE; ++i)
+        {
+            memset(buf, i, SPI_FLASH_SEC_SIZE);
+            TEST_ASSERT_EQUAL(SPI_FLASH_SEC_SIZE, write(fd, buf, SPI_FLASH_SEC_SIZE));
+        }
+        TEST_ASSERT_EQUAL(0, close(fd));
+        float fill_s = test_elapsed(&tv_start);
+        littleflash.get_stats(&stats);
+
+        printf("blank_check %d: format %.3fms, fill %.1fKB/s, %d erases, %d skipped\n",
+               check,
+               format_s * 1e3,
+               BLANK_FILL_SIZE / 1024 / fill_s,
+               stats.erases,
+               stats.erases_skipped);
+
+        if (check)
+        {
+            TEST_ASSERT_TRUE(stats.erases_skipped > 0);
+        }
+        else
+        {
+            TEST_ASSERT_EQUAL(0, stats.erases_skipped);
+        }
+
+        test_teardown();
+
+        // What was written over skipped erases reads back
+        test_setup(&little_cfg);
+        fd = open(MOUNT_POINT "/fill.bin", O_RDONLY);
+        TEST_ASSERT_TRUE(fd >= 0);
+        for (int i = 0; i < BLANK_FILL_SIZE / SPI_FLASH_SEC_SIZE; ++i)
+        {
+            TEST_ASSERT_EQUAL(SPI_FLASH_SEC_SIZE, read(fd, buf, SPI_FLASH_SEC_SIZE));
+            TEST_ASSERT_EQUAL((uint8_t) i, buf[0]);
+            TEST_ASSERT_EQUAL((uint8_t) i, buf[SPI_FLASH_SEC_SIZE - 1]);
+        }
+        TEST_ASSERT_EQUAL(0, close(fd));
+        TEST_ASSERT_EQUAL(0, unlink(MOUNT_POINT "/fill.bin"));
+        test_teardown();
+    }
+
+    free(buf);
+}
+
+#define DEVICE_SIZE (32 * SPI_FLASH_SEC_SIZE)
+#define DEVICE_FILE_SIZE (32 * 1024)
+#define NESTED_POINT "/nested"
+
+static void test_device_rw(const char *name, const char *path)
+{
+    uint8_t *buf = (uint8_t *) malloc(SPI_FLASH_SEC_SIZE);
+    TEST_ASSERT_NOT_NULL(buf);
+
+    struct timeval tv_start;
+
+    gettimeofday(&tv_start, NULL);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0);
+    TEST_ASSERT_TRUE(fd >= 0);
+    for (int i = 0; i < DEVICE_FILE_SIZE / SPI_FLASH_SEC_SIZE; ++i)
+    {
+        memset(buf, i, SPI_FLASH_SEC_SIZE);
+        TEST_ASSERT_EQUAL(SPI_FLASH_SEC_SIZE, write(fd, buf, SPI_FLASH_SEC_SIZE));
+    }
+    TEST_ASSERT_EQUAL(0, close(fd));
+    float write_s = test_elapsed(&tv_start);
+
+    gettimeofday(&tv_start, NULL);
+    fd = open(path, O_RDONLY);
+    TEST_ASSERT_TRUE(fd >= 0);
+    for (int i = 0; i < DEVICE_FILE_SIZE / SPI_FLASH_SEC_SIZE; ++i)
+    {
+        TEST_ASSERT_EQUAL(SPI_FLASH_SEC_SIZE, read(fd, buf, SPI_FLASH_SEC_SIZE));
+        TEST_ASSERT_EQUAL((uint8_t) i, buf[0]);
+        TEST_ASSERT_EQUAL((uint8_t) i, buf[SPI_FLASH_SEC_SIZE - 1]);
+    }
+    TEST_ASSERT_EQUAL(0, close(fd));
+    float read_s = test_elapsed(&tv_start);
+
+    TEST_ASSERT_EQUAL(0, unlink(path));
+
+    printf("%s device: write %.1fKB/s, read %.1fKB/s\n",
+           name,
+           DEVICE_FILE_SIZE / 1024 / write_s,
+           DEVICE_FILE_SIZE / 1024 / read_s);
+
+    free(buf);
+}
+
+TEST_CASE(can_block_device, "mount block devices", "[littleflash]")
+{
+    // A device passed in wins over flash and part_label
+    RamDevice ram;
+    TEST_ASSERT_EQUAL(ESP_OK, ram.init(DEVICE_SIZE));
+    TEST_ASSERT_EQUAL(DEVICE_SIZE, ram.info()->size);
+    TEST_ASSERT_EQUAL(SPI_FLASH_SEC_SIZE, ram.info()->sector_size);
+    TEST_ASSERT_TRUE(ram.info()->flags & BLOCK_DEVICE_VOLATILE);
+
+    little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+    little_cfg.device = &ram;
+    test_littleflash_setup(&little_cfg);
+    test_device_rw("RAM", MOUNT_POINT "/device.bin");
+    test_littleflash_teardown();
+    ram.term();
+
+    // An image file on the test filesystem, mounted by a second instance
+    test_setup(OPENFILES);
+
+    FileDevice file;
+    TEST_ASSERT_EQUAL(ESP_OK, file.init(MOUNT_POINT "/image.bin", DEVICE_SIZE));
+
+    struct stat st;
+    TEST_ASSERT_EQUAL(0, stat(MOUNT_POINT "/image.bin", &st));
+    TEST_ASSERT_EQUAL(DEVICE_SIZE, st.st_size);
+
+    LittleFlash nested;
+    little_flash_config_t nested_cfg = test_littleflash_config(OPENFILES);
+    nested_cfg.base_path = NESTED_POINT;
+    nested_cfg.device = &file;
+    TEST_ASSERT_EQUAL(ESP_OK, nested.init(&nested_cfg));
+    test_device_rw("File", NESTED_POINT "/device.bin");
+    nested.term();
+
+    file.term();
+    TEST_ASSERT_EQUAL(0, unlink(MOUNT_POINT "/image.bin"));
+
+    test_teardown();
+}
+
+#define SCHED_SLICE_SIZE (16 * SPI_FLASH_SEC_SIZE)
+#define SCHED_READS 100
+#define SCHED_READ_SIZE 256
+#define SCHED_FILE_SIZE (16 * 1024)
+#define SCHED_WRITE_SIZE (8 * 1024)
+
+typedef struct
+{
+    volatile bool stop;
+    bool ok;
+    uint32_t writes;
+    SemaphoreHandle_t done;
+} sched_task_arg_t;
+
+// Rewrites a file on the other mount until told to stop, so blocks keep
+// getting erased and programmed
+static void sched_write_task(void *param)
+{
+    sched_task_arg_t *args = (sched_task_arg_t *) param;
+
+    uint8_t *buf = (uint8_t *) malloc(SCHED_WRITE_SIZE);
+    args->ok = buf != NULL;
+    while (args->ok && !args->stop)
+    {
+        memset(buf, args->writes, SCHED_WRITE_SIZE);
+
+        int fd = open("/sched_w/busy.bin", O_WRONLY | O_CREAT | O_TRUNC, 0);
+        args->ok = fd >= 0 &&
+                   write(fd, buf, SCHED_WRITE_SIZE) == SCHED_WRITE_SIZE &&
+                   close(fd) == 0;
+        args->writes++;
+    }
+    free(buf);
+
+    xSemaphoreGive(args->done);
+    vTaskDelay(1);
+    vTaskDelete(NULL);
+}
+
+static void test_sched(const char *name, bool sched, uint32_t suspend_us)
+{
+    RamDevice ram;
+    TEST_ASSERT_EQUAL(ESP_OK, ram.init(2 * SCHED_SLICE_SIZE));
+
+    // Read and program rates and erase time of a typical SPI NOR chip
+    const sim_device_timing_t timing =
+    {
+        .read_rate = 20,
+        .prog_rate = 0.4,
+        .erase_us = 45000,
+        .suspend_us = suspend_us
+    };
+    SimDevice sim;
+    TEST_ASSERT_EQUAL(ESP_OK, sim.init(&ram, &timing));
+
+    SchedDevice sched_dev;
+    BlockDevice *chip = &sim;
+    if (sched)
+    {
+        TEST_ASSERT_EQUAL(ESP_OK, sched_dev.init(&sim));
+        chip = &sched_dev;
+    }
+
+    // One mount reads while the other writes, both on the same chip.  A
+    // reader and writer on one mount take turns on its lock, which no
+    // scheduling below LittleFS can help, so they get a mount each.
+    SliceDevice rslice;
+    SliceDevice wslice;
+    TEST_ASSERT_EQUAL(ESP_OK, rslice.init(chip, 0, SCHED_SLICE_SIZE));
+    TEST_ASSERT_EQUAL(ESP_OK, wslice.init(chip, SCHED_SLICE_SIZE, SCHED_SLICE_SIZE));
+
+    LittleFlash rfs;
+    little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+    little_cfg.base_path = "/sched_r";
+    little_cfg.prog_size = SCHED_READ_SIZE;
+    little_cfg.device = &rslice;
+    TEST_ASSERT_EQUAL(ESP_OK, rfs.init(&little_cfg));
+
+    LittleFlash wfs;
+    little_cfg.base_path = "/sched_w";
+    little_cfg.device = &wslice;
+    TEST_ASSERT_EQUAL(ESP_OK, wfs.init(&little_cfg));
+
+    uint8_t *buf = (uint8_t *) malloc(SCHED_FILE_SIZE);
+    TEST_ASSERT_NOT_NULL(buf);
+    memset(buf, 0x5a, SCHED_FILE_SIZE);
+    int fd = open("/sched_r/data.bin", O_WRONLY | O_CREAT | O_TRUNC, 0);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL(SCHED_FILE_SIZE, write(fd, buf, SCHED_FILE_SIZE));
+    TEST_ASSERT_EQUAL(0, close(fd));
+
+    sched_task_arg_t args = {};
+    args.done = xSemaphoreCreateBinary();
+    TEST_ASSERT_NOT_NULL(args.done);
+    TEST_ASSERT_EQUAL(pdPASS, xTaskCreate(&sched_write_task, "sched", 4096, &args, 1, NULL));
+
+    // Each read lands on a page that isn't cached
+    uint32_t lat[SCHED_READS];
+    uint32_t seed = 1;
+    fd = open("/sched_r/data.bin", O_RDONLY);
+    TEST_ASSERT_TRUE(fd >= 0);
+    sim.reset_stats();
+    for (int i = 0; i < SCHED_READS; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        off_t off = ((seed >> 16) % (SCHED_FILE_SIZE / SCHED_READ_SIZE)) * SCHED_READ_SIZE;
+
+        int64_t start = esp_timer_get_time();
+        TEST_ASSERT_EQUAL(off, lseek(fd, off, SEEK_SET));
+        TEST_ASSERT_EQUAL(SCHED_READ_SIZE, read(fd, buf, SCHED_READ_SIZE));
+        lat[i] = esp_timer_get_time() - start;
+
+        TEST_ASSERT_EQUAL(0x5a, buf[0]);
+        vTaskDelay(1);
+    }
+    TEST_ASSERT_EQUAL(0, close(fd));
+
+    args.stop = true;
+    xSemaphoreTake(args.done, portMAX_DELAY);
+    vSemaphoreDelete(args.done);
+    TEST_ASSERT_TRUE(args.ok);
+
+    sim_device_stats_t sim_stats;
+    sim.get_stats(&sim_stats);
+
+    qsort(lat, SCHED_READS, sizeof(uint32_t), scale_cmp);
+    printf("%s: read latency p50 %dus p99 %dus max %dus, %d rewrites, %d reads waited, %d suspends\n",
+           name,
+           lat[SCHED_READS * 50 / 100],
+           lat[SCHED_READS * 99 / 100],
+           lat[SCHED_READS - 1],
+           args.writes,
+           sim_stats.busy_waits,
+           sim_stats.suspends);
+
+    free(buf);
+    wfs.term();
+    rfs.term();
+}
+
+TEST_CASE(can_io_sched, "read latency under a concurrent write load", "[littleflash]")
+{
+    test_sched("In call order", false, 0);
+    test_sched("Reads first", true, 0);
+    test_sched("Reads first with suspend", true, 20);
+}
+
+#define POOL_BUDGET (40 * 1024)
+#define POOL_LIMIT (16 * 1024)
+#define POOL_FILES 8
+#define POOL_ROUNDS 4
+
+// Reads every file on the mount a few times over, so its handle cache fills
+static void test_pool_reads(const char *base)
+{
+    char path[32];
+    char buf[256];
+
+    for (int r = 0; r < POOL_ROUNDS; ++r)
+    {
+        for (int i = 0; i < POOL_FILES; ++i)
+        {
+            snprintf(path, sizeof(path), "%s/pool%d", base, i);
+            int fd = open(path, O_RDONLY);
+            TEST_ASSERT_TRUE(fd >= 0);
+            TEST_ASSERT_EQUAL(sizeof(buf), read(fd, buf, sizeof(buf)));
+            TEST_ASSERT_EQUAL(0, close(fd));
+        }
+    }
+}
+
+static void test_pool_print(const char *name, LittlePool *pool, LittleFlash *a, LittleFlash *b)
+{
+    little_pool_stats_t as;
+    little_pool_stats_t bs;
+    little_pool_stats_t ps;
+    pool->get_stats(a, &as);
+    pool->get_stats(b, &bs);
+    pool->get_stats(NULL, &ps);
+
+    printf("%s: pool %d of %d bytes, A %d bytes (%d reclaimed), B %d bytes (%d reclaimed)\n",
+           name,
+           (int) ps.used,
+           POOL_BUDGET,
+           (int) as.used,
+           (int) as.reclaimed,
+           (int) bs.used,
+           (int) bs.reclaimed);
+}
+
+TEST_CASE(can_pool, "mounts sharing a memory budget", "[littleflash]")
+{
+    LittlePool pool;
+    TEST_ASSERT_EQUAL(ESP_OK, pool.init(POOL_BUDGET));
+
+    RamDevice ram_a;
+    RamDevice ram_b;
+    TEST_ASSERT_EQUAL(ESP_OK, ram_a.init(DEVICE_SIZE));
+    TEST_ASSERT_EQUAL(ESP_OK, ram_b.init(DEVICE_SIZE));
+
+    little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+    little_cfg.handle_cache = POOL_FILES;
+    little_cfg.pool = &pool;
+
+    LittleFlash fs_a;
+    little_cfg.base_path = "/pool_a";
+    little_cfg.device = &ram_a;
+    TEST_ASSERT_EQUAL(ESP_OK, fs_a.init(&little_cfg));
+
+    LittleFlash fs_b;
+    little_cfg.base_path = "/pool_b";
+    little_cfg.device = &ram_b;
+    TEST_ASSERT_EQUAL(ESP_OK, fs_b.init(&little_cfg));
+
+    char path[32];
+    char buf[256];
+    memset(buf, 'p', sizeof(buf));
+    for (int i = 0; i < POOL_FILES; ++i)
+    {
+        for (int m = 0; m < 2; ++m)
+        {
+            snprintf(path, sizeof(path), "/pool_%c/pool%d", 'a' + m, i);
+            FILE *f = fopen(path, "wb");
+            TEST_ASSERT_NOT_NULL(f);
+            TEST_ASSERT_EQUAL(sizeof(buf), fwrite(buf, 1, sizeof(buf), f));
+            TEST_ASSERT_EQUAL(0, fclose(f));
+        }
+    }
+
+    // The LittleFS buffers of both mounts are charged up front
+    little_pool_stats_t as;
+    little_pool_stats_t bs;
+    pool.get_stats(&fs_a, &as);
+    pool.get_stats(&fs_b, &bs);
+    TEST_ASSERT_TRUE(as.used > 0);
+    TEST_ASSERT_EQUAL(as.used, bs.used);
+    size_t base = as.used;
+    test_pool_print("Mounted", &pool, &fs_a, &fs_b);
+
+    // So is the cache LittleFS gives an open file, until it's closed
+    int fd = open("/pool_a/pool0", O_RDWR);
+    TEST_ASSERT_TRUE(fd >= 0);
+    pool.get_stats(&fs_a, &as);
+    TEST_ASSERT_TRUE(as.used > base);
+    TEST_ASSERT_EQUAL(0, close(fd));
+    pool.get_stats(&fs_a, &as);
+    TEST_ASSERT_EQUAL(base, as.used);
+
+    // A busy mount fills the pool with cached handles...
+    pool.reset_stats();
+    test_pool_reads("/pool_a");
+    pool.get_stats(&fs_a, &as);
+    TEST_ASSERT_TRUE(as.used > base);
+    test_pool_print("A busy", &pool, &fs_a, &fs_b);
+
+    // ...which go to the other mount once it gets busy instead
+    test_pool_reads("/pool_b");
+    pool.get_stats(&fs_a, &as);
+    pool.get_stats(&fs_b, &bs);
+    TEST_ASSERT_TRUE(as.reclaims > 0);
+    TEST_ASSERT_TRUE(bs.used > as.used);
+    test_pool_print("B busy", &pool, &fs_a, &fs_b);
+
+    little_pool_stats_t ps;
+    pool.get_stats(NULL, &ps);
+    TEST_ASSERT_TRUE(ps.peak <= POOL_BUDGET);
+    TEST_ASSERT_EQUAL(as.used + bs.used, ps.used);
+
+    fs_b.term();
+
+    // A mount can't take more than its limit, however empty the pool
+    little_cfg.handle_cache = 0;
+    little_cfg.pool_limit = POOL_LIMIT;
+    TEST_ASSERT_EQUAL(ESP_OK, fs_b.init(&little_cfg));
+
+    fd = open("/pool_b/pool0", O_RDONLY);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL(-1, fs_b.set_cache(fd, POOL_LIMIT));
+    TEST_ASSERT_EQUAL(ENOMEM, errno);
+    TEST_ASSERT_EQUAL(0, fs_b.set_cache(fd, 1024));
+    TEST_ASSERT_EQUAL(sizeof(buf), read(fd, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL('p', buf[0]);
+    TEST_ASSERT_EQUAL(0, close(fd));
+
+    pool.get_stats(&fs_b, &bs);
+    TEST_ASSERT_EQUAL(1, bs.failures);
+    TEST_ASSERT_EQUAL(base, bs.used);
+
+    fs_b.term();
+    fs_a.term();
+
+    // Everything went back
+    pool.get_stats(NULL, &ps);
+    TEST_ASSERT_EQUAL(0, ps.used);
+
+    ram_b.term();
+    ram_a.term();
+    pool.term();
+}
+
+#define FBUF_BUFFERS 4
+#define FBUF_WRITE 512
+#define FBUF_ROUNDS 8
+
+// Opens files at once and writes to them in turn, reporting the memory
+// taken by the mount and its open files
+static void test_fbuf(int files, int buffers)
+{
+    uint8_t buf[FBUF_WRITE];
+    char path[32];
+    struct timeval tv_start;
+    little_flash_stats_t stats;
+
+    int *fds = (int *) malloc(files * sizeof(int));
+    TEST_ASSERT_NOT_NULL(fds);
+
+    test_extflash_setup();
+    size_t heap = esp_get_free_heap_size();
+
+    little_flash_config_t little_cfg = test_littleflash_config(files);
+    little_cfg.file_buffers = buffers;
+    test_littleflash_setup(&little_cfg);
+
+    // Without shared buffers, the heap may run out first
+    int opened = 0;
+    for (int i = 0; i < files; ++i)
+    {
+        snprintf(path, sizeof(path), MOUNT_POINT "/fbuf%d", i);
+        fds[i] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0);
+        if (fds[i] < 0)
+        {
+            TEST_ASSERT_EQUAL(0, buffers);
+            TEST_ASSERT_EQUAL(ENOMEM, errno);
+            break;
+        }
+        opened++;
+    }
+
+    littleflash.reset_stats();
+    gettimeofday(&tv_start, NULL);
+    for (int r = 0; r < FBUF_ROUNDS; ++r)
+    {
+        for (int i = 0; i < opened; ++i)
+        {
+            memset(buf, i + r, sizeof(buf));
+            TEST_ASSERT_EQUAL(FBUF_WRITE, write(fds[i], buf, FBUF_WRITE));
+        }
+    }
+    float write_s = test_elapsed(&tv_start);
+    size_t footprint = heap - esp_get_free_heap_size();
+    littleflash.get_stats(&stats);
+
+    // Data flushed when a buffer was taken away reads back in place
+    for (int i = 0; i < opened; ++i)
+    {
+        TEST_ASSERT_EQUAL(0, lseek(fds[i], 0, SEEK_SET));
+        for (int r = 0; r < FBUF_ROUNDS; ++r)
+        {
+            TEST_ASSERT_EQUAL(FBUF_WRITE, read(fds[i], buf, FBUF_WRITE));
+            TEST_ASSERT_EQUAL((uint8_t) (i + r), buf[0]);
+            TEST_ASSERT_EQUAL((uint8_t) (i + r), buf[FBUF_WRITE - 1]);
+        }
+        TEST_ASSERT_EQUAL(0, close(fds[i]));
+    }
+
+    for (int i = 0; i < opened; ++i)
+    {
+        snprintf(path, sizeof(path), MOUNT_POINT "/fbuf%d", i);
+        TEST_ASSERT_EQUAL(0, unlink(path));
+    }
+
+    if (opened < files)
+    {
+        printf("%2d files, %d shared buffers: out of memory after %d files\n", files, buffers, opened);
+    }
+    else
+    {
+        // Each write to a file whose buffer was taken erases a new block
+        printf("%2d files, %d shared buffers: %6d bytes, write %.1fKB/s, %d buffer reclaims, %d erases\n",
+               files,
+               buffers,
+               (int) footprint,
+               files * FBUF_ROUNDS * FBUF_WRITE / 1024 / write_s,
+               stats.buffer_reclaims,
+               stats.erases);
+    }
+
+    test_teardown();
+    free(fds);
+}
+
+TEST_CASE(can_file_buffers, "open files sharing file buffers", "[littleflash]")
+{
+    // The VFS has 64 fds, less stdin, stdout and stderr
+    static const int files[] = { 4, 16, 64 - 3 };
+
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i)
+    {
+        test_fbuf(files[i], 0);
+        test_fbuf(files[i], FBUF_BUFFERS);
+    }
+
+    // Opening a file leaves the data buffered for another one alone
+    char buf[16];
+    little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+    little_cfg.file_buffers = 1;
+    test_setup(&little_cfg);
+
+    int held = open(MOUNT_POINT "/fbuf_held", O_RDWR | O_CREAT | O_TRUNC, 0);
+    TEST_ASSERT_TRUE(held >= 0);
+    TEST_ASSERT_EQUAL(10, write(held, "0123456789", 10));
+
+    int other = open(MOUNT_POINT "/fbuf_other", O_RDWR | O_CREAT | O_TRUNC, 0);
+    TEST_ASSERT_TRUE(other >= 0);
+    TEST_ASSERT_EQUAL(0, close(other));
+
+    TEST_ASSERT_EQUAL(0, lseek(held, 0, SEEK_SET));
+    TEST_ASSERT_EQUAL(10, read(held, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(0, memcmp(buf, "0123456789", 10));
+    TEST_ASSERT_EQUAL(0, close(held));
+
+    TEST_ASSERT_EQUAL(0, unlink(MOUNT_POINT "/fbuf_held"));
+    TEST_ASSERT_EQUAL(0, unlink(MOUNT_POINT "/fbuf_other"));
+    test_teardown();
+}
+
+#define CRC_BENCH_SIZE 4096
+#define CRC_BENCH_ROUNDS 64
+#define CRC_TREE_DIRS 10
+#define CRC_TREE_FILES 50
+
+typedef struct
+{
+    const char *name;
+    little_crc_fn_t fn;
+} crc_impl_t;
+
+static const crc_impl_t crc_impls[] =
+{
+    { "bytewise", little_crc_bytewise },
+    { "slice-by-8", little_crc_slice8 },
+#if defined(LITTLE_CRC_HAS_ROM)
+    { "ROM", little_crc_rom },
+#endif
+};
+
+#define CRC_IMPLS (sizeof(crc_impls) / sizeof(crc_impls[0]))
+
+TEST_CASE(can_crc, "LittleFS CRC versions", "[littleflash]")
+{
+    const char *root = MOUNT_POINT "/crc";
+    struct timeval tv_start;
+    little_flash_usage_t usage;
+
+    uint8_t *buf = (uint8_t *) malloc(CRC_BENCH_SIZE);
+    TEST_ASSERT_NOT_NULL(buf);
+    uint32_t seed = 1;
+    for (int i = 0; i < CRC_BENCH_SIZE; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+
+    // Every version gives the same result for any length and alignment,
+    // and in pieces
+    for (size_t c = 0; c < CRC_IMPLS; ++c)
+    {
+        uint32_t crc = 0xffffffff;
+        crc_impls[c].fn(&crc, "123456789", 9);
+        TEST_ASSERT_EQUAL(0x340bc6d9, crc);
+
+        for (int off = 0; off < 8; ++off)
+        {
+            for (int len = 0; len < 64; ++len)
+            {
+                uint32_t expect = 0xffffffff;
+                little_crc_bytewise(&expect, buf + off, len);
+
+                crc = 0xffffffff;
+                crc_impls[c].fn(&crc, buf + off, len / 3);
+                crc_impls[c].fn(&crc, buf + off + len / 3, len - len / 3);
+                TEST_ASSERT_EQUAL(expect, crc);
+            }
+        }
+    }
+
+    for (size_t c = 0; c < CRC_IMPLS; ++c)
+    {
+        uint32_t crc = 0xffffffff;
+        int64_t start = esp_timer_get_time();
+        for (int i = 0; i < CRC_BENCH_ROUNDS; ++i)
+        {
+            crc_impls[c].fn(&crc, buf, CRC_BENCH_SIZE);
+        }
+        int64_t us = esp_timer_get_time() - start;
+
+        printf("%-10s: %.2fMB/s\n", crc_impls[c].name, CRC_BENCH_ROUNDS * CRC_BENCH_SIZE / 1.048576 / us);
+    }
+    free(buf);
+
+    // Mounting and walking a tree fetches and checks every directory
+    test_setup(OPENFILES);
+    test_tree_create(root, CRC_TREE_DIRS, CRC_TREE_FILES);
+    test_littleflash_teardown();
+
+    for (size_t c = 0; c < CRC_IMPLS; ++c)
+    {
+        little_crc_use(crc_impls[c].fn);
+
+        little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+        gettimeofday(&tv_start, NULL);
+        test_littleflash_setup(&little_cfg);
+        TEST_ASSERT_EQUAL(0, littleflash.usage(root, &usage));
+        float t_s = test_elapsed(&tv_start);
+        test_littleflash_teardown();
+
+        TEST_ASSERT_EQUAL(CRC_TREE_DIRS * CRC_TREE_FILES, usage.files);
+        printf("%-10s: mount and usage() of %d files in %.3fms\n", crc_impls[c].name, CRC_TREE_DIRS * CRC_TREE_FILES, t_s * 1e3);
+    }
+
+    little_crc_use(NULL);
+
+    little_flash_config_t little_cfg = test_littleflash_config(OPENFILES);
+    test_littleflash_setup(&little_cfg);
+    TEST_ASSERT_EQUAL(0, littleflash.remove_tree(root));
+    test_teardown();
+}
+
 extern "C" void app_main(void *)
 {
     can_format();
@@ -275,6 +3247,30 @@ extern "C" void app_main(void *)
     can_dir();
     can_task();
     can_read_write();
+    can_log();
+    can_kv();
+    can_dentry();
+    can_list();
+    can_tree();
+    can_copy();
+    can_compress();
+    can_wear();
+    can_bench();
+    can_scale();
+    can_prog_size();
+    can_read_only();
+    can_truncate();
+    can_handle_cache();
+    can_sendfile();
+    can_vector();
+    can_pread();
+    can_file_cache();
+    can_blank_check();
+    can_block_device();
+    can_io_sched();
+    can_pool();
+    can_file_buffers();
+    can_crc();
 
     printf("All tests done...\n");
 
@@ -0,0 +1,479 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//
+// Runs the benchmark suite on the host against LittleFS on a simulated
+// flash device.  Time spent in the device is modelled from its read and
+// program rates and erase time and added to the measured CPU time.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+extern "C"
+{
+#include "lfs.h"
+#include "bench_lfs.h"
+}
+
+#define MAX_FILES 8
+
+typedef struct
+{
+    uint8_t *image;
+    double read_us_per_byte;
+    double prog_us_per_byte;
+    double erase_us;
+    double sim_us;
+    struct lfs_config cfg;
+    lfs_t lfs;
+    lfs_file_t *files[MAX_FILES];
+} sim_t;
+
+static const char *prog_name;
+
+// ============================================================================
+// LFS disk interface for the simulated device
+// ============================================================================
+
+static int sim_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    sim_t *sim = (sim_t *) c->context;
+
+    memcpy(buffer, sim->image + block * c->block_size + off, size);
+    sim->sim_us += size * sim->read_us_per_byte;
+
+    return 0;
+}
+
+static int sim_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+    sim_t *sim = (sim_t *) c->context;
+
+    uint8_t *dst = sim->image + block * c->block_size + off;
+    const uint8_t *src = (const uint8_t *) buffer;
+    for (lfs_size_t i = 0; i < size; i++)
+    {
+        dst[i] &= src[i];
+    }
+    sim->sim_us += size * sim->prog_us_per_byte;
+
+    return 0;
+}
+
+static int sim_erase(const struct lfs_config *c, lfs_block_t block)
+{
+    sim_t *sim = (sim_t *) c->context;
+
+    memset(sim->image + block * c->block_size, 0xff, c->block_size);
+    sim->sim_us += sim->erase_us;
+
+    return 0;
+}
+
+static int sim_sync(const struct lfs_config *c)
+{
+    return 0;
+}
+
+// ============================================================================
+// Benchmark operations
+// ============================================================================
+
+static int ret(int err)
+{
+    return err < 0 ? -1 : 0;
+}
+
+static int sim_mount(void *ctx)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    return ret(lfs_mount(&sim->lfs, &sim->cfg));
+}
+
+static int sim_unmount(void *ctx)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    return ret(lfs_unmount(&sim->lfs));
+}
+
+static int sim_open(void *ctx, const char *path, int flags)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    int lfs_flags = 0;
+    if ((flags & O_ACCMODE) == O_RDONLY)
+    {
+        lfs_flags = LFS_O_RDONLY;
+    }
+    else if ((flags & O_ACCMODE) == O_WRONLY)
+    {
+        lfs_flags = LFS_O_WRONLY;
+    }
+    else
+    {
+        lfs_flags = LFS_O_RDWR;
+    }
+
+    if (flags & O_CREAT)
+    {
+        lfs_flags |= LFS_O_CREAT;
+    }
+
+    if (flags & O_TRUNC)
+    {
+        lfs_flags |= LFS_O_TRUNC;
+    }
+
+    if (flags & O_APPEND)
+    {
+        lfs_flags |= LFS_O_APPEND;
+    }
+
+    for (int fd = 0; fd < MAX_FILES; fd++)
+    {
+        if (sim->files[fd] == NULL)
+        {
+            lfs_file_t *file = (lfs_file_t *) malloc(sizeof(lfs_file_t));
+            if (file == NULL || lfs_file_open(&sim->lfs, file, path, lfs_flags) < 0)
+            {
+                free(file);
+                return -1;
+            }
+            sim->files[fd] = file;
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+static int sim_close(void *ctx, int fd)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    int err = lfs_file_close(&sim->lfs, sim->files[fd]);
+    free(sim->files[fd]);
+    sim->files[fd] = NULL;
+
+    return ret(err);
+}
+
+static ssize_t sim_rd(void *ctx, int fd, void *buf, size_t size)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    lfs_ssize_t len = lfs_file_read(&sim->lfs, sim->files[fd], buf, size);
+
+    return len < 0 ? -1 : len;
+}
+
+static ssize_t sim_wr(void *ctx, int fd, const void *buf, size_t size)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    lfs_ssize_t len = lfs_file_write(&sim->lfs, sim->files[fd], buf, size);
+
+    return len < 0 ? -1 : len;
+}
+
+static off_t sim_seek(void *ctx, int fd, off_t off)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    lfs_soff_t pos = lfs_file_seek(&sim->lfs, sim->files[fd], off, LFS_SEEK_SET);
+    if (pos < 0)
+    {
+        return -1;
+    }
+
+    return lfs_file_tell(&sim->lfs, sim->files[fd]);
+}
+
+static int sim_fsync(void *ctx, int fd)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    return ret(lfs_file_sync(&sim->lfs, sim->files[fd]));
+}
+
+static int sim_stat(void *ctx, const char *path, size_t *size)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    struct lfs_info info;
+    int err = lfs_stat(&sim->lfs, path, &info);
+    if (err < 0)
+    {
+        return -1;
+    }
+    *size = info.size;
+
+    return 0;
+}
+
+static int sim_unlink(void *ctx, const char *path)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    return ret(lfs_remove(&sim->lfs, path));
+}
+
+static int sim_mkdir(void *ctx, const char *path)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    return ret(lfs_mkdir(&sim->lfs, path));
+}
+
+static int sim_list(void *ctx, const char *path)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    lfs_dir_t dir;
+    if (lfs_dir_open(&sim->lfs, &dir, path) < 0)
+    {
+        return -1;
+    }
+
+    int entries = 0;
+    struct lfs_info info;
+    int err;
+    while ((err = lfs_dir_read(&sim->lfs, &dir, &info)) > 0)
+    {
+        if (strcmp(info.name, ".") != 0 && strcmp(info.name, "..") != 0)
+        {
+            entries++;
+        }
+    }
+
+    lfs_dir_close(&sim->lfs, &dir);
+
+    return err < 0 ? -1 : entries;
+}
+
+static size_t sim_capacity(void *ctx)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    return sim->cfg.block_size * sim->cfg.block_count;
+}
+
+static size_t sim_block_size(void *ctx)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    return sim->cfg.block_size;
+}
+
+static int sim_mark(void *data, lfs_block_t block)
+{
+    uint8_t *used = (uint8_t *) data;
+
+    used[block] = 1;
+
+    return 0;
+}
+
+static size_t sim_used(void *ctx)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    uint8_t *used = (uint8_t *) calloc(sim->cfg.block_count, 1);
+    if (used == NULL)
+    {
+        return 0;
+    }
+
+    size_t blocks = 0;
+    if (lfs_traverse(&sim->lfs, sim_mark, used) == 0)
+    {
+        for (lfs_size_t b = 0; b < sim->cfg.block_count; b++)
+        {
+            blocks += used[b];
+        }
+    }
+
+    free(used);
+
+    return blocks * sim->cfg.block_size;
+}
+
+static uint64_t sim_now_us(void *ctx)
+{
+    sim_t *sim = (sim_t *) ctx;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + (uint64_t) sim->sim_us;
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "\n"
+            "options:\n"
+            "  -s <bytes>  device size (default 4194304)\n"
+            "  -b <bytes>  block size (default 4096)\n"
+            "  -g <bytes>  program granularity (default block size)\n"
+            "  -f <fmt>    json or csv (default json)\n"
+            "  -r <MB/s>   device read rate (default 20)\n"
+            "  -p <MB/s>   device program rate (default 0.4)\n"
+            "  -e <ms>     device block erase time (default 45)\n"
+            "  -n <name>   suite name recorded with the results\n",
+            prog_name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = 4 * 1024 * 1024;
+    size_t block_size = 4096;
+    size_t prog_size = 0;
+    double read_rate = 20;
+    double prog_rate = 0.4;
+    double erase_ms = 45;
+
+    prog_name = argv[0];
+
+    bench_config_t cfg = {};
+    cfg.format = BENCH_JSON;
+    cfg.suite = "lfsbench";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:b:g:f:r:p:e:n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                size = strtoul(optarg, NULL, 0);
+            break;
+            case 'b':
+                block_size = strtoul(optarg, NULL, 0);
+            break;
+            case 'g':
+                prog_size = strtoul(optarg, NULL, 0);
+            break;
+            case 'f':
+                if (strcmp(optarg, "json") == 0)
+                {
+                    cfg.format = BENCH_JSON;
+                }
+                else if (strcmp(optarg, "csv") == 0)
+                {
+                    cfg.format = BENCH_CSV;
+                }
+                else
+                {
+                    usage();
+                }
+            break;
+            case 'r':
+                read_rate = atof(optarg);
+            break;
+            case 'p':
+                prog_rate = atof(optarg);
+            break;
+            case 'e':
+                erase_ms = atof(optarg);
+            break;
+            case 'n':
+                cfg.suite = optarg;
+            break;
+            default:
+                usage();
+            break;
+        }
+    }
+
+    if (prog_size == 0)
+    {
+        prog_size = block_size;
+    }
+
+    if (block_size == 0 || block_size % prog_size != 0 || size % block_size != 0 || size / block_size < 2 || read_rate <= 0 || prog_rate <= 0)
+    {
+        usage();
+    }
+
+    static sim_t sim;
+    sim.image = (uint8_t *) malloc(size);
+    if (sim.image == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", prog_name);
+        return 1;
+    }
+    memset(sim.image, 0xff, size);
+
+    sim.read_us_per_byte = 1.0 / read_rate / 1.048576;
+    sim.prog_us_per_byte = 1.0 / prog_rate / 1.048576;
+    sim.erase_us = erase_ms * 1000;
+
+    // Same geometry as LittleFlash::init()
+    sim.cfg.context     = &sim;
+    sim.cfg.read        = &sim_read;
+    sim.cfg.prog        = &sim_prog;
+    sim.cfg.erase       = &sim_erase;
+    sim.cfg.sync        = &sim_sync;
+    sim.cfg.read_size   = prog_size;
+    sim.cfg.prog_size   = prog_size;
+    sim.cfg.block_size  = block_size;
+    sim.cfg.block_count = size / block_size;
+    sim.cfg.lookahead   = 32;
+
+    if (lfs_format(&sim.lfs, &sim.cfg) < 0 || lfs_mount(&sim.lfs, &sim.cfg) < 0)
+    {
+        fprintf(stderr, "%s: unable to format the simulated device\n", prog_name);
+        return 1;
+    }
+
+    bench_ops_t ops = {};
+    ops.ctx = &sim;
+    ops.mount = sim_mount;
+    ops.unmount = sim_unmount;
+    ops.open = sim_open;
+    ops.close = sim_close;
+    ops.read = sim_rd;
+    ops.write = sim_wr;
+    ops.seek = sim_seek;
+    ops.fsync = sim_fsync;
+    ops.stat = sim_stat;
+    ops.unlink = sim_unlink;
+    ops.mkdir = sim_mkdir;
+    ops.rmdir = sim_unlink;
+    ops.list = sim_list;
+    ops.capacity = sim_capacity;
+    ops.block_size = sim_block_size;
+    ops.used = sim_used;
+    ops.now_us = sim_now_us;
+
+    int err = bench_run(&ops, &cfg);
+
+    lfs_unmount(&sim.lfs);
+    free(sim.image);
+
+    return err == 0 ? 0 : 1;
+}
@@ -0,0 +1,714 @@
+// Copyright 2017-2018 Leland Lucius
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//
+// Builds LittleFlash images from a directory tree on the host and unpacks
+// them again, using the same LittleFS sources as the component.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <string>
+
+extern "C"
+{
+#include "lfs.h"
+#include "littlelz.h"
+}
+
+// Must match the component's compressed file format
+#define COMPRESS_CHUNK 4096
+#define COMPRESS_HDR 4
+
+static const char *prog_name;
+
+static uint8_t *image;
+static size_t image_size;
+
+static const char *compress_prefix;
+static size_t zprefix_len;
+static uint8_t zbuf[COMPRESS_HDR + COMPRESS_CHUNK];
+static uint8_t raw[COMPRESS_CHUNK];
+static uint16_t zhtab[LITTLE_LZ_HASH_SIZE];
+
+static int files;
+static int dirs;
+
+// ============================================================================
+// LFS disk interface for the image in memory
+// ============================================================================
+
+static int image_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    memcpy(buffer, image + block * c->block_size + off, size);
+
+    return 0;
+}
+
+static int image_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+    // Programming can only clear bits, just like the real thing
+    uint8_t *dst = image + block * c->block_size + off;
+    const uint8_t *src = (const uint8_t *) buffer;
+    for (lfs_size_t i = 0; i < size; i++)
+    {
+        dst[i] &= src[i];
+    }
+
+    return 0;
+}
+
+static int image_erase(const struct lfs_config *c, lfs_block_t block)
+{
+    memset(image + block * c->block_size, 0xff, c->block_size);
+
+    return 0;
+}
+
+static int image_sync(const struct lfs_config *c)
+{
+    return 0;
+}
+
+// ============================================================================
+// Helpers
+// ============================================================================
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: %s create [options] <directory> <image>\n"
+            "       %s unpack [options] <image> <directory>\n"
+            "\n"
+            "options:\n"
+            "  -t <file>   partition table to take the image size from\n"
+            "  -l <label>  partition label (default littlefs)\n"
+            "  -s <size>   image size, like 1984K, 4M or 0x1f0000\n"
+            "  -b <size>   block size (default 4096)\n"
+            "  -z <path>   compress files below this path, as compress_prefix\n",
+            prog_name,
+            prog_name);
+    exit(1);
+}
+
+static bool parse_size(const char *str, size_t *size)
+{
+    char *end;
+    unsigned long val = strtoul(str, &end, 0);
+
+    if (end == str)
+    {
+        return false;
+    }
+
+    if (*end == 'K' || *end == 'k')
+    {
+        val *= 1024;
+        end++;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+        val *= 1024 * 1024;
+        end++;
+    }
+
+    while (isspace((unsigned char) *end))
+    {
+        end++;
+    }
+
+    *size = val;
+
+    return *end == '\0';
+}
+
+static char *trim(char *str)
+{
+    while (isspace((unsigned char) *str))
+    {
+        str++;
+    }
+
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char) end[-1]))
+    {
+        *--end = '\0';
+    }
+
+    return str;
+}
+
+// Looks up the size of a partition in an ESP-IDF partition table
+static bool partition_size(const char *table, const char *label, size_t *size)
+{
+    FILE *f = fopen(table, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", table, strerror(errno));
+        return false;
+    }
+
+    char line[256];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f))
+    {
+        char *hash = strchr(line, '#');
+        if (hash)
+        {
+            *hash = '\0';
+        }
+
+        // Name, Type, SubType, Offset, Size, Flags
+        char *fields[6] = {};
+        char *next = line;
+        for (int i = 0; i < 6 && next; i++)
+        {
+            fields[i] = next;
+            next = strchr(next, ',');
+            if (next)
+            {
+                *next++ = '\0';
+            }
+            fields[i] = trim(fields[i]);
+        }
+
+        if (fields[4] && strcmp(fields[0], label) == 0)
+        {
+            found = parse_size(fields[4], size);
+            if (!found)
+            {
+                fprintf(stderr, "%s: bad size for partition '%s'\n", table, label);
+                break;
+            }
+        }
+    }
+
+    if (!found && !ferror(f))
+    {
+        fprintf(stderr, "%s: partition '%s' not found\n", table, label);
+    }
+
+    fclose(f);
+
+    return found;
+}
+
+static bool compressed(const char *path)
+{
+    return compress_prefix &&
+           strncmp(path, compress_prefix, zprefix_len) == 0 &&
+           (path[zprefix_len] == '\0' || path[zprefix_len] == '/');
+}
+
+static int count_block(void *data, lfs_block_t block)
+{
+    (*(lfs_size_t *) data)++;
+
+    return 0;
+}
+
+// ============================================================================
+// Packing
+// ============================================================================
+
+static int pack_file(lfs_t *lfs, const std::string &host, const std::string &path)
+{
+    FILE *in = fopen(host.c_str(), "rb");
+    if (in == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", host.c_str(), strerror(errno));
+        return -1;
+    }
+
+    lfs_file_t file;
+    int err = lfs_file_open(lfs, &file, path.c_str(), LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err < 0)
+    {
+        fprintf(stderr, "%s: unable to create (%d)\n", path.c_str(), err);
+        fclose(in);
+        return -1;
+    }
+
+    bool compress = compressed(path.c_str());
+
+    size_t len;
+    while (err >= 0 && (len = fread(raw, 1, sizeof(raw), in)) > 0)
+    {
+        if (!compress)
+        {
+            err = lfs_file_write(lfs, &file, raw, len);
+            continue;
+        }
+
+        size_t stored_len = little_lz_compress(raw, len, zbuf + COMPRESS_HDR, len - 1, zhtab);
+        if (stored_len == 0)
+        {
+            memcpy(zbuf + COMPRESS_HDR, raw, len);
+            stored_len = len;
+        }
+
+        zbuf[0] = len;
+        zbuf[1] = len >> 8;
+        zbuf[2] = stored_len;
+        zbuf[3] = stored_len >> 8;
+
+        err = lfs_file_write(lfs, &file, zbuf, COMPRESS_HDR + stored_len);
+    }
+
+    if (ferror(in))
+    {
+        fprintf(stderr, "%s: %s\n", host.c_str(), strerror(errno));
+        err = LFS_ERR_IO;
+    }
+    fclose(in);
+
+    int cerr = lfs_file_close(lfs, &file);
+    if (err >= 0)
+    {
+        err = cerr;
+    }
+
+    if (err < 0)
+    {
+        fprintf(stderr, "%s: write failed (%d)%s\n",
+                path.c_str(),
+                err,
+                err == LFS_ERR_NOSPC ? ", image is full" : "");
+        return -1;
+    }
+
+    files++;
+
+    return 0;
+}
+
+static int pack_dir(lfs_t *lfs, const std::string &host, const std::string &path)
+{
+    DIR *dir = opendir(host.c_str());
+    if (dir == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", host.c_str(), strerror(errno));
+        return -1;
+    }
+
+    dirs++;
+
+    int err = 0;
+    struct dirent *de;
+    while (err == 0 && (de = readdir(dir)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        std::string hchild = host + "/" + de->d_name;
+        std::string child = path + "/" + de->d_name;
+
+        struct stat st;
+        if (stat(hchild.c_str(), &st) < 0)
+        {
+            fprintf(stderr, "%s: %s\n", hchild.c_str(), strerror(errno));
+            err = -1;
+        }
+        else if (S_ISDIR(st.st_mode))
+        {
+            int lerr = lfs_mkdir(lfs, child.c_str());
+            if (lerr < 0)
+            {
+                fprintf(stderr, "%s: unable to create (%d)\n", child.c_str(), lerr);
+                err = -1;
+            }
+            else
+            {
+                err = pack_dir(lfs, hchild, child);
+            }
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            err = pack_file(lfs, hchild, child);
+        }
+        else
+        {
+            fprintf(stderr, "%s: skipping, not a file or directory\n", hchild.c_str());
+        }
+    }
+
+    closedir(dir);
+
+    return err;
+}
+
+// ============================================================================
+// Unpacking
+// ============================================================================
+
+static int unpack_file(lfs_t *lfs, const std::string &path, const std::string &host)
+{
+    lfs_file_t file;
+    int err = lfs_file_open(lfs, &file, path.c_str(), LFS_O_RDONLY);
+    if (err < 0)
+    {
+        fprintf(stderr, "%s: unable to open (%d)\n", path.c_str(), err);
+        return -1;
+    }
+
+    FILE *out = fopen(host.c_str(), "wb");
+    if (out == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", host.c_str(), strerror(errno));
+        lfs_file_close(lfs, &file);
+        return -1;
+    }
+
+    bool compress = compressed(path.c_str());
+
+    while (true)
+    {
+        lfs_ssize_t len;
+        if (!compress)
+        {
+            len = lfs_file_read(lfs, &file, raw, sizeof(raw));
+        }
+        else
+        {
+            len = lfs_file_read(lfs, &file, zbuf, COMPRESS_HDR);
+            if (len == COMPRESS_HDR)
+            {
+                size_t raw_len = zbuf[0] | (zbuf[1] << 8);
+                size_t stored_len = zbuf[2] | (zbuf[3] << 8);
+                if (raw_len == 0 || raw_len > COMPRESS_CHUNK || stored_len == 0 || stored_len > raw_len)
+                {
+                    len = LFS_ERR_CORRUPT;
+                }
+                else
+                {
+                    uint8_t *dst = stored_len == raw_len ? raw : zbuf;
+                    len = lfs_file_read(lfs, &file, dst, stored_len);
+                    if (len >= 0 && (size_t) len != stored_len)
+                    {
+                        len = LFS_ERR_CORRUPT;
+                    }
+                    else if (len >= 0 && dst == zbuf)
+                    {
+                        len = little_lz_decompress(zbuf, stored_len, raw, raw_len);
+                        if ((size_t) len != raw_len)
+                        {
+                            len = LFS_ERR_CORRUPT;
+                        }
+                    }
+                }
+            }
+            else if (len > 0)
+            {
+                len = LFS_ERR_CORRUPT;
+            }
+        }
+
+        if (len <= 0)
+        {
+            err = len;
+            break;
+        }
+
+        if (fwrite(raw, 1, len, out) != (size_t) len)
+        {
+            fprintf(stderr, "%s: %s\n", host.c_str(), strerror(errno));
+            err = LFS_ERR_IO;
+            break;
+        }
+    }
+
+    lfs_file_close(lfs, &file);
+
+    if (fclose(out) != 0 && err == 0)
+    {
+        fprintf(stderr, "%s: %s\n", host.c_str(), strerror(errno));
+        err = LFS_ERR_IO;
+    }
+
+    if (err < 0)
+    {
+        fprintf(stderr, "%s: read failed (%d)\n", path.c_str(), err);
+        return -1;
+    }
+
+    files++;
+
+    return 0;
+}
+
+static int unpack_dir(lfs_t *lfs, const std::string &path, const std::string &host)
+{
+    if (mkdir(host.c_str(), 0777) < 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "%s: %s\n", host.c_str(), strerror(errno));
+        return -1;
+    }
+
+    lfs_dir_t dir;
+    int err = lfs_dir_open(lfs, &dir, path.empty() ? "/" : path.c_str());
+    if (err < 0)
+    {
+        fprintf(stderr, "%s: unable to open (%d)\n", path.empty() ? "/" : path.c_str(), err);
+        return -1;
+    }
+
+    dirs++;
+
+    err = 0;
+
+    struct lfs_info info;
+    int res;
+    while ((res = lfs_dir_read(lfs, &dir, &info)) > 0)
+    {
+        if (strcmp(info.name, ".") == 0 || strcmp(info.name, "..") == 0)
+        {
+            continue;
+        }
+
+        std::string child = path + "/" + info.name;
+        std::string hchild = host + "/" + info.name;
+
+        if (info.type == LFS_TYPE_DIR)
+        {
+            err = unpack_dir(lfs, child, hchild);
+        }
+        else
+        {
+            err = unpack_file(lfs, child, hchild);
+        }
+
+        if (err < 0)
+        {
+            break;
+        }
+    }
+
+    lfs_dir_close(lfs, &dir);
+
+    if (res < 0)
+    {
+        fprintf(stderr, "%s: read failed (%d)\n", path.empty() ? "/" : path.c_str(), res);
+        err = -1;
+    }
+
+    return err;
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+int main(int argc, char **argv)
+{
+    const char *table = NULL;
+    const char *label = "littlefs";
+    size_t block_size = 4096;
+
+    prog_name = argv[0];
+
+    if (argc < 2)
+    {
+        usage();
+    }
+
+    const char *cmd = argv[1];
+    bool create = strcmp(cmd, "create") == 0;
+    if (!create && strcmp(cmd, "unpack") != 0)
+    {
+        usage();
+    }
+
+    optind = 2;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:l:s:b:z:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                table = optarg;
+            break;
+            case 'l':
+                label = optarg;
+            break;
+            case 's':
+                if (!parse_size(optarg, &image_size))
+                {
+                    usage();
+                }
+            break;
+            case 'b':
+                if (!parse_size(optarg, &block_size))
+                {
+                    usage();
+                }
+            break;
+            case 'z':
+                compress_prefix = optarg;
+            break;
+            default:
+                usage();
+            break;
+        }
+    }
+
+    if (argc - optind != 2)
+    {
+        usage();
+    }
+
+    const char *src = argv[optind];
+    const char *dst = argv[optind + 1];
+
+    if (compress_prefix)
+    {
+        zprefix_len = strlen(compress_prefix);
+        while (zprefix_len > 0 && compress_prefix[zprefix_len - 1] == '/')
+        {
+            zprefix_len--;
+        }
+    }
+
+    if (table && !partition_size(table, label, &image_size))
+    {
+        return 1;
+    }
+
+    // Unpacking can take the size from the image itself
+    FILE *f = NULL;
+    if (!create)
+    {
+        f = fopen(src, "rb");
+        if (f == NULL)
+        {
+            fprintf(stderr, "%s: %s\n", src, strerror(errno));
+            return 1;
+        }
+
+        if (image_size == 0)
+        {
+            fseek(f, 0, SEEK_END);
+            image_size = ftell(f);
+            fseek(f, 0, SEEK_SET);
+        }
+    }
+
+    if (image_size == 0 || block_size == 0 || image_size % block_size != 0 || image_size / block_size < 2)
+    {
+        fprintf(stderr, "%s: image size must be a multiple of the block size, use -t or -s\n", prog_name);
+        return 1;
+    }
+
+    image = (uint8_t *) malloc(image_size);
+    if (image == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", prog_name);
+        return 1;
+    }
+    memset(image, 0xff, image_size);
+
+    if (f)
+    {
+        size_t len = fread(image, 1, image_size, f);
+        fclose(f);
+        if (len != image_size)
+        {
+            fprintf(stderr, "%s: image is smaller than %zu bytes\n", src, image_size);
+            return 1;
+        }
+    }
+
+    // Same geometry as LittleFlash::init()
+    struct lfs_config cfg = {};
+    cfg.read  = &image_read;
+    cfg.prog  = &image_prog;
+    cfg.erase = &image_erase;
+    cfg.sync  = &image_sync;
+    cfg.read_size   = block_size;
+    cfg.prog_size   = block_size;
+    cfg.block_size  = block_size;
+    cfg.block_count = image_size / block_size;
+    cfg.lookahead   = (cfg.block_count + 31) / 32 * 32;
+
+    lfs_t lfs;
+    int err;
+    if (create)
+    {
+        err = lfs_format(&lfs, &cfg);
+        if (err < 0)
+        {
+            fprintf(stderr, "%s: format failed (%d)\n", dst, err);
+            return 1;
+        }
+    }
+
+    err = lfs_mount(&lfs, &cfg);
+    if (err < 0)
+    {
+        fprintf(stderr, "%s: not a LittleFS image (%d)\n", create ? dst : src, err);
+        return 1;
+    }
+
+    if (create)
+    {
+        err = pack_dir(&lfs, src, "");
+    }
+    else
+    {
+        err = unpack_dir(&lfs, "", dst);
+    }
+
+    lfs_size_t used = 0;
+    if (err == 0)
+    {
+        lfs_traverse(&lfs, count_block, &used);
+    }
+
+    lfs_unmount(&lfs);
+
+    if (err < 0)
+    {
+        return 1;
+    }
+
+    if (create)
+    {
+        f = fopen(dst, "wb");
+        if (f == NULL || fwrite(image, 1, image_size, f) != image_size || fclose(f) != 0)
+        {
+            fprintf(stderr, "%s: %s\n", dst, strerror(errno));
+            return 1;
+        }
+    }
+
+    printf("%s: %d files, %d directories, %u of %u blocks used\n",
+           create ? dst : src,
+           files,
+           dirs,
+           (unsigned) used,
+           (unsigned) cfg.block_count);
+
+    free(image);
+
+    return 0;
+}